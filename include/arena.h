@@ -0,0 +1,45 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+// Taille des pages demandées au système
+#define ARENA_PAGE (64*1024)
+// Classes de taille: 32, 64, ..., 2048 octets. Au-delà on passe par malloc.
+#define ARENA_MIN_SHIFT 5
+#define ARENA_CLASSES   7
+#define ARENA_MAX       (1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+
+/**
+ * @brief Allocateur de petits blocs par classes de taille
+ * @details Les blocs sont découpés dans de grandes pages, et un bloc libéré
+ * part dans la liste libre de sa classe pour être réutilisé en O(1).
+ * Aucune entête par bloc: c'est l'appelant qui redonne la taille à
+ * arena_free (pour la DHT, strlen+1 de la chaîne).
+ *
+ * Pas de mutex: l'arène appartient à la DHT et n'est touchée que sous la
+ * mutex de celle-ci.
+ */
+typedef struct s_arena {
+	// Pages allouées (libérées par arena_destroy)
+	void** pages;
+	unsigned int npages;
+	// Reste de la page courante
+	char* cur;
+	size_t left;
+	// Une liste libre par classe, chaînée dans les blocs eux-mêmes
+	void* freelist[ARENA_CLASSES];
+
+	// Statistiques d'occupation
+	size_t used;     // octets servis (arrondis à la classe)
+	size_t reserved; // octets des pages
+	size_t big;      // octets servis directement par malloc
+} arena;
+
+void arena_init(arena* a);
+void* arena_alloc(arena* a, size_t size);
+void arena_free(arena* a, void* p, size_t size);
+char* arena_strdup(arena* a, const char* str);
+void arena_destroy(arena* a);
+
+#endif
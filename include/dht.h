@@ -0,0 +1,416 @@
+#ifndef __DHT_H__
+#define __DHT_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+// cf wal.h
+struct s_wal;
+
+// cf dht_lookup, dht_update et garbage_collector
+#ifndef HASH_DEPRECATION_TIME
+	#define HASH_DEPRECATION_TIME 30
+#endif
+
+#ifndef GARBAGE_COL_TIME
+	#define GARBAGE_COL_TIME 300
+#endif
+
+// Roue temporelle des expirations: une case par seconde (puissance de 2,
+// idéalement > GARBAGE_COL_TIME pour qu'une case ne mélange pas les tours)
+#ifndef DHT_WHEEL_SLOTS
+	#define DHT_WHEEL_SLOTS 512
+#endif
+
+// Entrées examinées par le garbage collector à chaque prise d'un verrou
+#ifndef DHT_GC_SLICE
+	#define DHT_GC_SLICE 256
+#endif
+
+// Taille initiale (et minimale) de htable dans une partition
+#define DHT_TABLE_MIN 512
+
+// Grande page (cf dht_hugepages): les tableaux plus petits restent sur le tas
+#ifndef DHT_HUGE_PAGE
+	#define DHT_HUGE_PAGE (2*1024*1024)
+#endif
+
+// Taille initiale de l'index d'une partition (puissance de 2)
+#define DHT_INDEX_MIN 1024
+
+// Nombre de partitions = 2^DHT_SHARD_BITS
+#ifndef DHT_SHARD_BITS
+	#define DHT_SHARD_BITS 4
+#endif
+#define DHT_SHARDS (1 << DHT_SHARD_BITS)
+
+// Condensé de la DHT (cf dht_digest): 16^3 seaux, feuilles d'un arbre de
+// Merkle d'arité 16. Chaque partition a ses propres seaux.
+#define DHT_DIGEST_FANOUT 16
+#define DHT_DIGEST_LEVELS 3
+#define DHT_DIGEST_BITS 12
+#define DHT_DIGEST_BUCKETS (1 << DHT_DIGEST_BITS)
+
+// Formats de clé (hash.kfmt). 0 = entrée libre dans htable
+#define KEY_FREE   0
+#define KEY_SHA256 1 // 64 caractères hexa minuscules, stockée en binaire
+#define KEY_SHORT  2 // <= DHT_KEY_BIN octets, stockée telle quelle
+#define KEY_LONG   3 // c string sur le tas (key.ext)
+
+// Formats d'adresse (hash.afmt)
+#define ADDR_V6    1 // IPv6 sous forme canonique, stockée en binaire
+#define ADDR_V4    2 // IPv4 stockée en v4-mapped (::ffff:a.b.c.d)
+#define ADDR_SHORT 3 // <= DHT_ADDR_BIN octets, stockée telle quelle
+#define ADDR_LONG  4 // c string sur le tas (addr.ext)
+
+#define DHT_KEY_BIN  32
+#define DHT_ADDR_BIN 16
+// Taille des buffers pour dht_keystr/dht_ipstr (hors formats *_LONG)
+#define DHT_KEY_STRLEN  (2*DHT_KEY_BIN+1)
+#define DHT_ADDR_STRLEN INET6_ADDRSTRLEN
+
+/**
+ * Une entrée de la DHT: 64 octets, soit une ligne de cache.
+ *
+ * La clé est presque toujours un SHA-256 en hexa (64 caractères): on la stocke
+ * sous forme de 32 octets binaires. L'IP est stockée en in6_addr. Les
+ * comparaisons sont des memcmp de taille fixe et il n'y a plus aucune
+ * allocation par entrée, sauf pour les clés/adresses qui ne rentrent pas
+ * dans la forme binaire (cf KEY_LONG, ADDR_LONG).
+ *
+ * Le texte d'origine est toujours restituable à l'identique: une clé en hexa
+ * majuscule ou une IPv6 non canonique passent par les formats texte.
+ */
+typedef struct s_hash {
+	union {
+		uint8_t bin[DHT_KEY_BIN];
+		char* ext;
+	} key;
+	union {
+		uint8_t bin[DHT_ADDR_BIN];
+		char* ext;
+	} addr;
+	long int time; // timestamp de la dernière mise à jour, 0 = entrée retirée
+	// Entrée suivante ayant la même clé (indice+1 dans htable, 0 = fin)
+	uint32_t next;
+	uint8_t kfmt;
+	uint8_t klen; // longueur du texte pour KEY_SHORT
+	uint8_t afmt;
+	uint8_t alen; // longueur du texte pour ADDR_SHORT
+} hash;
+
+/**
+ * Clé ou adresse encodée, telle que recherchée dans la DHT
+ */
+typedef struct s_hkey {
+	union {
+		uint8_t bin[DHT_KEY_BIN];
+		char* ext;
+	};
+	uint8_t fmt;
+	uint8_t len;
+	uint32_t code; // code de hachage (clés seulement)
+} hkey;
+
+/**
+ * Case de l'index: 8 octets, 8 cases par ligne de cache.
+ * Le code de hachage est stocké à côté de la tête de chaîne pour que le
+ * sondage ne touche htable qu'en cas de collision probable.
+ */
+typedef struct s_slot {
+	uint32_t code;
+	// Première entrée de la chaîne (indice+1 dans htable)
+	// 0 = case vide, DHT_TOMBSTONE = case supprimée
+	uint32_t head;
+} slot;
+
+#define DHT_TOMBSTONE UINT32_MAX
+
+/**
+ * Bloc (ancien tableau ou ancien index) retiré par un rédacteur, libéré quand
+ * plus aucun lecteur ne peut le voir (cf dht_read_begin)
+ */
+typedef struct s_retired {
+	void* ptr;
+	// 0 pour un bloc du tas, taille de la projection sinon (cf table_alloc)
+	size_t len;
+	uint32_t epoch;
+	struct s_retired* next;
+} dht_retired;
+
+/**
+ * Lecteur de la DHT: un par thread, enregistré au premier dht_read_begin
+ */
+typedef struct s_dht_reader {
+	// Epoque lue à l'entrée en section de lecture, 0 hors section
+	uint32_t epoch;
+	// Sections imbriquées
+	int depth;
+	struct s_dht_reader* next;
+} dht_reader;
+
+/**
+ * Maillon d'une liste circulaire doublement chaînée de la roue temporelle.
+ * Les DHT_WHEEL_SLOTS+2 premiers maillons sont les sentinelles des cases, de
+ * la liste en cours de traitement et de la liste libre; le maillon de l'entrée
+ * i de htable est DHT_WHEEL_SLOTS+2+i: hash reste à 64 octets.
+ *
+ * Un emplacement libre est dans la liste libre, d'où le compacteur peut le
+ * retirer en O(1) quel que soit son rang.
+ *
+ * Une entrée retirée n'est plus dans la roue: son maillon la chaîne dans la
+ * liste des entrées en attente de libération (prev = époque du retrait,
+ * next = entrée suivante, indice+1, et TLINK_MOVED si l'entrée a été
+ * déplacée par le compacteur).
+ */
+typedef struct s_tlink {
+	uint32_t prev;
+	uint32_t next;
+} tlink;
+
+// Entrée déplacée: sa copie a repris ses chaînes KEY_LONG/ADDR_LONG
+#define TLINK_MOVED 0x80000000u
+
+/**
+ * @brief La structure de la DHT
+ * @details
+ *
+ * # Le tableau continu
+ *
+ * Ma DHT est un tableau continu de hashs, façon FAT32
+ *
+ * J'ai opté pour ne pas utiliser de liste chainée.
+ * Les listes chainées ont des
+ * performances abominables chez moi. Chaque hash est à un emplacement
+ * différent dans la mémoire, or j'alloue de gros buffers assez régulièrement p
+ * our récupérer et réceptionner des paquets ce qui force les maillons de mes
+ * chaines à être espacés dans la mémoire de plusieurs KO.
+ * Le cache trashing est énorme.
+ *
+ * Le compilateur gère également beaucoup mieux les tableaux contigus (voire la
+ * différence de performances en -O3)
+ *
+ * Le tableau sert de slab: toutes les entrées font la même taille, et les
+ * emplacements libérés par le garbage collector sont chaînés dans une liste
+ * libre (via leur tlink) pour être réutilisés en O(1) par dht_add.
+ * Les rares chaînes qui ne tiennent pas dans une entrée (KEY_LONG,
+ * ADDR_LONG) sont découpées dans l'arène de la DHT, jamais dans le tas.
+ *
+ * # L'index
+ *
+ * Par-dessus le tableau, une table de hachage à adressage ouvert (sondage
+ * linéaire) associe chaque clé à la première entrée de htable qui la porte.
+ * Les entrées d'une même clé (une par IP) sont chaînées entre elles par
+ * indices via hash.next; on ne touche donc jamais aux entrées des autres clés.
+ *
+ * Les suppressions laissent des tombstones qui sont purgées au prochain
+ * redimensionnement de l'index.
+ *
+ * # Les expirations
+ *
+ * Chaque entrée est rangée dans la case de la roue temporelle correspondant à
+ * la seconde de son expiration (time + GARBAGE_COL_TIME), et déplacée en O(1)
+ * quand un PUT la rafraîchit. A chaque seconde, le garbage collector ne
+ * visite que les cases échues, pas la table: il ne libère que ce qui est dû,
+ * et relâche le verrou de la partition toutes les DHT_GC_SLICE entrées pour
+ * laisser passer les requêtes.
+ *
+ * # Le compactage
+ *
+ * Après une vague d'expirations, le garbage collector referme les trous:
+ * quand plus d'un quart des emplacements sous le cursor sont libres, les
+ * entrées du haut du tableau sont recopiées dans les trous du bas (cf
+ * entry_move), par tranches de DHT_GC_SLICE emplacements. Les emplacements
+ * libres en fin de tableau sont rendus (le cursor redescend), et le tableau
+ * est remplacé par un plus petit quand il est occupé à moins d'un quart.
+ *
+ * # Les lectures sans verrou
+ *
+ * GET ne prend aucun verrou: il suit l'index et les chaînes avec des lectures
+ * atomiques, et les rédacteurs publient chaque modification par une écriture
+ * atomique, une fois l'entrée complète.
+ *
+ * Rien de ce qu'un lecteur a pu voir n'est libéré ou réutilisé sous ses yeux
+ * (reclamation par époques): une entrée retirée garde son contenu et ses
+ * liens et attend dans une liste de la partition, un tableau ou un index
+ * remplacé attend dans la liste retired. Le garbage collector ne les libère
+ * qu'une fois que tous les lecteurs en section (cf dht_read_begin) sont entrés
+ * après le retrait.
+ *
+ * # Les partitions et la concurrence
+ *
+ * La DHT est découpée en DHT_SHARDS partitions indépendantes (tableau, index,
+ * liste libre, arène), choisies par les bits de poids fort du code de
+ * hachage de la clé (l'index d'une partition utilise les bits de poids
+ * faible).
+ *
+ * Chaque partition a son propre verrou lecteurs/rédacteur, pris en écriture
+ * par PUT et le garbage collector, et en lecture par les parcours complets
+ * (dht_foreach, dht_getstats). Les GET ne le prennent pas.
+ *
+ * # Le condensé
+ *
+ * Les DHT_DIGEST_BITS bits de poids fort du code de hachage de la clé
+ * choisissent un seau (donc toujours dans la même partition). Chaque seau
+ * garde le XOR d'un hash 64 bits de chacun de ses tuples (clé, adresse, sans
+ * le timestamp): un ajout ou une expiration le met à jour en O(1), sous le
+ * verrou de la partition. Deux serveurs qui ont les mêmes tuples ont les
+ * mêmes seaux, et un noeud de l'arbre de Merkle est le XOR des seaux qu'il
+ * couvre (cf sync_repair).
+ *
+ * Impossible de stocker un verrou par hash; il faudrait vérifier que le verrou
+ * existe avant de le prendre ce qui n'est pas atomique et rendrait le
+ * programme non-déterministe
+ */
+typedef struct s_dht_shard {
+	// Gros tableau dynamique
+	// Remplacé (et non réalloué) quand il grandit ou rétrécit, cf slot_alloc
+	// et shard_shrink
+	hash* htable;
+	// indique le dernier hash plein (mis à jour aux appels de dht_add qui
+	// rajoutent un hash en fin de table, et par le compactage)
+	unsigned int cursor;
+	// taille allouée pour htable (en unités)
+	unsigned int size;
+	// htable ne rétrécit pas en dessous (cf dht_reserve)
+	unsigned int minsize;
+	// Gros tableaux en grandes pages (cf dht_hugepages)
+	int huge;
+	// Entrées occupées
+	unsigned int count;
+
+	// Stockage des chaînes KEY_LONG/ADDR_LONG
+	arena strings;
+
+	// Index clé -> première entrée
+	// index[-1].code contient le nombre de cases, pour les lecteurs qui ne
+	// lisent pas isize (cf index_alloc)
+	slot* index;
+	// Nombre de cases de l'index (puissance de 2)
+	unsigned int isize;
+	// Cases occupées, tombstones comprises
+	unsigned int iused;
+	// Clés distinctes (cases vivantes de l'index)
+	unsigned int keys;
+
+	// Roue temporelle et liste libre: DHT_WHEEL_SLOTS+2 sentinelles puis un
+	// maillon par emplacement de htable (cf tlink)
+	tlink* timers;
+	// Dernière seconde traitée par le garbage collector
+	long int wheel_now;
+
+	// Condensé des tuples de chaque seau de la partition (cf dht_digest)
+	uint64_t digest[DHT_DIGEST_BUCKETS >> DHT_SHARD_BITS];
+
+	// Entrées retirées en attente de libération (indice+1, cf tlink)
+	uint32_t limbo;
+	uint32_t limbo_tail;
+	// Blocs remplacés en attente de libération
+	dht_retired* retired;
+	// Epoque courante de la DHT (dht.epoch)
+	uint32_t* epoch;
+
+	// En lecture pour GET, en écriture pour PUT et le garbage collector
+	pthread_rwlock_t lock;
+} dht_shard;
+
+typedef struct s_dht {
+	dht_shard shards[DHT_SHARDS];
+
+	// Epoque courante, avancée par le garbage collector (cf dht_read_begin)
+	uint32_t epoch;
+	// Lecteurs enregistrés
+	dht_reader* readers;
+
+	// Journal des PUT, NULL si pas de journal (cf wal_append)
+	struct s_wal* wal;
+
+	// Passe à 1 à l'ajout du premier hash (cf dht_started)
+	int started;
+	// Passe à 1 dans dht_free: le garbage collector s'arrête
+	int stopping;
+	// Tenue par le garbage collector pendant un passage. Il attend sur
+	// gc_wake le premier hash, puis une seconde entre deux passages
+	pthread_mutex_t gc;
+	pthread_cond_t gc_wake;
+} dht;
+
+// IPs copiées au plus par dht_lookup
+#ifndef DHT_RESULT_MAX
+	#define DHT_RESULT_MAX 64
+#endif
+
+/**
+ * Résultat d'un GET (cf dht_lookup): une copie des IPs d'une clé, qui ne
+ * dépend plus de la DHT
+ */
+typedef struct s_dht_result {
+	// IPs copiées
+	unsigned int count;
+	// 0, ou position de la première IP qui n'a pas été copiée faute de place
+	uint32_t next;
+	// IPs (hkey.ext pointe dans text pour ADDR_LONG)
+	hkey addrs[DHT_RESULT_MAX];
+	char text[DHT_RESULT_MAX * DHT_ADDR_STRLEN];
+} dht_result;
+
+// Tuples insérés au plus par dht_updatev
+#ifndef DHT_TUPLE_MAX
+	#define DHT_TUPLE_MAX 256
+#endif
+
+/**
+ * Un tuple à insérer, cf dht_updatev
+ */
+typedef struct s_dht_tuple {
+	hkey key;
+	hkey addr;
+	long int time;
+} dht_tuple;
+
+/**
+ * Occupation de la DHT, cf dht_stats
+ */
+typedef struct s_dht_stats {
+	unsigned int entries;  // entrées occupées
+	unsigned int slots;    // emplacements sous le cursor (occupés ou libres)
+	unsigned int capacity; // emplacements alloués
+	unsigned int keys;     // clés distinctes
+	unsigned int isize;    // cases de l'index
+	size_t table_bytes;    // htable + index + roue temporelle
+	size_t arena_used;     // octets servis par l'arène
+	size_t arena_reserved; // octets des pages de l'arène
+	size_t arena_big;      // octets hors classes de l'arène (malloc)
+} dht_stats;
+
+int dht_init(dht* d);
+int dht_hugepages(dht* d);
+int dht_reserve(dht* d, unsigned int entries);
+void dht_free(dht* d);
+hash* dht_getWithIP(dht* d, char* h, char* ip);
+void dht_read_begin(dht* d);
+void dht_read_end(dht* d);
+int dht_lookup(dht* d, char* h, uint32_t from, dht_result* r);
+int dht_lookupk(dht* d, const hkey* k, uint32_t from, dht_result* r);
+int dht_add(dht* d, char* h, char* ip);
+int dht_update(dht* d, char* h, char* ip, char* t);
+int dht_updatek(dht* d, const hkey* k, const hkey* a, long t);
+int dht_updatev(dht* d, const dht_tuple* v, int n);
+void dht_getstats(dht* d, dht_stats* st);
+int dht_foreach(dht* d, int (*fn)(hash* e, void* arg), void* arg);
+int dht_foreach_shard(dht* d, int n, int (*fn)(hash* e, void* arg), 
+					  void* arg);
+long dht_save(dht* d, const char* path);
+void dht_digest(dht* d, uint64_t* leaves);
+uint32_t dht_bucket(const hash* e);
+long dht_load(dht* d, const char* path);
+void* garbage_collector(void* param);
+
+// Codecs des clés et adresses, partagés avec libdhtclient
+#include "keyenc.h"
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef __DHTCLIENT_H__
+#define __DHTCLIENT_H__
+
+// En premier: net.h définit _GNU_SOURCE (struct mmsghdr). Un programme qui
+// inclut d'autres entêtes avant celui-ci compile avec -D_GNU_SOURCE
+#include "net.h"
+#include "dht.h"
+#include "proto.h"
+#include "ring.h"
+
+#include <stdint.h>
+
+// Requêtes en vol au plus par client (puissance de 2: l'indice de la requête
+// est dans les bits de poids faible de son id)
+#ifndef DHTCLIENT_INFLIGHT
+	#define DHTCLIENT_INFLIGHT 256
+#endif
+
+// Attente d'une réponse avant de renvoyer une requête (ms), nombre d'envois
+// supplémentaires avant d'abandonner
+#ifndef DHTCLIENT_TIMEOUT
+	#define DHTCLIENT_TIMEOUT 1000
+#endif
+#ifndef DHTCLIENT_RETRIES
+	#define DHTCLIENT_RETRIES 3
+#endif
+
+// Plus grosse requête encodée: entête, clé et adresse texte, position
+#define DHTCLIENT_REQUEST (PROTO_HEADER + 2 * (PROTO_VARINT_MAX + 256) + \
+						   PROTO_VARINT_MAX)
+
+// Issue d'une requête, passée à son rappel
+enum e_dhtclient_status {
+	DHTCLIENT_OK,       // terminée (dernière page d'un GET)
+	DHTCLIENT_MORE,     // une page d'un GET, d'autres suivront
+	DHTCLIENT_NOANSWER, // pas de réponse après DHTCLIENT_RETRIES renvois
+	DHTCLIENT_ERROR     // réponse invalide, trop de redirections
+};
+
+/**
+ * @brief Rappel d'une requête
+ *
+ * @param arg argument donné avec la requête
+ * @param status cf e_dhtclient_status
+ * @param addrs adresses d'une page (GET), valables le temps du rappel
+ * (cf proto_addrstr)
+ * @param count nombre d'adresses, 0 pour un PUT
+ */
+typedef void (*dhtclient_cb)(void* arg, int status, const hkey* addrs,
+							 int count);
+
+/**
+ * Une requête en vol
+ */
+typedef struct s_dhtclient_req {
+	int busy;
+	uint32_t id;
+	uint8_t op;
+	// Code de la clé, pour trouver ses propriétaires (cf ring_owners)
+	uint32_t code;
+	// GET: position de la page demandée
+	uint32_t from;
+	// Renvois et redirections déjà faits
+	int tries;
+	int moves;
+	// Instant (ms) du prochain renvoi
+	long deadline;
+	dhtclient_cb cb;
+	void* arg;
+	// Requête encodée, renvoyée telle quelle
+	int len;
+	uint8_t buf[DHTCLIENT_REQUEST];
+} dhtclient_req;
+
+/**
+ * @brief Client de la DHT, réutilisable (libdhtclient)
+ * @details
+ *
+ * Une seule socket, ouverte par dhtclient_open, pour toutes les requêtes.
+ * Chacune porte un id (cf proto.h) qui désigne son emplacement dans reqs:
+ * jusqu'à DHTCLIENT_INFLIGHT requêtes attendent leur réponse en même temps,
+ * dans n'importe quel ordre. Une requête sans réponse au bout de timeout ms
+ * est renvoyée, au plus retries fois, puis son rappel reçoit
+ * DHTCLIENT_NOANSWER.
+ *
+ * Les envois sont mis en attente dans un lot (cf netqueue) et partent en un
+ * appel système, au plus tard au prochain dhtclient_poll. Les réponses sont
+ * lues par lots (cf netlisten_batch) et les rappels appelés depuis
+ * dhtclient_poll.
+ *
+ * Un PUT est acquitté par un OP_END. Un GET reçoit ses adresses page par
+ * page: le client demande lui-même les suivantes, le rappel est appelé une
+ * fois par page. En mode anneau (cf ring.h), l'anneau demandé à
+ * l'ouverture (OP_RING), ou reçu dans un OP_MOVED, est gardé: les requêtes
+ * partent directement chez le propriétaire de leur clé, puis chez les
+ * autres propriétaires à chaque renvoi.
+ *
+ * Deux interfaces:
+ * - asynchrone: dhtclient_get et dhtclient_put rendent la main de suite (sauf
+ *   si DHTCLIENT_INFLIGHT requêtes sont déjà en vol), dhtclient_poll appelle
+ *   les rappels des réponses arrivées
+ * - bloquante: dhtclient_get_wait et dhtclient_put_wait attendent la fin de
+ *   leur requête. Les rappels des autres requêtes en vol sont appelés
+ *   pendant ce temps.
+ *
+ * Un client n'est pas partagé entre threads. Les fonctions qui attendent
+ * (_wait, dhtclient_poll) ne doivent pas être appelées depuis un rappel. Un
+ * rappel peut envoyer une requête, sauf DHTCLIENT_MORE quand toutes les
+ * requêtes sont en vol (la fin d'une requête libère son emplacement avant
+ * son rappel).
+ */
+typedef struct s_dhtclient {
+	nethandle net;
+	netbatch batch;
+	// Serveur donné à dhtclient_open
+	struct sockaddr_in6 server;
+	// Anneau reçu dans un OP_MOVED, NULL avant
+	ring* ring;
+	int timeout;
+	int retries;
+	uint32_t seq;
+	dhtclient_req* reqs;
+	// Emplacements libres de reqs
+	int free[DHTCLIENT_INFLIGHT];
+	int nb_free;
+	// dhtclient_poll est en train d'appeler des rappels
+	int polling;
+} dhtclient;
+
+DHT_EXPORT int dhtclient_open(dhtclient* c, char* host, char* port);
+DHT_EXPORT void dhtclient_close(dhtclient* c);
+DHT_EXPORT int dhtclient_get(dhtclient* c, const hkey* k, dhtclient_cb cb,
+							 void* arg);
+DHT_EXPORT int dhtclient_put(dhtclient* c, const hkey* k, const hkey* a,
+							 dhtclient_cb cb, void* arg);
+DHT_EXPORT int dhtclient_poll(dhtclient* c, int ms);
+DHT_EXPORT int dhtclient_wait(dhtclient* c);
+DHT_EXPORT int dhtclient_pending(const dhtclient* c);
+DHT_EXPORT int dhtclient_get_wait(dhtclient* c, const hkey* k,
+								  char (*ips)[DHT_ADDR_STRLEN], int max);
+DHT_EXPORT int dhtclient_put_wait(dhtclient* c, const hkey* k, const hkey* a);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __KEYENC_H__
+#define __KEYENC_H__
+
+#include "dht.h"
+
+// Symboles exportés par libdhtclient, compilée en -fvisibility=hidden (cf
+// Makefile): le reste de la bibliothèque ne se voit pas du programme hôte
+#define DHT_EXPORT __attribute__((visibility("default")))
+
+/**
+ * @brief Encodage des clés et adresses (cf hkey)
+ * @details Tout ce dont un client a besoin du format de la DHT, sans la DHT
+ * elle-même: libdhtclient n'embarque que ce module (cf Makefile).
+ */
+
+DHT_EXPORT void dht_keyenc(const char* h, hkey* k);
+DHT_EXPORT void dht_addrenc(const char* ip, hkey* a);
+DHT_EXPORT void dht_keycode(hkey* k);
+DHT_EXPORT const char* dht_keystr(const hash* e, char* buf);
+DHT_EXPORT const char* dht_ipstr(const hash* e, char* buf);
+
+#endif
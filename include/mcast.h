@@ -0,0 +1,42 @@
+#ifndef __MCAST_H__
+#define __MCAST_H__
+
+#include "dht.h"
+#include "net.h"
+#include "proto.h"
+
+// Millisecondes au plus entre un PUT et son annonce (cf --announce-every)
+#ifndef MCAST_INTERVAL
+	#define MCAST_INTERVAL 5
+#endif
+
+// Millisecondes entre deux OP_HELLO
+#ifndef MCAST_HELLO
+	#define MCAST_HELLO 2000
+#endif
+
+/**
+ * @brief Découverte des serveurs et réplication des PUT par multicast
+ * @details
+ *
+ * Avec --multicast GROUPE:PORT, chaque serveur rejoint le groupe (cf
+ * netmulticast) et:
+ * - y annonce son adresse d'écoute toutes les MCAST_HELLO ms (OP_HELLO). Les
+ *   autres serveurs l'ajoutent au groupe SWIM (cf swim_add), qui détecte
+ *   ensuite s'il meurt: pas besoin de graine (--join)
+ * - hors anneau, y annonce les PUT qu'il reçoit. Pas un datagramme par PUT:
+ *   ils sont regroupés en OP_ANNOUNCE, envoyés dès qu'ils remplissent un
+ *   datagramme, ou MCAST_INTERVAL ms au plus après le premier. Un PUT coûte
+ *   ainsi une fraction de datagramme, quel que soit le nombre de serveurs.
+ *
+ * Les annonces ne sont pas acquittées: un lot perdu est rattrapé par la
+ * réparation (cf --peer). Chaque serveur reçoit aussi ses propres messages,
+ * reconnus à leur id (cf proto.h).
+ */
+
+int mcast_start(dht* d, nethandle* s, char* group, char* port, char* iface,
+				int interval, int announce);
+int mcast_put(const hkey* k, const hkey* a);
+void mcast_stop(void);
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+// recvmmsg/sendmmsg
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -14,11 +19,23 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/time.h>
 
+// Plus gros datagramme accepté quand les gros messages sont activés
 #define BUFF_SIZE 131072
+// MTU supposé quand on ne peut pas lire celui de l'interface
+#define NET_MTU 1500
+// Entêtes IPv6 + UDP: un datagramme de NET_MTU porte NET_PAYLOAD octets
+#define NET_HEADERS 48
+#define NET_PAYLOAD (NET_MTU - NET_HEADERS)
 #define LISTEN 0
 #define SEND   1
 
+// Nombre max de datagrammes lus ou envoyés par appel système
+#define NET_BATCH 32
+// Place pour les réponses en attente d'envoi (cf netqueue)
+#define NET_OUTBUF 65536
+
 typedef struct s_nethandle {
 	// Gros addrinfo renvoyé par getaddrinfo contenant ~tout
 	struct addrinfo* sainfo;
@@ -33,13 +50,65 @@ typedef struct s_nethandle {
 	// Eventuel buffer de données
 	void* buf;
 	int length;
+	// Taille de buf, 0 pour la choisir d'après le MTU (cf netlisten)
+	int bufsize;
+	// Adresse de l'expéditeur, remplie par netlisten (sin6 pointe dessus)
+	struct sockaddr_in6 peer;
+	// Texte de peer, seulement rempli si les logs sont activés
+	char peeraddr[INET6_ADDRSTRLEN];
+	// Si non NULL, netsend met les messages en attente dans ce lot au lieu
+	// de les envoyer (cf netflush)
+	struct s_netbatch* batch;
 } nethandle;
 
+/**
+ * Un lot de datagrammes reçus en un appel à recvmmsg, et les réponses en
+ * attente d'être envoyées en un appel à sendmmsg.
+ * 
+ * Un lot par thread de traitement: ses tampons sont alloués une fois et
+ * recyclés à chaque appel, sans jamais être remis à zéro (chaque message est
+ * seulement terminé par un '\0').
+ */
+typedef struct s_netbatch {
+	// Socket de réception et d'envoi
+	int socket_desc;
+
+	// Réception: count datagrammes, le i-ème dans inbuf + i*slot
+	int count;
+	// Taille d'un emplacement de inbuf (plus gros message + '\0')
+	size_t slot;
+	struct mmsghdr in[NET_BATCH];
+	struct iovec iniov[NET_BATCH];
+	struct sockaddr_in6 from[NET_BATCH];
+	char* inbuf;
+
+	// Envoi: nout datagrammes copiés dans outbuf
+	int nout;
+	size_t outused;
+	struct mmsghdr out[NET_BATCH];
+	struct iovec outiov[NET_BATCH];
+	struct sockaddr_in6 to[NET_BATCH];
+	char* outbuf;
+} netbatch;
+
 int netopen(char* host, char* port, nethandle* s, char c_mode);
 int netclose(nethandle* s);
+int sockaddr_to_nethandle(struct sockaddr_in6* sin6, nethandle* listen, 
+						  nethandle* s);
 int netlisten(nethandle* s, nethandle* sender);
 int netsend_binary(nethandle* s, void* data, int length);
 int netsend(nethandle* s, char* str);
-// int netmulticast(nethandle* local, nethandle* multi);
+int nettimeout(nethandle* s, int ms);
+int netmtu(nethandle* s);
+int netpeer(nethandle* peer, nethandle* s);
+int netsplit(char* str, char** host, char** port);
+int netbatch_init(nethandle* s, netbatch* b, int size);
+void netbatch_free(netbatch* b);
+int netlisten_batch(nethandle* s);
+char* netbatch_get(nethandle* s, int i, nethandle* sender);
+int netqueue(netbatch* b, struct sockaddr_in6* to, void* data, int length);
+void* netqueue_last(netbatch* b, struct sockaddr_in6* to, int* length);
+int netflush(netbatch* b);
+int netmulticast(char* group, char* port, char* iface, nethandle* multi);
 
 #endif
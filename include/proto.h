@@ -0,0 +1,173 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+
+#include "dht.h"
+
+// Premier octet d'un message binaire: PROTO_MAGIC | PROTO_VERSION
+// Un message texte commence toujours par une lettre ASCII (< 0x80)
+#define PROTO_MAGIC   0xD0
+#define PROTO_VERSION 1
+
+// magic/version, opcode, format de clé, format d'adresse, id de requête
+#define PROTO_HEADER 8
+
+// Plus gros champ varint (uint64_t)
+#define PROTO_VARINT_MAX 10
+
+// Entête d'une page OP_ADDRS: nombre d'adresses (16 bits), suite (32 bits)
+#define PROTO_PAGE_HEADER (PROTO_HEADER + 6)
+
+// Opcodes des messages binaires
+#define OP_PUT          1 // clé, adresse
+#define OP_GET          2 // clé, première adresse voulue (varint)
+#define OP_PLZGIBHASHES 3 // -
+#define OP_KKTAKETHIS   4 // clé, adresse, âge (varint)
+#define OP_ADDRS        5 // page d'adresses: la réponse à OP_GET
+#define OP_END          6 // fin des réponses à une requête, acquitte un PUT
+#define OP_SYNC         7 // taille max d'un lot (varint), cf sync.h
+#define OP_BATCH        8 // lot de tuples: clé, adresse, âge
+#define OP_ACK          9 // lots reçus: premier et dernier (32 bits chacun)
+#define OP_DIGEST      10 // noeud de l'arbre de Merkle (varint)
+#define OP_DIGESTS     11 // noeud (varint), condensés de ses fils
+#define OP_PULL        12 // taille max d'un lot (varint), seaux voulus
+#define OP_RING        13 // -, ou la liste des serveurs de l'anneau
+#define OP_MOVED       14 // la clé est ailleurs: liste des serveurs
+#define OP_PING        15 // sonde d'un membre, cf swim.h
+#define OP_PING_REQ    16 // sonde un membre à ma place
+#define OP_PING_ACK    17 // réponse à une sonde
+#define OP_ANNOUNCE    18 // lot de PUT annoncés au groupe multicast
+#define OP_HELLO       19 // un serveur annonce son adresse au groupe
+
+// Corps d'un OP_ACK
+#define PROTO_ACK (PROTO_HEADER + 8)
+
+/**
+ * Un message binaire décodé.
+ *
+ * # Format
+ *
+ * Entête fixe de PROTO_HEADER octets:
+ * - [0]    PROTO_MAGIC | PROTO_VERSION
+ * - [1]    opcode (OP_*)
+ * - [2]    format de la clé (KEY_*, 0 si absente)
+ * - [3]    format de l'adresse (ADDR_*, 0 si absente)
+ * - [4..7] id de requête, gros-boutiste, recopié dans les réponses
+ *
+ * Puis la clé et l'adresse sous leur forme stockée dans la DHT:
+ * - KEY_SHA256: 32 octets bruts
+ * - ADDR_V6, ADDR_V4: 16 octets bruts (in6_addr)
+ * - formats texte: longueur (varint), texte, '\0'
+ *
+ * Puis pour OP_KKTAKETHIS l'âge du tuple en secondes (varint), plutôt que son
+ * timestamp: un octet au lieu de cinq, et insensible au décalage d'horloge
+ * entre les deux serveurs.
+ *
+ * # Pages d'adresses
+ *
+ * Un GET reçoit exactement un datagramme OP_ADDRS, rempli d'autant
+ * d'adresses que possible (cf proto_page_add). Après l'entête:
+ * - [8..9]   nombre d'adresses, gros-boutiste
+ * - [10..13] suite: position de la prochaine adresse, 0 si c'est la dernière
+ *            page. Le client la renvoie dans OP_GET pour la page suivante.
+ * - les adresses, chacune précédée de son format (1 octet)
+ *
+ * # Lots de tuples
+ *
+ * Une synchronisation (cf sync.h) envoie la DHT en OP_BATCH, même entête
+ * qu'une page OP_ADDRS:
+ * - [8..9]   nombre de tuples
+ * - [10..13] numéro du lot, recopié dans l'OP_ACK qui l'acquitte
+ * - les tuples: format de clé, format d'adresse (1 octet chacun), clé,
+ *   adresse, âge (varint), encodés comme pour OP_KKTAKETHIS
+ *
+ * Un OP_ACK acquitte tous les lots de [8..11] à [12..15] inclus (32 bits,
+ * gros-boutistes): le destinataire peut élargir le dernier ACK en attente
+ * plutôt que d'en envoyer un par lot.
+ *
+ * # Anti-entropie
+ *
+ * OP_DIGESTS répond à un OP_DIGEST par les DHT_DIGEST_FANOUT condensés des
+ * fils du noeud (64 bits chacun, gros-boutistes). OP_PULL demande les tuples
+ * de certains seaux seulement: après la taille max d'un lot, un bit par seau
+ * (DHT_DIGEST_BUCKETS / 8 octets, bit b = octet b/8, bit b%8). La réponse
+ * est une synchronisation (OP_BATCH, OP_END) restreinte à ces seaux.
+ *
+ * # Anneau
+ *
+ * En mode anneau (cf ring.h), OP_RING sans corps demande la liste des
+ * serveurs, et la réponse OP_RING la porte (cf ring_encode). Un OP_GET
+ * reçu par un serveur qui n'est pas propriétaire de la clé reçoit un
+ * OP_MOVED, qui porte la même liste: le client calcule les propriétaires et
+ * renvoie sa requête à l'un d'eux. Le corps va de m.cur à m.end.
+ *
+ * # Appartenance
+ *
+ * OP_PING, OP_PING_REQ et OP_PING_ACK (cf swim.h) n'ont qu'un corps opaque,
+ * de m.cur à m.end. L'id de requête est le numéro de la sonde, recopié dans
+ * l'OP_PING_ACK.
+ *
+ * # Multicast
+ *
+ * OP_ANNOUNCE a la forme d'un OP_BATCH: les PUT reçus par un serveur pendant
+ * quelques millisecondes, annoncés d'un coup au groupe (cf mcast.h). OP_HELLO
+ * porte l'adresse et le port (16 + 2 octets) d'écoute d'un serveur. L'id de
+ * requête des deux identifie le serveur émetteur, qui reçoit aussi ses
+ * propres messages.
+ */
+typedef struct s_proto_msg {
+	uint8_t op;
+	uint32_t id;
+	hkey key;
+	hkey addr;
+	// OP_KKTAKETHIS: timestamp du tuple
+	long int time;
+	// OP_GET: position de la première adresse voulue
+	// OP_ADDRS: position de la suivante, 0 = dernière page
+	// OP_BATCH: numéro du lot
+	// OP_SYNC, OP_PULL: taille max d'un lot
+	// OP_DIGEST, OP_DIGESTS: noeud de l'arbre (cf SYNC_NODE)
+	// OP_ACK: premier lot acquitté
+	uint32_t from;
+	// OP_ACK: dernier lot acquitté
+	uint32_t to;
+	// OP_DIGESTS: condensés des fils du noeud m.from
+	uint64_t digests[DHT_DIGEST_FANOUT];
+	// OP_PULL: seaux voulus (DHT_DIGEST_BUCKETS bits), dans le message reçu
+	uint8_t* buckets;
+	// OP_ADDRS, OP_BATCH: nombre d'adresses (de tuples) et adresses pas
+	// encore lues (cf proto_page_next, proto_batch_next), dans le message reçu
+	// OP_RING, OP_MOVED: liste des serveurs (cf ring_encode)
+	// OP_PING, OP_PING_REQ, OP_PING_ACK: cf swim_recv
+	// OP_HELLO: adresse d'écoute de l'émetteur
+	unsigned int count;
+	uint8_t* cur;
+	uint8_t* end;
+} proto_msg;
+
+/**
+ * Une page OP_ADDRS ou un lot OP_BATCH en cours d'écriture
+ */
+typedef struct s_proto_page {
+	uint8_t* buf;
+	int size;
+	int len;
+	unsigned int count;
+} proto_page;
+
+int proto_is_binary(const void* buf, int len);
+int proto_encode(const proto_msg* m, void* buf, int size);
+int proto_decode(void* buf, int len, proto_msg* m);
+void proto_fromhash(const hash* e, proto_msg* m);
+int proto_page_init(proto_page* pg, void* buf, int size, uint32_t id);
+int proto_page_add(proto_page* pg, const hkey* a);
+int proto_page_end(proto_page* pg, uint32_t next);
+int proto_page_next(proto_msg* m, hkey* a);
+int proto_batch_init(proto_page* pg, void* buf, int size, uint32_t id);
+int proto_announce_init(proto_page* pg, void* buf, int size, uint32_t id);
+int proto_batch_add(proto_page* pg, const hkey* k, const hkey* a, long t);
+int proto_batch_next(proto_msg* m, hkey* k, hkey* a, long* t);
+DHT_EXPORT const char* proto_addrstr(const hkey* a, char* buf);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Serveurs d'un anneau au plus
+#ifndef RING_NODES_MAX
+	#define RING_NODES_MAX 64
+#endif
+
+// Noeuds virtuels par serveur
+#ifndef RING_VNODES
+	#define RING_VNODES 64
+#endif
+
+// Copies de chaque tuple par défaut (cf --replicas)
+#ifndef RING_REPLICAS
+	#define RING_REPLICAS 2
+#endif
+
+// Anneau encodé: nombre de serveurs, copies, noeuds virtuels (16 bits), puis
+// adresse (16 octets) et port (16 bits) de chaque serveur
+#define RING_HEADER 4
+#define RING_NODE 18
+
+/**
+ * Un point de l'anneau: un noeud virtuel d'un serveur
+ */
+typedef struct s_ring_point {
+	uint32_t point;
+	uint16_t node;
+} ring_point;
+
+/**
+ * @brief Anneau de hachage cohérent
+ * @details
+ *
+ * En mode anneau (cf --ring), chaque serveur ne garde qu'une partie des
+ * clés. Chaque serveur est placé RING_VNODES fois sur un cercle de 2^32
+ * points, en des positions qui ne dépendent que de son adresse et de son
+ * port. Une clé appartient aux 'replicas' premiers serveurs distincts
+ * rencontrés en tournant à partir de son code de hachage (cf dht_keycode).
+ *
+ * Tous ceux qui connaissent la même liste de serveurs (les serveurs, et les
+ * clients qui l'ont apprise par OP_RING ou OP_MOVED) calculent donc les mêmes
+ * propriétaires, sans se concerter. Ajouter un serveur ne déplace
+ * qu'environ 1/n des clés, et la mémoire de chacun décroît en replicas/n.
+ *
+ * Les serveurs sont triés par adresse: l'ordre de la liste ne compte pas.
+ */
+typedef struct s_ring {
+	int count;
+	int replicas;
+	// Ce serveur dans nodes, -1 pour un client
+	int self;
+	struct sockaddr_in6 nodes[RING_NODES_MAX];
+	int npoints;
+	ring_point points[RING_NODES_MAX * RING_VNODES];
+} ring;
+
+int ring_parse(ring* r, char* list, int replicas);
+int ring_build(ring* r);
+int ring_find(const ring* r, const struct sockaddr_in6* a);
+int ring_owners(const ring* r, uint32_t code, int* owners);
+int ring_owns(const ring* r, uint32_t code);
+int ring_encode(const ring* r, uint8_t* p, int size);
+int ring_decode(ring* r, const uint8_t* p, int len);
+
+#endif
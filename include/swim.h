@@ -0,0 +1,93 @@
+#ifndef __SWIM_H__
+#define __SWIM_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "net.h"
+#include "proto.h"
+
+// Membres connus au plus (soi-même exclu)
+#ifndef SWIM_MEMBERS_MAX
+	#define SWIM_MEMBERS_MAX 64
+#endif
+
+// Millisecondes entre deux sondes (cf --probe-every)
+#ifndef SWIM_PERIOD
+	#define SWIM_PERIOD 500
+#endif
+
+// Millisecondes d'attente de l'ACK d'un OP_PING, avant les sondes indirectes
+#ifndef SWIM_TIMEOUT
+	#define SWIM_TIMEOUT 150
+#endif
+
+// Membres chargés de sonder à notre place (OP_PING_REQ)
+#ifndef SWIM_INDIRECT
+	#define SWIM_INDIRECT 3
+#endif
+
+// Un suspect est déclaré mort au bout de SWIM_SUSPICION * log2(n+1) périodes
+#ifndef SWIM_SUSPICION
+	#define SWIM_SUSPICION 3
+#endif
+
+// Une nouvelle est répétée SWIM_RETRANSMIT * log2(n+1) fois
+#ifndef SWIM_RETRANSMIT
+	#define SWIM_RETRANSMIT 3
+#endif
+
+// Nouvelles portées par un même message au plus
+#ifndef SWIM_PIGGYBACK
+	#define SWIM_PIGGYBACK 8
+#endif
+
+// Corps d'un message (cf swim_recv): incarnation de l'expéditeur (32 bits),
+// un membre (adresse et port, SWIM_NODE octets), nombre de nouvelles (8 bits),
+// puis les nouvelles: un membre, son état (8 bits) et son incarnation (32 bits)
+#define SWIM_NODE 18
+#define SWIM_HEADER (4 + SWIM_NODE + 1)
+#define SWIM_UPDATE (SWIM_NODE + 1 + 4)
+
+enum e_swim_state {SWIM_ALIVE, SWIM_SUSPECT, SWIM_DEAD};
+
+/**
+ * @brief Appartenance et détection de pannes (SWIM)
+ * @details
+ *
+ * Chaque serveur sonde un membre toutes les SWIM_PERIOD ms, dans un ordre
+ * aléatoire (chaque membre une fois par tour, puis l'ordre est rebattu):
+ * - un OP_PING, qui doit recevoir un OP_PING_ACK en SWIM_TIMEOUT ms
+ * - sinon un OP_PING_REQ à SWIM_INDIRECT autres membres, qui sondent le
+ *   membre à notre place et relaient son ACK: un lien perdu entre deux
+ *   serveurs ne suffit pas à en déclarer un mort
+ * - sans ACK à la fin de la période, le membre devient suspect. Il est
+ *   déclaré mort si personne ne l'a innocenté après
+ *   SWIM_SUSPICION * log2(n+1) périodes.
+ *
+ * Un membre qui apprend qu'on le suspecte se défend en incrémentant son
+ * incarnation: la nouvelle "vivant" l'emporte sur "suspect" de même
+ * incarnation. L'incarnation de départ est l'heure: un serveur redémarré
+ * l'emporte sur sa propre mort.
+ *
+ * Aucun message dédié à la diffusion: les changements d'état des membres
+ * voyagent dans les sondes elles-mêmes (SWIM_PIGGYBACK nouvelles au plus par
+ * message, chacune répétée SWIM_RETRANSMIT * log2(n+1) fois). Chaque serveur
+ * envoie donc un nombre constant de messages par période quelle que soit la
+ * taille du groupe, et une nouvelle atteint tout le monde en O(log n)
+ * périodes.
+ *
+ * Un membre est identifié par l'adresse et le port d'écoute de son serveur:
+ * les sondes partent de la socket du serveur, et arrivent à ses workers
+ * (cf swim_recv).
+ */
+
+int swim_start(nethandle* s, char* seeds, int period);
+int swim_add(const struct sockaddr_in6* a);
+int swim_recv(proto_msg* m, nethandle* sender);
+int swim_hello(nethandle* sender);
+int swim_alive(const struct sockaddr_in6* a);
+int swim_count(int* alive, int* suspect, int* dead);
+void swim_stop(void);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <stdint.h>
+
+#include "dht.h"
+#include "net.h"
+#include "proto.h"
+
+// Octets envoyés et pas encore acquittés au plus (au moins un lot): doit
+// tenir dans le tampon de réception du pair (net.core.rmem_default)
+#ifndef SYNC_WINDOW
+	#define SYNC_WINDOW (96*1024)
+#endif
+
+// Millisecondes avant de renvoyer un lot qui n'est pas acquitté
+#ifndef SYNC_RTO
+	#define SYNC_RTO 200
+#endif
+
+// Renvois d'un même lot avant d'abandonner la synchronisation
+#ifndef SYNC_RETRIES
+	#define SYNC_RETRIES 10
+#endif
+
+// Synchronisations servies en même temps au plus
+#ifndef SYNC_JOBS
+	#define SYNC_JOBS 4
+#endif
+
+// Secondes entre deux réparations auprès d'un pair (cf sync_peer)
+#ifndef SYNC_REPAIR_PERIOD
+	#define SYNC_REPAIR_PERIOD 30
+#endif
+
+// Noeud de l'arbre de Merkle (cf OP_DIGEST): profondeur, position
+#define SYNC_NODE(level, index) (((uint32_t)(level) << 24) | (index))
+#define SYNC_NODE_LEVEL(node) ((node) >> 24)
+#define SYNC_NODE_INDEX(node) ((node) & 0xffffff)
+
+/**
+ * @brief Synchronisation en masse entre deux serveurs
+ * @details
+ *
+ * plzgibhashes envoie un datagramme kktakethis par entrée, sans contrôle de
+ * flux: un million d'entrées, c'est un million de paquets dont une bonne
+ * partie déborde du tampon de réception du pair. Ici:
+ *
+ * - le pair demande la DHT avec un OP_SYNC, qui porte le plus gros lot qu'il
+ *   accepte (cf sync_request)
+ * - le serveur répond depuis un thread et une socket à part (cf sync_serve):
+ *   les tuples sont regroupés en lots OP_BATCH, aussi pleins que le permet
+ *   le MTU du chemin (cf netmtu)
+ * - au plus SYNC_WINDOW octets de lots sont en vol: l'émetteur n'envoie un
+ *   nouveau lot que quand le plus ancien est acquitté, il va donc au rythme
+ *   du récepteur sans déborder de son tampon de réception
+ * - le récepteur insère chaque lot d'un coup (cf dht_updatev) et l'acquitte
+ *   par un OP_ACK qui couvre un intervalle de lots (cf sync_recv)
+ * - un lot non acquitté au bout de SYNC_RTO ms est renvoyé, SYNC_RETRIES fois
+ *   au plus. Insérer deux fois un même lot ne change rien.
+ * - un OP_END (même id) termine la synchronisation
+ *
+ * La DHT est envoyée partition par partition (cf dht_foreach_shard): une
+ * partition est encodée verrou en lecture pris, puis envoyée verrou relâché.
+ *
+ * # Anti-entropie
+ *
+ * Pour rester à jour ensuite, pas besoin de tout renvoyer: sync_repair
+ * compare l'arbre de Merkle des deux DHT (cf dht_digest) de la racine vers
+ * les seaux, et ne récupère que les tuples des seaux qui diffèrent (OP_PULL,
+ * une synchronisation restreinte à ces seaux).
+ */
+
+int sync_request(nethandle* s, char* host, char* port, int payload);
+int sync_serve(dht* d, nethandle* peer, proto_msg* req);
+int sync_insert(dht* d, proto_msg* m);
+int sync_recv(dht* d, proto_msg* m, nethandle* sender);
+int sync_digest(dht* d, proto_msg* m, nethandle* sender);
+long sync_repair(dht* d, char* host, char* port);
+int sync_peer(dht* d, char* host, char* port, int period);
+void sync_stop(void);
+
+#endif
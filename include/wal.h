@@ -0,0 +1,91 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dht.h"
+
+// Millisecondes entre deux écritures groupées du journal
+#ifndef WAL_INTERVAL
+	#define WAL_INTERVAL 10
+#endif
+
+// Taille d'un segment au-delà de laquelle on passe au suivant
+#ifndef WAL_SEGMENT
+	#define WAL_SEGMENT (64*1024*1024)
+#endif
+
+// Tampon des enregistrements en attente d'écriture (x2)
+#ifndef WAL_BUF
+	#define WAL_BUF (1024*1024)
+#endif
+
+// Entête d'un enregistrement: longueur et somme de contrôle du corps
+#define WAL_RECORD_HEADER 8
+
+/**
+ * @brief Journal des PUT (write-ahead log)
+ * @details
+ *
+ * Chaque PUT accepté par la DHT (cf dht_updatek) ajoute un enregistrement
+ * binaire au tampon du journal, sans appel système. Le thread du journal
+ * écrit tout le tampon d'un coup toutes les 'interval' millisecondes (ou dès
+ * qu'il est plein), puis fait un seul fdatasync: c'est le "group commit".
+ * Au pire, un arrêt brutal perd les PUT des 'interval' dernières
+ * millisecondes.
+ *
+ * # Les segments
+ *
+ * Le journal est une suite de fichiers prefix.000001, prefix.000002, ...
+ * On passe au segment suivant tous les WAL_SEGMENT octets, et à chaque
+ * point de reprise (cf wal_checkpoint): un instantané de la DHT est écrit
+ * puis les segments qu'il couvre sont supprimés. Le journal ne grossit donc
+ * pas indéfiniment.
+ *
+ * # Les enregistrements
+ *
+ * - longueur du corps (32 bits), somme FNV-1a du corps (32 bits)
+ * - corps: kfmt, afmt, klen, alen, time (64 bits), puis la clé et l'adresse
+ *   comme dans l'instantané (cf dht_save)
+ *
+ * Entiers dans l'ordre des octets de la machine. Un enregistrement tronqué ou
+ * dont la somme ne correspond pas (écriture interrompue) termine le segment.
+ */
+typedef struct s_wal {
+	char* prefix;
+	// Segment courant
+	int fd;
+	uint32_t segment;
+	size_t written;
+
+	// Millisecondes entre deux écritures
+	int interval;
+
+	// Tampon rempli par les PUT, et tampon en cours d'écriture
+	uint8_t* buf;
+	size_t len;
+	uint8_t* spare;
+
+	// Protège buf/len; cond réveille le thread du journal, space les PUT
+	// qui attendent de la place
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t space;
+	int stop;
+
+	// Protège le fichier: écritures, changement de segment
+	pthread_mutex_t io;
+
+	pthread_t thread;
+} wal;
+
+int wal_open(wal* w, const char* prefix, int interval);
+long wal_replay(wal* w, dht* d);
+int wal_start(wal* w);
+int wal_append(wal* w, const hkey* k, const hkey* a, long t);
+int wal_checkpoint(wal* w, dht* d, const char* snapshot);
+void wal_close(wal* w);
+
+#endif
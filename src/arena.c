@@ -0,0 +1,137 @@
+#include "macros.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[ARENA ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+/**
+ * @brief Classe d'un bloc de 'size' octets
+ * @return indice de classe, ou -1 si le bloc est trop gros pour l'arène
+ */
+static int size_class(size_t size){
+	if (size > ARENA_MAX)
+		return -1;
+
+	int c = 0;
+	while (((size_t)1 << (ARENA_MIN_SHIFT + c)) < size)
+		c++;
+
+	return c;
+}
+
+void arena_init(arena* a){
+	memset(a, 0, sizeof(*a));
+}
+
+/**
+ * @brief Renvoie un bloc d'au moins 'size' octets
+ * @details Dans l'ordre: liste libre de la classe, reste de la page courante,
+ * nouvelle page. Les blocs trop gros pour une classe passent par malloc.
+ *
+ * @return bloc ou NULL
+ */
+void* arena_alloc(arena* a, size_t size){
+	int c = size_class(size);
+	void* p;
+
+	if (c == -1){
+		p = malloc(size);
+		if (p != NULL)
+			a->big += size;
+		return p;
+	}
+
+	size_t csize = (size_t)1 << (ARENA_MIN_SHIFT + c);
+
+	if (a->freelist[c] != NULL){
+		p = a->freelist[c];
+		a->freelist[c] = *(void**)p;
+		a->used += csize;
+		return p;
+	}
+
+	if (a->left < csize){
+		// Le reste de la page est perdu, il est plus petit que le bloc demandé
+		void** pages = realloc(a->pages, (a->npages+1) * sizeof(void*));
+		if (pages == NULL){
+			warn("realloc pages");
+			return NULL;
+		}
+		a->pages = pages;
+
+		a->cur = malloc(ARENA_PAGE);
+		if (a->cur == NULL){
+			warn("malloc page");
+			a->left = 0;
+			return NULL;
+		}
+		a->pages[a->npages++] = a->cur;
+		a->left = ARENA_PAGE;
+		a->reserved += ARENA_PAGE;
+		info("  Arena: new page (%u pages)", a->npages);
+	}
+
+	p = a->cur;
+	a->cur += csize;
+	a->left -= csize;
+	a->used += csize;
+	return p;
+}
+
+/**
+ * @brief Rend un bloc à l'arène
+ *
+ * @param p bloc renvoyé par arena_alloc
+ * @param size la taille demandée à arena_alloc
+ */
+void arena_free(arena* a, void* p, size_t size){
+	if (p == NULL)
+		return;
+
+	int c = size_class(size);
+
+	if (c == -1){
+		free(p);
+		a->big -= size;
+		return;
+	}
+
+	*(void**)p = a->freelist[c];
+	a->freelist[c] = p;
+	a->used -= (size_t)1 << (ARENA_MIN_SHIFT + c);
+}
+
+char* arena_strdup(arena* a, const char* str){
+	size_t len = strlen(str) + 1;
+	char* p = arena_alloc(a, len);
+
+	if (p != NULL)
+		memcpy(p, str, len);
+
+	return p;
+}
+
+/**
+ * @brief Libère toutes les pages (et donc tous les blocs) de l'arène
+ * @details Les gros blocs passés par malloc restent à libérer par l'appelant.
+ */
+void arena_destroy(arena* a){
+	for (unsigned int i = 0; i < a->npages; ++i)
+		free(a->pages[i]);
+	free(a->pages);
+	memset(a, 0, sizeof(*a));
+}
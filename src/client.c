@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "macros.h"
-#include "net.h"
+#include "dhtclient.h"
+
+#include <getopt.h>
 
 // Macros d'affichage.
 // Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
@@ -13,84 +16,305 @@
 #define assert(...)        __assert(FILE, __VA_ARGS__)
 #define assert_return(...) __assert_return(FILE, __VA_ARGS__)
 
+// Requêtes en vol au plus en mode --batch (cf --window)
+#ifndef CLIENT_WINDOW
+	#define CLIENT_WINDOW 128
+#endif
+
 enum e_cmd {GET, PUT};
 
+// Requêtes de --batch terminées en erreur
+static int _G_FAILED = 0;
+
+// Une requête de --batch, gardée jusqu'à son dernier rappel
+typedef struct s_batch_req {
+	// Adresses déjà affichées (GET sur plusieurs pages)
+	int printed;
+	// "get HASH" ou "put HASH"
+	char line[];
+} batch_req;
+
+/**
+ * @brief Affiche une page d'adresses reçue (cf dhtclient_get)
+ */
+static void print_addrs(void* arg, int status, const hkey* addrs, int count){
+	char str[DHT_ADDR_STRLEN];
+	int* ok = arg;
+
+	for (int i = 0; i < count; ++i){
+		const char* str_addr = proto_addrstr(&addrs[i], str);
+		info("IP: %s", str_addr);
+		printf("%s\n", str_addr);
+	}
+	*ok = (status == DHTCLIENT_OK || status == DHTCLIENT_MORE);
+}
+
+/**
+ * @brief Affiche le résultat d'une requête de --batch
+ * @details Une ligne "HASH IP" par adresse d'un GET, "HASH (null)" pour un
+ * GET sans adresse sur aucune de ses pages. Un PUT acquitté n'affiche rien.
+ *
+ * @param arg batch_req, alloué par batch_line
+ */
+static void print_result(void* arg, int status, const hkey* addrs, int count){
+	char str[DHT_ADDR_STRLEN];
+	batch_req* req = arg;
+	char* hash = req->line + 4;
+
+	for (int i = 0; i < count; ++i)
+		printf("%s %s\n", hash, proto_addrstr(&addrs[i], str));
+	req->printed += count;
+	if (status == DHTCLIENT_MORE)
+		return;
+
+	if (status != DHTCLIENT_OK){
+		warn("No answer to '%s'", req->line);
+		_G_FAILED++;
+	}
+	else if (req->line[0] == 'g' && req->printed == 0)
+		printf("%s (null)\n", hash);
+	free(req);
+}
+
+/**
+ * @brief Envoie une commande "put HASH IP" ou "get HASH" de --batch
+ * @details Si window requêtes sont en vol, attend des réponses d'abord. Les
+ * réponses déjà arrivées sont lues tous les NET_BATCH envois: les requêtes
+ * partent par lots (cf dhtclient_poll).
+ *
+ * @param c client
+ * @param line ligne, modifiée
+ * @param nb_line numéro de la ligne
+ * @param window requêtes en vol au plus
+ * @return 0 ou -1
+ */
+static int batch_line(dhtclient* c, char* line, long nb_line, int window){
+	static long sent = 0;
+	char *save = NULL, *cmd, *hash, *ip, *extra;
+	batch_req* arg;
+	hkey key, addr;
+	int tmp;
+
+	cmd   = strtok_r(line, " \t\r", &save);
+	hash  = strtok_r(NULL, " \t\r", &save);
+	ip    = strtok_r(NULL, " \t\r", &save);
+	extra = strtok_r(NULL, " \t\r", &save);
+	if (cmd == NULL)
+		return 0;
+
+	// Rien après la commande: "put H 1.2.3.4 garbage" est une erreur
+	  assert_return(hash == NULL ||
+					!((strcmp(cmd, "get") == 0 && ip == NULL) ||
+					  (strcmp(cmd, "put") == 0 && ip != NULL && extra == NULL)),
+					"Line %ld: 'put HASH IP' or 'get HASH' expected", nb_line);
+
+	while (dhtclient_pending(c) >= window)
+		  assert_return(dhtclient_poll(c, -1) == -1, "dhtclient_poll");
+
+	// Le rappel a besoin de la commande: elle est gardée jusqu'à lui
+	arg = malloc(sizeof(batch_req) + strlen(hash) + 5);
+	  assert_return(arg == NULL, "malloc");
+	arg->printed = 0;
+	sprintf(arg->line, "%s %s", cmd, hash);
+
+	dht_keyenc(hash, &key);
+	if (cmd[0] == 'p'){
+		dht_addrenc(ip, &addr);
+		tmp = dhtclient_put(c, &key, &addr, &print_result, arg);
+	}
+	else {
+		tmp = dhtclient_get(c, &key, &print_result, arg);
+	}
+	if (tmp == -1){
+		free(arg);
+		return -1;
+	}
+
+	if (++sent % NET_BATCH == 0)
+		  assert_return(dhtclient_poll(c, 0) == -1, "dhtclient_poll");
+
+	return 0;
+}
+
+/**
+ * @brief Envoie les commandes lues dans fd, une par ligne (cf batch_line)
+ * @details Une seule socket pour toutes: au plus window requêtes attendent
+ * leur réponse, les résultats sont affichés dans leur ordre d'arrivée (cf
+ * print_result).
+ *
+ * Une ligne plus longue que le tampon est ignorée jusqu'à son '\n', et
+ * comptée une seule fois comme invalide.
+ *
+ * @return nombre de commandes invalides ou sans réponse
+ */
+static int batch(dhtclient* c, int fd, int window){
+	static char buf[65536];
+	int len = 0, start, tmp, skip = false;
+	long nb_line = 0;
+
+	do {
+		tmp = read(fd, buf + len, sizeof(buf) - 1 - len);
+		  assert_return(tmp == -1, "Can't read the commands");
+		len += tmp;
+		// Fin du fichier: la dernière ligne n'a pas forcément de '\n'
+		if (tmp == 0 && len > 0 && buf[len-1] != '\n')
+			buf[len++] = '\n';
+
+		start = 0;
+		for (int i = 0; i < len; ++i){
+			if (buf[i] != '\n')
+				continue;
+			buf[i] = '\0';
+			// Fin d'une ligne trop longue, déjà comptée
+			if (skip)
+				skip = false;
+			else if (batch_line(c, buf + start, ++nb_line, window) == -1)
+				_G_FAILED++;
+			start = i + 1;
+		}
+
+		// Tampon plein sans '\n': la suite de la ligne est ignorée aussi
+		if (start == 0 && len == (int)sizeof(buf) - 1){
+			if (!skip){
+				warn("Line %ld: too long, skipped", ++nb_line);
+				_G_FAILED++;
+				skip = true;
+			}
+			len = 0;
+			continue;
+		}
+		memmove(buf, buf + start, len - start);
+		len -= start;
+	} while (tmp > 0);
+
+	dhtclient_wait(c);
+	fflush(stdout);
+	info("%ld lines, %d failed", nb_line, _G_FAILED);
+
+	return _G_FAILED;
+}
+
+static void usage(char* name){
+	err("Usage: %s IP PORT get HASH\n"
+		"       %s IP PORT put HASH IP\n"
+		"       %s IP PORT --batch [FILE] [--window N]\n", name, name, name);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
 	// On commence par checker les arguments
 	char *host, *port, *cmd, *hash, *ip;
 	enum e_cmd command;
+	int use_batch = false, window = CLIENT_WINDOW, opt;
+
+	static struct option options[] = {
+		{"batch",  no_argument,       NULL, 'b'},
+		{"window", required_argument, NULL, 'w'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "bw:", options, NULL)) != -1){
+		switch (opt){
+			case 'b':
+				use_batch = true;
+				break;
+			case 'w':
+				window = atoi(optarg);
+				  assert(window <= 0 || window > DHTCLIENT_INFLIGHT, 
+						 "--window: 1 to %d", DHTCLIENT_INFLIGHT);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc == 5 || argc == 6){
-		host = argv[1];
-		port = argv[2];
-		cmd  = argv[3];
-		hash = argv[4];
-		ip   = argv[5];
+	// client IP PORT --batch [FICHIER]: stdin par défaut
+	if (use_batch){
+		dhtclient dht;
+		int in = STDIN_FILENO;
+		int failed;
 
-		if (argc == 5){
+		if (argc != 2 && argc != 3)
+			usage(argv[-optind]);
+		  assert(atoi(argv[1]) <= 0, "Bad port");
+		if (argc == 3){
+			in = open(argv[2], O_RDONLY);
+			  assert(in == -1, "Can't open %s", argv[2]);
+		}
+		  assert(dhtclient_open(&dht, argv[0], argv[1]) == -1, 
+				 "Can't connect to DHT");
+
+		failed = batch(&dht, in, window);
+
+		dhtclient_close(&dht);
+		if (in != STDIN_FILENO)
+			close(in);
+		return (failed > 0) ? EXIT_FAILURE : 0;
+	}
+
+	if (argc == 4 || argc == 5){
+		host = argv[0];
+		port = argv[1];
+		cmd  = argv[2];
+		hash = argv[3];
+		ip   = argv[4];
+
+		if (argc == 4){
 			if (strcmp(cmd, "get") == 0){
 				command = GET;
 				ip = "";
 			} 
 			else {
-				err("Usage: %s IP PORT get HASH\n", argv[0]);
+				err("Usage: %s IP PORT get HASH\n", argv[-optind]);
 				exit(EXIT_FAILURE);
 			}
 		}
-		else if (argc == 6){
+		else if (argc == 5){
 			if (strcmp(cmd, "put") == 0){
 				command = PUT;
 			}
 			else {
-				err("Usage: %s IP PORT put HASH IP\n", argv[0]);
+				err("Usage: %s IP PORT put HASH IP\n", argv[-optind]);
 				exit(EXIT_FAILURE);
 			}
 		}
 	} else {
-		err("Usage: %s IP PORT COMMANDE HASH [IP]\n", argv[0]);
-		exit(EXIT_FAILURE);
+		usage(argv[-optind]);
 	}
 
 	// Les arguments sont valides.
 	// Je contacte le serveur
-	int tmp;
-	nethandle dht;
+	int tmp, ok = false;
+	dhtclient dht;
+	hkey key, addr;
 
 	// Port valide ?
 	tmp = atoi(port);
 	  assert(tmp <= 0, "Bad port");
 
-	tmp = netopen(host, port, &dht, 'w');
+	tmp = dhtclient_open(&dht, host, port);
 	  assert(tmp == -1, "Can't connect to DHT");
 
-	// nethandle multi;
-	// tmp = netmulticast(&dht, &multi);
-	//   	assert(tmp == -1, "Can't join a multicast group");
-
-
-	char buf[1024];
-	sprintf(buf, "%s %s %s", cmd, hash, ip);
-	check(
-		netsend(&dht, buf) != -1,
-		"Send : '%s'", buf
-	);
-
-	if (command == GET){
-		while (true){
-			tmp = netlisten(&dht, NULL);
-			info("IP: %s", dht.buf);
-			if(strcmp(dht.buf, "(null)") == 0)
-				break;
-			printf("%s\n", dht.buf);
-		}
+	// Requête binaire (cf proto.h): la clé et l'IP sont encodées ici, le
+	// serveur n'a plus rien à parser. libdhtclient renvoie la requête sans
+	// réponse, demande les pages suivantes d'un GET, et suit l'anneau
+	// (cf dhtclient.h)
+	dht_keyenc(hash, &key);
+	if (command == PUT){
+		dht_addrenc(ip, &addr);
+		ok = (dhtclient_put_wait(&dht, &key, &addr) == 0);
+		check(ok, "Send : '%s %s %s'", cmd, hash, ip);
+	}
+	else {
+		if (dhtclient_get(&dht, &key, &print_addrs, &ok) == 0)
+			dhtclient_wait(&dht);
 		fflush(stdout);
 	}
 
-	netclose(&dht);
-
-	// print the received char
-
-	// close the socket
+	dhtclient_close(&dht);
+	  assert(!ok, "No answer from the DHT");
 
 	return 0;
 }
@@ -0,0 +1,2062 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "dht.h"
+#include "wal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[  DHT ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// Barrière complète entre les lecteurs et la reclamation (cf retire_epoch).
+// -fsanitize=thread refuse les barrières seules: une opération atomique
+// séquentielle, barrière complète elle aussi sur x86, en tient lieu
+#ifdef __SANITIZE_THREAD__
+	static int fence_word;
+	#define full_fence() __atomic_fetch_add(&fence_word, 0, __ATOMIC_SEQ_CST)
+#else
+	#define full_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+// Enregistrement du thread courant, pour la dernière DHT lue
+// (cf dht_read_begin)
+static __thread dht_reader* tls_reader = NULL;
+static __thread dht* tls_dht = NULL;
+
+/**
+ * @brief Code de hachage de la clé d'une entrée (cf dht_keyenc)
+ */
+static uint32_t entry_code(const hash* e){
+	hkey k;
+
+	k.fmt = e->kfmt;
+	k.len = e->klen;
+	if (e->kfmt == KEY_LONG)
+		k.ext = e->key.ext;
+	else
+		memcpy(k.bin, e->key.bin, DHT_KEY_BIN);
+	dht_keycode(&k);
+
+	return k.code;
+}
+
+static int key_equal(const hash* e, const hkey* k){
+	if (e->kfmt != k->fmt || e->klen != k->len)
+		return false;
+	if (k->fmt == KEY_LONG)
+		return strcmp(e->key.ext, k->ext) == 0;
+	return memcmp(e->key.bin, k->bin, DHT_KEY_BIN) == 0;
+}
+
+static int addr_equal(const hash* e, const hkey* a){
+	if (e->afmt != a->fmt || e->alen != a->len)
+		return false;
+	if (a->fmt == ADDR_LONG)
+		return strcmp(e->addr.ext, a->ext) == 0;
+	return memcmp(e->addr.bin, a->bin, DHT_ADDR_BIN) == 0;
+}
+
+static int entry_addr_equal(const hash* e, const hash* f){
+	if (e->afmt != f->afmt || e->alen != f->alen)
+		return false;
+	if (e->afmt == ADDR_LONG)
+		return strcmp(e->addr.ext, f->addr.ext) == 0;
+	return memcmp(e->addr.bin, f->addr.bin, DHT_ADDR_BIN) == 0;
+}
+
+// Sentinelles de la liste des entrées en cours d'expiration et de la liste
+// libre, et maillon de l'entrée i de htable (cf tlink)
+#define WHEEL_PENDING DHT_WHEEL_SLOTS
+#define FREE_LIST     (DHT_WHEEL_SLOTS + 1)
+#define TNODE(i) (DHT_WHEEL_SLOTS + 2 + (uint32_t)(i))
+
+static void timer_unlink(dht_shard* sh, uint32_t n){
+	tlink* t = sh->timers;
+
+	t[t[n].prev].next = t[n].next;
+	t[t[n].next].prev = t[n].prev;
+	t[n].prev = t[n].next = n;
+}
+
+// Ajoute n en fin de la liste de sentinelle head
+static void timer_link(dht_shard* sh, uint32_t head, uint32_t n){
+	tlink* t = sh->timers;
+
+	t[n].prev = t[head].prev;
+	t[n].next = head;
+	t[t[head].prev].next = n;
+	t[head].prev = n;
+}
+
+/**
+ * @brief Range l'entrée i dans la case de la roue de son expiration
+ * @details A appeler à chaque modification de hash.time. Une entrée déjà
+ * échue va dans la case de la prochaine seconde traitée.
+ */
+static void timer_arm(dht_shard* sh, uint32_t i){
+	long int expiry = sh->htable[i].time + GARBAGE_COL_TIME + 1;
+
+	if (expiry <= sh->wheel_now)
+		expiry = sh->wheel_now + 1;
+
+	timer_unlink(sh, TNODE(i));
+	timer_link(sh, expiry & (DHT_WHEEL_SLOTS - 1), TNODE(i));
+}
+
+/**
+ * @brief Epoque à laquelle un objet que les lecteurs ne peuvent plus
+ * atteindre a été retiré (cf dht_read_begin)
+ * @details La barrière ordonne le retrait (déjà publié) avant la lecture de
+ * l'époque: un lecteur entré avec une époque plus grande ne peut pas le voir.
+ */
+static uint32_t retire_epoch(dht_shard* sh){
+	full_fence();
+	return __atomic_load_n(sh->epoch, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Libère un bloc obtenu par malloc (len = 0) ou par mmap
+ */
+static void block_free(void* ptr, size_t len){
+	if (len == 0)
+		free(ptr);
+	else
+		munmap(ptr, len);
+}
+
+/**
+ * @brief Confie un bloc remplacé (ancien tableau, ancien index) au garbage
+ * collector, qui le libérera après le passage de tous les lecteurs
+ *
+ * @param len 0 pour un bloc obtenu par malloc, taille projetée sinon
+ * @return 0 ou -1
+ */
+static int retire(dht_shard* sh, void* ptr, size_t len){
+	dht_retired* r;
+
+	if (ptr == NULL)
+		return 0;
+
+	r = malloc(sizeof(*r));
+	  assert_return(r == NULL, "malloc");
+	r->ptr = ptr;
+	r->len = len;
+	r->epoch = retire_epoch(sh);
+	r->next = sh->retired;
+	sh->retired = r;
+
+	return 0;
+}
+
+/**
+ * @brief Rend à l'arène ce qu'une entrée y a éventuellement pris
+ * @details L'entrée est remise à zéro (KEY_FREE).
+ */
+static void entry_clear(dht_shard* sh, hash* e){
+	if (e->kfmt == KEY_LONG)
+		arena_free(&sh->strings, e->key.ext, strlen(e->key.ext)+1);
+	if (e->afmt == ADDR_LONG)
+		arena_free(&sh->strings, e->addr.ext, strlen(e->addr.ext)+1);
+	memset(e, 0, sizeof(*e));
+}
+
+/**
+ * @brief Taille de la projection d'un tableau de size entrées
+ * @details 0 si le tableau passe par malloc: sans DHT_HUGE, ou s'il tient
+ * dans moins d'une grande page.
+ */
+static size_t table_len(dht_shard* sh, uint32_t size){
+	size_t bytes = (size_t)size * sizeof(hash);
+
+	if (!sh->huge || bytes < DHT_HUGE_PAGE)
+		return 0;
+
+	return (bytes + DHT_HUGE_PAGE - 1) & ~((size_t)DHT_HUGE_PAGE - 1);
+}
+
+/**
+ * @brief Alloue un tableau de size entrées
+ * @details Avec DHT_HUGE, les gros tableaux sont projetés en grandes pages
+ * (MAP_HUGETLB), ou à défaut en pages normales que le noyau peut regrouper
+ * (transparent huge pages): un gros tableau coûte beaucoup moins d'entrées
+ * de TLB.
+ */
+static hash* table_alloc(dht_shard* sh, uint32_t size){
+	size_t len = table_len(sh, size);
+	void* p;
+
+	if (len == 0)
+		return malloc((size_t)size * sizeof(hash));
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+
+	// Pas de grandes pages réservées (vm.nr_hugepages): THP
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	madvise(p, len, MADV_HUGEPAGE);
+
+	return p;
+}
+
+/**
+ * @brief Remplace htable par un tableau de size entrées
+ * @details Des lecteurs peuvent être en train de lire l'ancien: les entrées
+ * sous le cursor sont copiées dans le nouveau, et l'ancien est retiré plutôt
+ * que réalloué. Sert à l'agrandissement (en doublant: le coût des copies reste
+ * proportionnel au nombre d'entrées), au rétrécissement et à dht_reserve.
+ * A appeler verrou de la partition pris en écriture, size >= cursor.
+ *
+ * @return 0 ou -1
+ */
+static int table_resize(dht_shard* sh, uint32_t size){
+	// Les maillons grandissent avec le tableau, et rétrécissent après lui
+	if (size > sh->size){
+		tlink* timers = realloc(sh->timers, TNODE(size)*sizeof(tlink));
+		  assert_return(timers == NULL, "realloc");
+		sh->timers = timers;
+	}
+
+	hash* htable = table_alloc(sh, size);
+	  assert_return(htable == NULL, "table_alloc");
+	if (sh->htable != NULL)
+		memcpy(htable, sh->htable, sh->cursor*sizeof(hash));
+	if (retire(sh, sh->htable, table_len(sh, sh->size)) == -1){
+		block_free(htable, table_len(sh, size));
+		return -1;
+	}
+	__atomic_store_n(&sh->htable, htable, __ATOMIC_RELEASE);
+
+	if (size < sh->size){
+		tlink* timers = realloc(sh->timers, TNODE(size)*sizeof(tlink));
+		if (timers != NULL)
+			sh->timers = timers;
+	}
+
+	sh->size = size;
+	return 0;
+}
+
+/**
+ * @brief Vrai si l'entrée i est occupée et visible (ni libre ni retirée)
+ * @details A appeler verrou de la partition pris (lecture suffit).
+ */
+static int slot_live(dht_shard* sh, uint32_t i){
+	return sh->htable[i].kfmt != KEY_FREE && sh->htable[i].time != 0 &&
+		!(sh->timers[TNODE(i)].next & TLINK_MOVED);
+}
+
+/**
+ * @brief Réserve un emplacement dans htable
+ * @details Prend la tête de la liste libre, sinon l'emplacement après le
+ * cursor (en agrandissant le tableau si besoin).
+ * A appeler verrou de la partition pris en écriture.
+ *
+ * @return indice de l'emplacement ou -1
+ */
+static long slot_alloc(dht_shard* sh){
+	uint32_t i;
+
+	if (sh->timers[FREE_LIST].next != FREE_LIST){
+		i = sh->timers[FREE_LIST].next - TNODE(0);
+		timer_unlink(sh, TNODE(i));
+		return i;
+	}
+
+	// Si on manque de place, on double le tableau (cf table_resize)
+	if (sh->cursor >= sh->size){
+		if (table_resize(sh, (sh->size == 0) ? DHT_TABLE_MIN : sh->size*2) == -1)
+			return -1;
+		info("  Redim hash table to %d", sh->size);
+	}
+
+	i = sh->cursor++;
+	sh->timers[TNODE(i)].prev = sh->timers[TNODE(i)].next = TNODE(i);
+	return i;
+}
+
+/**
+ * @brief Vide l'emplacement i et le remet dans la liste libre
+ * @details Seulement pour une entrée qu'aucun lecteur ne peut voir: jamais
+ * publiée, ou sortie de limbo_reclaim.
+ * A appeler verrou de la partition pris en écriture.
+ */
+static void slot_free(dht_shard* sh, uint32_t i){
+	entry_clear(sh, &sh->htable[i]);
+	timer_unlink(sh, TNODE(i));
+	timer_link(sh, FREE_LIST, TNODE(i));
+}
+
+/**
+ * @brief Met l'entrée i en attente de libération (cf limbo_reclaim)
+ *
+ * @param flags 0, ou TLINK_MOVED si l'entrée a été recopiée ailleurs
+ */
+static void limbo_push(dht_shard* sh, uint32_t i, uint32_t flags){
+	tlink* t = sh->timers;
+
+	timer_unlink(sh, TNODE(i));
+	t[TNODE(i)].prev = retire_epoch(sh);
+	t[TNODE(i)].next = flags;
+	if (sh->limbo == 0)
+		sh->limbo = i+1;
+	else
+		t[TNODE(sh->limbo_tail-1)].next |= i+1;
+	sh->limbo_tail = i+1;
+}
+
+static uint64_t fnv1a64(uint64_t h, const void* p, size_t len){
+	const uint8_t* b = p;
+
+	for (size_t i = 0; i < len; ++i){
+		h ^= b[i];
+		h *= 1099511628211ull;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Hash 64 bits d'un tuple (clé, adresse), sans son timestamp
+ * @details Le même sur tous les serveurs: il ne dépend que de la forme
+ * stockée de la clé et de l'adresse.
+ */
+static uint64_t tuple_hash(const hash* e){
+	uint64_t h = 14695981039346656037ull;
+
+	h = fnv1a64(h, &e->kfmt, 1);
+	if (e->kfmt == KEY_LONG)
+		h = fnv1a64(h, e->key.ext, strlen(e->key.ext));
+	else
+		h = fnv1a64(h, e->key.bin, (e->kfmt == KEY_SHORT) ? e->klen : 
+										DHT_KEY_BIN);
+
+	h = fnv1a64(h, &e->afmt, 1);
+	if (e->afmt == ADDR_LONG)
+		h = fnv1a64(h, e->addr.ext, strlen(e->addr.ext));
+	else
+		h = fnv1a64(h, e->addr.bin, (e->afmt == ADDR_SHORT) ? e->alen : 
+										 DHT_ADDR_BIN);
+
+	// FNV mélange mal les derniers octets
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/**
+ * @brief Seau du condensé de l'entrée e (cf dht_digest)
+ */
+uint32_t dht_bucket(const hash* e){
+	return entry_code(e) >> (32 - DHT_DIGEST_BITS);
+}
+
+/**
+ * @brief Ajoute ou retire le tuple e du condensé de sa partition
+ * @details XOR: la même opération dans les deux sens.
+ * A appeler verrou de la partition pris en écriture.
+ */
+static void digest_flip(dht_shard* sh, const hash* e){
+	uint32_t b = dht_bucket(e) & ((DHT_DIGEST_BUCKETS >> DHT_SHARD_BITS) - 1);
+	sh->digest[b] ^= tuple_hash(e);
+}
+
+/**
+ * @brief Retire l'entrée i
+ * @details L'entrée est marquée retirée (time = 0) et mise en attente,
+ * clé, adresse et lien next intacts: un lecteur arrêté dessus peut encore finir son parcours. Elle
+ * ne rejoindra la liste libre qu'après le passage de tous les lecteurs (cf
+ * limbo_reclaim).
+ * A appeler verrou de la partition pris en écriture, entrée déjà retirée de
+ * l'index.
+ */
+static void slot_release(dht_shard* sh, uint32_t i){
+	digest_flip(sh, &sh->htable[i]);
+	__atomic_store_n(&sh->htable[i].time, 0, __ATOMIC_RELAXED);
+	limbo_push(sh, i, 0);
+}
+
+/**
+ * @brief Libère les entrées et les blocs retirés avant l'époque min
+ * @details Les entrées retirées sont vidées et rejoignent la liste libre.
+ * A appeler verrou de la partition pris en écriture.
+ *
+ * @param sh partition
+ * @param min plus petite époque des lecteurs en section
+ * @return nombre de blocs libérés
+ */
+static unsigned int limbo_reclaim(dht_shard* sh, uint32_t min){
+	unsigned int blocks = 0;
+	uint32_t i;
+	tlink* t;
+
+	// Les entrées sont retirées dans l'ordre: la liste est triée par époque
+	while (sh->limbo != 0){
+		i = sh->limbo - 1;
+		t = &sh->timers[TNODE(i)];
+		if ((int32_t)(t->prev - min) >= 0)
+			break;
+
+		sh->limbo = t->next & ~TLINK_MOVED;
+		// Une entrée déplacée a légué ses chaînes à sa copie
+		if (t->next & TLINK_MOVED)
+			memset(&sh->htable[i], 0, sizeof(hash));
+		t->prev = t->next = TNODE(i);
+
+		slot_free(sh, i);
+	}
+	if (sh->limbo == 0)
+		sh->limbo_tail = 0;
+
+	for (dht_retired** r = &sh->retired; *r != NULL; ){
+		if ((int32_t)((*r)->epoch - min) < 0){
+			dht_retired* old = *r;
+			*r = old->next;
+			block_free(old->ptr, old->len);
+			free(old);
+			blocks++;
+		}
+		else {
+			r = &(*r)->next;
+		}
+	}
+
+	return blocks;
+}
+
+/**
+ * @brief Alloue un index vide de size cases
+ * @details Une case de plus est allouée devant l'index pour y ranger sa
+ * taille (index[-1].code): un lecteur sans verrou lit ainsi le pointeur et
+ * la taille d'un seul coup.
+ */
+static slot* index_alloc(uint32_t size){
+	slot* block = calloc(size + 1, sizeof(slot));
+	if (block == NULL)
+		return NULL;
+
+	block[0].code = size;
+	return block + 1;
+}
+
+static void* index_block(slot* index){
+	return (index == NULL) ? NULL : index - 1;
+}
+
+/**
+ * @brief Cherche la première entrée de la clé k, sans verrou
+ * @details Même sondage que index_find, en lectures atomiques. Une case est
+ * publiée code d'abord, tête ensuite (cf index_insert): une tête non nulle
+ * lue en acquire garantit le code qui va avec.
+ * A appeler en section de lecture (cf dht_read_begin).
+ *
+ * @return indice+1 de la première entrée, 0 si la clé n'est pas dans la DHT
+ */
+static uint32_t index_lookup(dht_shard* sh, const hkey* k){
+	slot* index = __atomic_load_n(&sh->index, __ATOMIC_ACQUIRE);
+	uint32_t head;
+	hash* htable;
+
+	if (index == NULL)
+		return 0;
+
+	uint32_t mask = index[-1].code - 1;
+
+	for (uint32_t i = k->code & mask; ; i = (i+1) & mask){
+		head = __atomic_load_n(&index[i].head, __ATOMIC_ACQUIRE);
+
+		if (head == 0)
+			return 0;
+		if (head == DHT_TOMBSTONE || 
+			__atomic_load_n(&index[i].code, __ATOMIC_RELAXED) != k->code)
+			continue;
+
+		// Relu après la tête: le tableau contient forcément l'entrée
+		htable = __atomic_load_n(&sh->htable, __ATOMIC_ACQUIRE);
+		if (key_equal(&htable[head-1], k))
+			return head;
+	}
+}
+
+/**
+ * @brief Cherche la case d'index de la clé k
+ * @details Sondage linéaire. Le code de hachage est comparé avant la clé, on
+ * ne lit donc htable qu'en cas de collision probable.
+ * A appeler verrou de la partition pris (lecture suffit).
+ *
+ * @return La case ou NULL si la clé n'est pas dans la DHT
+ */
+static slot* index_find(dht_shard* sh, const hkey* k){
+	if (sh->index == NULL)
+		return NULL;
+
+	uint32_t mask = sh->isize - 1;
+	slot* s;
+
+	// Termine toujours: l'index n'est jamais plein (cf index_reserve)
+	for (uint32_t i = k->code & mask; ; i = (i+1) & mask){
+		s = &sh->index[i];
+
+		if (s->head == 0)
+			return NULL;
+
+		if (s->head != DHT_TOMBSTONE && s->code == k->code &&
+			key_equal(&sh->htable[s->head-1], k))
+			return s;
+	}
+}
+
+/**
+ * @brief Cherche la case d'index portant l'entrée i
+ * @details Comme index_find, mais sans avoir à ré-encoder la clé.
+ * A appeler verrou de la partition pris (lecture suffit).
+ */
+static slot* index_find_entry(dht_shard* sh, unsigned int i){
+	if (sh->index == NULL)
+		return NULL;
+
+	uint32_t mask = sh->isize - 1;
+	uint32_t code = entry_code(&sh->htable[i]);
+	slot* s;
+
+	for (uint32_t j = code & mask; ; j = (j+1) & mask){
+		s = &sh->index[j];
+
+		if (s->head == 0)
+			return NULL;
+
+		if (s->head != DHT_TOMBSTONE && s->code == code){
+			for (uint32_t p = s->head; p != 0; p = sh->htable[p-1].next){
+				if (p == i+1)
+					return s;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Reconstruit l'index avec 'size' cases
+ * @details Purge les tombstones au passage.
+ *
+ * @return 0 ou -1
+ */
+static int index_resize(dht_shard* sh, uint32_t size){
+	slot* old = sh->index;
+	uint32_t oldsize = sh->isize;
+	uint32_t mask = size - 1;
+	uint32_t used = 0;
+
+	// Construit à part puis publié d'un coup: les lecteurs voient l'ancien
+	// index ou le nouveau, jamais un index à moitié rempli
+	slot* index = index_alloc(size);
+	  assert_return(index == NULL, "calloc index");
+
+	for (uint32_t i = 0; i < oldsize; ++i){
+		if (old[i].head == 0 || old[i].head == DHT_TOMBSTONE)
+			continue;
+
+		uint32_t j = old[i].code & mask;
+		while (index[j].head != 0)
+			j = (j+1) & mask;
+
+		index[j] = old[i];
+		used++;
+	}
+
+	if (retire(sh, index_block(old), 0) == -1){
+		free(index_block(index));
+		return -1;
+	}
+	__atomic_store_n(&sh->index, index, __ATOMIC_RELEASE);
+	sh->isize = size;
+	sh->iused = used;
+
+	info("  Redim index to %u (%u keys)", size, sh->iused);
+	return 0;
+}
+
+/**
+ * @brief S'assure qu'on peut insérer une clé sans dépasser 75% de remplissage
+ * @details Si l'index est trop rempli, il est reconstruit à une taille
+ * laissant les clés vivantes à 50% maximum.
+ *
+ * @return 0 ou -1
+ */
+static int index_reserve(dht_shard* sh){
+	if (sh->index != NULL && (sh->iused+1)*4 <= sh->isize*3)
+		return 0;
+
+	// Les tombstones disparaissent au redimensionnement
+	uint32_t size = DHT_INDEX_MIN;
+	while ((sh->keys+1)*2 > size)
+		size *= 2;
+
+	return index_resize(sh, size);
+}
+
+/**
+ * @brief Insère une clé absente de l'index
+ * @details Réutilise la première tombstone croisée.
+ * A appeler verrou de la partition pris en écriture, après index_reserve.
+ */
+static void index_insert(dht_shard* sh, uint32_t code, uint32_t head){
+	uint32_t mask = sh->isize - 1;
+	uint32_t i = code & mask;
+
+	while (sh->index[i].head != 0 && sh->index[i].head != DHT_TOMBSTONE)
+		i = (i+1) & mask;
+
+	if (sh->index[i].head == 0)
+		sh->iused++;
+	sh->keys++;
+
+	// Le code avant la tête, cf index_lookup
+	__atomic_store_n(&sh->index[i].code, code, __ATOMIC_RELAXED);
+	__atomic_store_n(&sh->index[i].head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Retire l'entrée i de la chaîne de sa clé
+ * @details Si c'était la dernière IP de la clé, la case devient une tombstone.
+ * A appeler verrou de la partition pris en écriture, avant d'effacer
+ * l'entrée.
+ */
+static void index_unlink(dht_shard* sh, unsigned int i){
+	hash* e = &sh->htable[i];
+	slot* s = index_find_entry(sh, i);
+
+	if (s == NULL){
+		warn("index_unlink: entry %u not indexed", i);
+		return;
+	}
+
+	// e garde son next: un lecteur arrêté sur e retrouve la suite de la chaîne
+	if (s->head == i+1){
+		__atomic_store_n(&s->head, e->next ? e->next : DHT_TOMBSTONE, 
+						 __ATOMIC_RELEASE);
+		if (s->head == DHT_TOMBSTONE)
+			sh->keys--;
+		return;
+	}
+
+	for (uint32_t p = s->head; p != 0; p = sh->htable[p-1].next){
+		if (sh->htable[p-1].next == i+1){
+			__atomic_store_n(&sh->htable[p-1].next, e->next, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Cherche l'entrée (h, ip) à partir de la case de sa clé
+ * @details A appeler verrou de la partition pris (lecture suffit).
+ */
+static hash* chain_find(dht_shard* sh, slot* s, const hkey* a){
+	if (s == NULL)
+		return NULL;
+
+	for (uint32_t p = s->head; p != 0; p = sh->htable[p-1].next){
+		if (addr_equal(&sh->htable[p-1], a))
+			return &sh->htable[p-1];
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Partition portant la clé k
+ */
+static dht_shard* shard_of(dht* d, const hkey* k){
+	return &d->shards[k->code >> (32 - DHT_SHARD_BITS)];
+}
+
+/**
+ * @brief Réveille le garbage collector au tout premier ajout
+ * @details Plusieurs threads peuvent ajouter en même temps dans des
+ * partitions différentes: seul le premier le réveille.
+ */
+static void dht_started(dht* d){
+	if (__sync_bool_compare_and_swap(&d->started, 0, 1)){
+		// Le premier hash a été ajouté
+		// On réveille le garbage collector qui attend p-e depuis le démarrage
+		pthread_mutex_lock(&d->gc);
+		pthread_cond_broadcast(&d->gc_wake);
+		pthread_mutex_unlock(&d->gc);
+	}
+}
+
+int dht_init(dht* d){
+	int tmp;
+	pthread_rwlockattr_t attr;
+
+	memset(d, 0, sizeof(dht));
+
+	// Les GET sont largement majoritaires: sans préférence pour les
+	// rédacteurs, un PUT ou le garbage collector pourraient attendre
+	// indéfiniment
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+	for (int i = 0; i < DHT_SHARDS; ++i){
+		dht_shard* sh = &d->shards[i];
+		arena_init(&sh->strings);
+		tmp = pthread_rwlock_init(&sh->lock, &attr);
+		  assert_return(tmp != 0, "rwlock init");
+
+		sh->timers = malloc(TNODE(0) * sizeof(tlink));
+		  assert_return(sh->timers == NULL, "malloc");
+		for (uint32_t n = 0; n < TNODE(0); ++n)
+			sh->timers[n].prev = sh->timers[n].next = n;
+		sh->wheel_now = time(NULL) - 1;
+		sh->epoch = &d->epoch;
+	}
+	// 0 = lecteur hors section
+	d->epoch = 1;
+	pthread_rwlockattr_destroy(&attr);
+
+	tmp = pthread_mutex_init(&d->gc, NULL);
+	  assert_return(tmp != 0, "mutex gc init");
+	tmp = pthread_cond_init(&d->gc_wake, NULL);
+	  assert_return(tmp != 0, "cond gc init");
+
+	return 0;
+}
+
+/**
+ * @brief Projette les gros tableaux en grandes pages
+ * @details MAP_HUGETLB si des grandes pages sont réservées
+ * (vm.nr_hugepages), sinon des pages normales signalées au noyau pour les
+ * transparent huge pages (MADV_HUGEPAGE). Les tableaux de moins de
+ * DHT_HUGE_PAGE octets restent sur le tas.
+ * A appeler avant le premier ajout (et avant dht_reserve).
+ *
+ * @param d DHT
+ * @return 0 ou -1 si la DHT a déjà des tableaux
+ */
+int dht_hugepages(dht* d){
+	for (int n = 0; n < DHT_SHARDS; ++n){
+		  assert_return(d->shards[n].htable != NULL, 
+		                "dht_hugepages: table already allocated");
+	}
+
+	for (int n = 0; n < DHT_SHARDS; ++n)
+		d->shards[n].huge = true;
+
+	return 0;
+}
+
+/**
+ * @brief Agrandit chaque partition pour 'entries' tuples (cf dht_reserve)
+ *
+ * @param pin la taille devient la taille minimale de htable
+ * @return 0 ou -1
+ */
+static int reserve(dht* d, unsigned int entries, int pin){
+	unsigned int per_shard = entries / DHT_SHARDS;
+	uint32_t size, isize = DHT_INDEX_MIN;
+	int ret = 0;
+
+	per_shard += per_shard / 16;
+	size = (per_shard + DHT_TABLE_MIN - 1) / DHT_TABLE_MIN * DHT_TABLE_MIN;
+	if (size < DHT_TABLE_MIN)
+		size = DHT_TABLE_MIN;
+	// Au pire une clé par tuple, à 50% de remplissage (cf index_reserve)
+	while (isize < per_shard*2)
+		isize *= 2;
+
+	for (int n = 0; n < DHT_SHARDS && ret == 0; ++n){
+		dht_shard* sh = &d->shards[n];
+		pthread_rwlock_wrlock(&sh->lock);
+
+		if (pin)
+			sh->minsize = size;
+		if (size > sh->size)
+			ret = table_resize(sh, size);
+		if (ret == 0 && isize > sh->isize)
+			ret = index_resize(sh, isize);
+
+		pthread_rwlock_unlock(&sh->lock);
+	}
+	  assert_return(ret == -1, "dht_reserve");
+
+	info("Reserved %u slots and %u index cells per shard", size, isize);
+	return 0;
+}
+
+/**
+ * @brief Dimensionne la DHT pour 'entries' tuples
+ * @details Chaque partition reçoit d'un coup le tableau et l'index
+ * qu'elle aurait atteints en grandissant (avec un peu de marge, les clés ne
+ * tombant pas toutes exactement au même rythme dans chaque partition): le
+ * chargement ne fait plus aucune copie. Le garbage collector ne rétrécit
+ * jamais le tableau en dessous de cette taille.
+ *
+ * @param d DHT
+ * @param entries nombre de tuples attendus
+ * @return 0 ou -1
+ */
+int dht_reserve(dht* d, unsigned int entries){
+	return reserve(d, entries, true);
+}
+
+/**
+ * @brief Libère la mémoire allouée dans la DHT
+ * @details
+ *
+ * @param d [description]
+ */
+void dht_free(dht* d){
+	dht_shard* sh;
+
+	// Attend la fin du passage en cours du garbage collector: il ne touche
+	// plus aux partitions ensuite
+	pthread_mutex_lock(&d->gc);
+	d->stopping = true;
+	pthread_cond_broadcast(&d->gc_wake);
+	pthread_mutex_unlock(&d->gc);
+
+	for (int n = 0; n < DHT_SHARDS; ++n){
+		sh = &d->shards[n];
+
+		// Les pages de l'arène partent d'un coup, seuls les gros blocs sont
+		// à libérer un par un
+		for (unsigned int i = 0; i < sh->cursor; ++i){
+			if (!(sh->timers[TNODE(i)].next & TLINK_MOVED))
+				entry_clear(sh, &sh->htable[i]);
+		}
+		arena_destroy(&sh->strings);
+		block_free(sh->htable, table_len(sh, sh->size));
+		sh->htable = NULL;
+		sh->cursor = sh->size = sh->count = 0;
+
+		free(index_block(sh->index));
+		sh->index = NULL;
+		while (sh->retired != NULL){
+			dht_retired* r = sh->retired;
+			sh->retired = r->next;
+			block_free(r->ptr, r->len);
+			free(r);
+		}
+		sh->limbo = sh->limbo_tail = 0;
+		free(sh->timers);
+		sh->timers = NULL;
+		sh->isize = 0;
+		sh->iused = 0;
+		sh->keys = 0;
+	}
+
+	// Plus aucun lecteur ne doit être en section
+	if (tls_dht == d)
+		tls_dht = NULL;
+	while (d->readers != NULL){
+		dht_reader* r = d->readers;
+		d->readers = r->next;
+		free(r);
+	}
+}
+
+/**
+ * @brief Entrée suivante d'une chaîne, sans verrou
+ * @details Les entrées retirées restent chaînées jusqu'à leur libération: on
+ * les saute.
+ * A appeler en section de lecture (cf dht_read_begin).
+ *
+ * @param sh partition
+ * @param next indice+1 de l'entrée à lire, mis à jour avec la suivante
+ * @return l'entrée ou NULL en fin de chaîne
+ */
+static hash* chain_next(dht_shard* sh, uint32_t* next){
+	hash* htable;
+	hash* e;
+
+	while (*next != 0){
+		htable = __atomic_load_n(&sh->htable, __ATOMIC_ACQUIRE);
+		e = &htable[*next-1];
+		*next = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&e->time, __ATOMIC_RELAXED) != 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Renvoie l'adresse du hash qui match le tuple (h, ip)
+ * @details Pour vérifier si un hash est déjà présent sous une même IP. Ca
+ * change si on fait un dht_add ou un dht_update à l'appel de la commande PUT.
+ *
+ * Sans verrou: à appeler en section de lecture (cf dht_read_begin), qui doit
+ * durer tant que l'entrée renvoyée est utilisée.
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param h string hash
+ * @param ip string ip
+ * @return ptr hash
+ */
+hash* dht_getWithIP(dht* d, char* h, char* ip){
+	hkey k, a;
+	dht_keyenc(h, &k);
+	dht_addrenc(ip, &a);
+
+	dht_shard* sh = shard_of(d, &k);
+	uint32_t next = index_lookup(sh, &k);
+
+	for (hash* e = chain_next(sh, &next); e != NULL; e = chain_next(sh, &next)){
+		if (addr_equal(e, &a))
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Copie les IPs valides de la clé h
+ * @details Tout est lu en un seul parcours de la chaîne de la clé, dans une
+ * section de lecture ouverte et refermée ici: le résultat appartient à
+ * l'appelant et ne dépend plus de la DHT. Plusieurs threads peuvent donc
+ * faire des GET en même temps, il n'y a aucun curseur partagé.
+ *
+ * Les IPs périmées (HASH_DEPRECATION_TIME) ne sont jamais renvoyées.
+ * Une entrée en cours de déplacement (cf entry_move) peut apparaître deux
+ * fois de suite dans la chaîne: elle n'est comptée qu'une fois.
+ *
+ * Au plus DHT_RESULT_MAX IPs par appel. S'il en reste, r->next indique où
+ * reprendre:
+ *
+ * ```C
+ *		dht_result r;
+ *		uint32_t from = 0;
+ *		do {
+ *			dht_lookup(&d, "8962235e792f6b112f04f", from, &r);
+ *			for (unsigned int i = 0; i < r.count; ++i)
+ *				... r.addrs[i] ...
+ *			from = r.next;
+ *		} while (from != 0);
+ * ```
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param h String hash
+ * @param from nombre d'IPs à sauter (0, ou r->next d'un appel précédent)
+ * @param r résultat
+ *
+ * @return r->count
+ */
+int dht_lookup(dht* d, char* h, uint32_t from, dht_result* r){
+	hkey k;
+
+	dht_keyenc(h, &k);
+	return dht_lookupk(d, &k, from, r);
+}
+
+/**
+ * @brief dht_lookup pour une clé déjà encodée
+ */
+int dht_lookupk(dht* d, const hkey* k, uint32_t from, dht_result* r){
+	dht_shard* sh = shard_of(d, k);
+	long int deadline = time(NULL) - HASH_DEPRECATION_TIME;
+	uint32_t pos = 0, next;
+	size_t used = 0, len;
+	hkey* a;
+	hash* e;
+	hash* prev = NULL;
+
+	r->count = 0;
+	r->next = 0;
+
+	dht_read_begin(d);
+
+	next = index_lookup(sh, k);
+	for (e = chain_next(sh, &next); e != NULL; e = chain_next(sh, &next)){
+		if (prev != NULL && entry_addr_equal(prev, e))
+			continue;
+		prev = e;
+		if (__atomic_load_n(&e->time, __ATOMIC_RELAXED) < deadline)
+			continue;
+		if (pos++ < from)
+			continue;
+
+		if (r->count == DHT_RESULT_MAX){
+			r->next = pos - 1;
+			break;
+		}
+
+		a = &r->addrs[r->count];
+		a->fmt = e->afmt;
+		a->len = e->alen;
+		a->code = 0;
+
+		if (e->afmt == ADDR_LONG){
+			// Le texte est copié: l'arène peut le libérer après la section
+			len = strlen(e->addr.ext) + 1;
+			if (used + len > sizeof(r->text)){
+				r->next = pos - 1;
+				break;
+			}
+			a->ext = memcpy(r->text + used, e->addr.ext, len);
+			used += len;
+		}
+		else {
+			memcpy(a->bin, e->addr.bin, DHT_ADDR_BIN);
+		}
+
+		r->count++;
+	}
+
+	dht_read_end(d);
+
+	return r->count;
+}
+
+/**
+ * @brief Enregistrement du thread courant auprès de d (créé au premier appel)
+ */
+static dht_reader* reader_self(dht* d){
+	dht_reader* me;
+
+	if (tls_dht == d)
+		return tls_reader;
+
+	me = calloc(1, sizeof(*me));
+	assert(me == NULL, "calloc reader");
+	me->next = __atomic_load_n(&d->readers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&d->readers, &me->next, me, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	tls_reader = me;
+	tls_dht = d;
+	return me;
+}
+
+/**
+ * @brief Entre en section de lecture
+ * @details Les lectures (dht_lookup, dht_getWithIP) ne prennent aucun
+ * verrou. Les entrées qu'elles voient restent lisibles jusqu'au
+ * dht_read_end correspondant: le garbage collector ne libère rien de ce qui a
+ * été retiré après l'entrée en section.
+ * 
+ * dht_lookup ouvre sa propre section; dht_getWithIP, qui renvoie une entrée
+ * de la DHT, doit être appelée en section.
+ * 
+ * Les sections peuvent s'imbriquer. Une section doit rester courte: elle
+ * retarde la réutilisation des emplacements libérés.
+ *
+ * ```C
+ *		dht_read_begin(&d);
+ *		hash* e = dht_getWithIP(&d, key, ip);
+ *		...
+ *		dht_read_end(&d);
+ * ```
+ * @param d DHT
+ */
+void dht_read_begin(dht* d){
+	dht_reader* me = reader_self(d);
+
+	if (me->depth++ > 0)
+		return;
+
+	// L'époque annoncée doit être visible des rédacteurs avant toute lecture
+	// de la DHT (cf retire_epoch)
+	__atomic_store_n(&me->epoch, __atomic_load_n(&d->epoch, __ATOMIC_ACQUIRE),
+					 __ATOMIC_SEQ_CST);
+	full_fence();
+}
+
+/**
+ * @brief Sort de la section de lecture ouverte par dht_read_begin
+ */
+void dht_read_end(dht* d){
+	dht_reader* me = reader_self(d);
+
+	if (me->depth > 0 && --me->depth == 0)
+		__atomic_store_n(&me->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Plus petite époque des lecteurs en section (ou l'époque courante)
+ * @details Tout ce qui a été retiré avant cette époque est hors de portée des
+ * lecteurs.
+ */
+static uint32_t reader_min(dht* d){
+	uint32_t min = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+	uint32_t e;
+
+	for (dht_reader* r = __atomic_load_n(&d->readers, __ATOMIC_ACQUIRE); 
+		 r != NULL; r = r->next){
+		e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (e != 0 && (int32_t)(e - min) < 0)
+			min = e;
+	}
+
+	return min;
+}
+
+/**
+ * @brief Ajoute (h, ip) au premier emplacement libre et l'indexe
+ * @details A appeler verrou de la partition pris en écriture.
+ *
+ * @param s Case d'index de h si la clé existe déjà, NULL sinon
+ * @return L'entrée ajoutée ou NULL
+ */
+static hash* add_locked(dht_shard* sh, const hkey* k, const hkey* a, slot* s){
+	hash* e = NULL;
+	long found = slot_alloc(sh);
+	if (found == -1)
+		return NULL;
+
+	e = &sh->htable[found];
+	memset(e, 0, sizeof(*e));
+
+	e->kfmt = k->fmt;
+	e->klen = k->len;
+	if (k->fmt == KEY_LONG){
+		e->key.ext = arena_strdup(&sh->strings, k->ext);
+		if (e->key.ext == NULL){
+			warn("arena_strdup");
+			e->kfmt = KEY_FREE;
+			slot_free(sh, found);
+			return NULL;
+		}
+	}
+	else {
+		memcpy(e->key.bin, k->bin, DHT_KEY_BIN);
+	}
+
+	e->afmt = a->fmt;
+	e->alen = a->len;
+	if (a->fmt == ADDR_LONG){
+		e->addr.ext = arena_strdup(&sh->strings, a->ext);
+		if (e->addr.ext == NULL){
+			warn("arena_strdup");
+			e->afmt = 0;
+			slot_free(sh, found);
+			return NULL;
+		}
+	}
+	else {
+		memcpy(e->addr.bin, a->bin, DHT_ADDR_BIN);
+	}
+
+	e->time = time(NULL);
+
+	// Chaînage: une nouvelle clé prend une case d'index, sinon on ajoute en fin
+	// de chaîne pour que GET renvoie les IPs dans l'ordre d'arrivée
+	if (s == NULL){
+		if (index_reserve(sh) == -1){
+			slot_free(sh, found);
+			return NULL;
+		}
+		index_insert(sh, k->code, found+1);
+	}
+	else {
+		uint32_t p = s->head;
+		while (sh->htable[p-1].next != 0)
+			p = sh->htable[p-1].next;
+		// Publie l'entrée, complète, aux lecteurs
+		__atomic_store_n(&sh->htable[p-1].next, found+1, __ATOMIC_RELEASE);
+	}
+
+	timer_arm(sh, found);
+	digest_flip(sh, e);
+	sh->count++;
+	return e;
+}
+
+/**
+ * @brief Rajoute toujours un hash à la DHT au premier emplacement libre
+ * @details Ne vérifie pas si le hash existe déjà dans le tableau.
+ * Gère tout seul l'agrandissement du tableau.
+ * Réutilise en priorité les emplacements de la liste libre
+ * Vérifie que le hash ne dépasse pas le HASH_DEPRECATION_TIME avant de le
+ * renvoyer
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param h Hash
+ * @param ip IP
+ * @return -1 ou 0
+ */
+int dht_add(dht* d, char* h, char* ip){
+	assert_return(h  == NULL, "Bad command (put - no hash provided)");
+	assert_return(ip == NULL, "Bad command (put - no IP provided)");
+
+	hkey k, a;
+	dht_keyenc(h, &k);
+	dht_addrenc(ip, &a);
+
+	dht_shard* sh = shard_of(d, &k);
+	pthread_rwlock_wrlock(&sh->lock);
+	hash* e = add_locked(sh, &k, &a, index_find(sh, &k));
+	if (e != NULL && d->wal != NULL)
+		wal_append(d->wal, &k, &a, e->time);
+	pthread_rwlock_unlock(&sh->lock);
+
+	assert_return(e == NULL, "dht_add");
+	info("  Added hash %s (%s)", h, ip);
+
+	dht_started(d);
+
+	return 0;
+}
+
+/**
+ * @brief Rajoute un tuple dans la DHT ou en met un à jour
+ * @details Un hash peut être mis à jour tant qu'il est dans la table.
+ * Le garbage collector passe toutes les GARBAGE_COL_TIME secondes
+ *
+ * La clé n'est cherchée qu'une fois: la même case d'index sert à la mise à
+ * jour ou à l'ajout.
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param h Hash
+ * @param ip IP
+ * @return -1 ou 0
+ */
+int dht_update(dht* d, char* h, char* ip, char* t){
+	assert_return(h == NULL, "Bad command (put - no hash provided)");
+	assert_return(ip   == NULL, "Bad command (put - no IP provided)");
+
+	hkey k, a;
+	dht_keyenc(h, &k);
+	dht_addrenc(ip, &a);
+
+	int added = dht_updatek(d, &k, &a, (t != NULL) ? atol(t) : 0);
+	  assert_return(added == -1, "dht_update");
+
+	if (added) {
+		info("  Added hash %s (%s)", h, ip);
+	}
+	else {
+		info("  Updated hash %s (%s)", h, ip);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Ajoute ou met à jour (k, a) avec le timestamp t (0 = maintenant)
+ * @details A appeler verrou de la partition pris en écriture.
+ *
+ * @return 1 si le tuple a été ajouté, 0 s'il a été mis à jour, -1 sinon
+ */
+static int update_locked(dht_shard* sh, const hkey* k, const hkey* a, long t){
+	int added = false;
+	slot* s = index_find(sh, k);
+	hash* e = chain_find(sh, s, a);
+
+	if (e == NULL) {
+		e = add_locked(sh, k, a, s);
+		added = true;
+	}
+	if (e == NULL)
+		return -1;
+
+	__atomic_store_n(&e->time, (t != 0) ? t : time(NULL), __ATOMIC_RELAXED);
+	timer_arm(sh, e - sh->htable);
+
+	return added;
+}
+
+/**
+ * @brief dht_update pour une clé et une adresse déjà encodées
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param k clé encodée (k->code rempli, cf dht_keycode)
+ * @param a adresse encodée
+ * @param t timestamp, 0 pour maintenant
+ * @return 1 si le tuple a été ajouté, 0 s'il a été mis à jour, -1 sinon
+ */
+int dht_updatek(dht* d, const hkey* k, const hkey* a, long t){
+	dht_shard* sh = shard_of(d, k);
+
+	if (t == 0)
+		t = time(NULL);
+
+	// Journalisé sous le verrou: le journal suit l'ordre des modifications
+	// de chaque clé (cf wal_checkpoint)
+	pthread_rwlock_wrlock(&sh->lock);
+	int added = update_locked(sh, k, a, t);
+	if (added != -1 && d->wal != NULL)
+		wal_append(d->wal, k, a, t);
+	pthread_rwlock_unlock(&sh->lock);
+
+	  assert_return(added == -1, "dht_updatek");
+
+	if (added)
+		dht_started(d);
+
+	return added;
+}
+
+/**
+ * @brief dht_updatek pour n tuples à la fois
+ * @details Chaque partition concernée n'est verrouillée qu'une fois: tous
+ * les tuples du lot qui y tombent sont insérés sous le même verrou. C'est ce
+ * qui rend une synchronisation (cf sync.h) bien moins chère que n PUT.
+ *
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param v tuples (clés prêtes, cf dht_keycode; time 0 pour maintenant)
+ * @param n nombre de tuples, au plus DHT_TUPLE_MAX
+ * @return Nombre de tuples ajoutés, -1 si l'un d'eux n'a pu être inséré
+ */
+int dht_updatev(dht* d, const dht_tuple* v, int n){
+	uint8_t done[DHT_TUPLE_MAX];
+	dht_shard* sh;
+	int added = 0, failed = 0, tmp;
+	long t, now = time(NULL);
+
+	  assert_return(n < 0 || n > DHT_TUPLE_MAX, "dht_updatev: %d tuples", n);
+	memset(done, 0, n);
+
+	for (int i = 0; i < n; ++i){
+		if (done[i])
+			continue;
+
+		sh = shard_of(d, &v[i].key);
+		pthread_rwlock_wrlock(&sh->lock);
+		for (int j = i; j < n; ++j){
+			if (done[j] || shard_of(d, &v[j].key) != sh)
+				continue;
+			done[j] = true;
+
+			t = (v[j].time != 0) ? v[j].time : now;
+			tmp = update_locked(sh, &v[j].key, &v[j].addr, t);
+			if (tmp == -1){
+				failed++;
+				continue;
+			}
+			added += tmp;
+			if (d->wal != NULL)
+				wal_append(d->wal, &v[j].key, &v[j].addr, t);
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+
+	if (added)
+		dht_started(d);
+
+	  assert_return(failed, "dht_updatev: %d tuple(s) lost", failed);
+
+	return added;
+}
+
+/**
+ * @brief Relève l'occupation de la DHT et de son arène
+ * @details Sert à dimensionner la table: slots - entries emplacements sont
+ * dans la liste libre, capacity - slots n'ont jamais servi.
+ * Les partitions sont relevées l'une après l'autre, le total n'est donc pas
+ * un instantané exact.
+ *
+ * @param d DHT
+ * @param st statistiques remplies
+ */
+void dht_getstats(dht* d, dht_stats* st){
+	dht_shard* sh;
+
+	memset(st, 0, sizeof(*st));
+
+	for (int n = 0; n < DHT_SHARDS; ++n){
+		sh = &d->shards[n];
+		pthread_rwlock_rdlock(&sh->lock);
+
+		st->entries        += sh->count;
+		st->slots          += sh->cursor;
+		st->capacity       += sh->size;
+		st->keys           += sh->keys;
+		st->isize          += sh->isize;
+		st->table_bytes    += sh->size*sizeof(hash) + sh->isize*sizeof(slot) +
+		                      TNODE(sh->size)*sizeof(tlink);
+		st->arena_used     += sh->strings.used;
+		st->arena_reserved += sh->strings.reserved;
+		st->arena_big      += sh->strings.big;
+
+		pthread_rwlock_unlock(&sh->lock);
+	}
+}
+
+/**
+ * @brief Appelle fn sur chaque entrée occupée de la DHT
+ * @details Chaque partition est parcourue verrou en lecture: fn ne doit pas
+ * modifier la DHT. S'arrête dès que fn renvoie autre chose que 0.
+ *
+ * @param d DHT
+ * @param fn fonction appelée sur chaque entrée
+ * @param arg passé tel quel à fn
+ * @return 0, ou la valeur non nulle renvoyée par fn
+ */
+int dht_foreach(dht* d, int (*fn)(hash* e, void* arg), void* arg){
+	int ret = 0;
+
+	for (int n = 0; n < DHT_SHARDS && ret == 0; ++n)
+		ret = dht_foreach_shard(d, n, fn, arg);
+
+	return ret;
+}
+
+/**
+ * @brief dht_foreach sur la seule partition n
+ * @details Permet de traiter la DHT par morceaux, sans garder de verrou
+ * entre deux partitions (cf sync_serve).
+ *
+ * @param d DHT
+ * @param n partition, de 0 à DHT_SHARDS - 1
+ * @param fn fonction appelée sur chaque entrée, verrou en lecture pris
+ * @param arg argument de fn
+ * @return 0, ou la première valeur non nulle renvoyée par fn
+ */
+int dht_foreach_shard(dht* d, int n, int (*fn)(hash* e, void* arg), 
+					  void* arg){
+	dht_shard* sh = &d->shards[n];
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&sh->lock);
+	for (unsigned int i = 0; i < sh->cursor && ret == 0; ++i){
+		if (slot_live(sh, i))
+			ret = fn(&sh->htable[i], arg);
+	}
+	pthread_rwlock_unlock(&sh->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Copie le condensé de la DHT: le XOR des tuples de chaque seau
+ * @details Les seaux d'une partition sont copiés verrou en lecture pris, les
+ * partitions l'une après l'autre. Le seau b est leaves[b], b étant les
+ * DHT_DIGEST_BITS bits de poids fort du code de la clé (cf dht_bucket).
+ *
+ * @param d DHT
+ * @param leaves DHT_DIGEST_BUCKETS condensés
+ */
+void dht_digest(dht* d, uint64_t* leaves){
+	const int per_shard = DHT_DIGEST_BUCKETS >> DHT_SHARD_BITS;
+	dht_shard* sh;
+
+	for (int n = 0; n < DHT_SHARDS; ++n){
+		sh = &d->shards[n];
+		pthread_rwlock_rdlock(&sh->lock);
+		memcpy(leaves + n * per_shard, sh->digest, sizeof(sh->digest));
+		pthread_rwlock_unlock(&sh->lock);
+	}
+}
+
+// Instantané (cf dht_save): "DHT1" dans l'ordre des octets de la machine
+#define SNAP_MAGIC   0x31544844u
+#define SNAP_VERSION 1
+// Entête d'un enregistrement: kfmt, afmt, klen, alen, time (64 bits)
+#define SNAP_RECORD  12
+// Tampon d'écriture
+#define SNAP_BUF     (256*1024)
+
+typedef struct s_snap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+	int64_t time;
+} snap_header;
+
+typedef struct s_snap_writer {
+	int fd;
+	uint8_t* buf;
+	size_t len;
+	uint64_t count;
+	int error;
+} snap_writer;
+
+static int snap_flush(snap_writer* w){
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < w->len){
+		n = write(w->fd, w->buf + done, w->len - done);
+		if (n == -1){
+			if (errno == EINTR)
+				continue;
+			w->error = errno;
+			return -1;
+		}
+		done += n;
+	}
+	w->len = 0;
+
+	return 0;
+}
+
+static void snap_put(snap_writer* w, const void* p, size_t len){
+	if (w->len + len > SNAP_BUF && snap_flush(w) == -1)
+		return;
+
+	// Une chaîne plus grosse que le tampon part directement
+	if (len > SNAP_BUF){
+		const uint8_t* c = p;
+		while (len > 0 && w->error == 0){
+			size_t part = (len > SNAP_BUF) ? SNAP_BUF : len;
+			memcpy(w->buf, c, part);
+			w->len = part;
+			snap_flush(w);
+			c += part;
+			len -= part;
+		}
+		return;
+	}
+
+	memcpy(w->buf + w->len, p, len);
+	w->len += len;
+}
+
+// Chaîne *_LONG: longueur (32 bits, '\0' compris) puis texte et '\0'
+static void snap_putstr(snap_writer* w, const char* str){
+	uint32_t len = strlen(str) + 1;
+
+	snap_put(w, &len, sizeof(len));
+	snap_put(w, str, len);
+}
+
+static int snap_entry(hash* e, void* arg){
+	snap_writer* w = arg;
+	uint8_t rec[SNAP_RECORD];
+	int64_t t = __atomic_load_n(&e->time, __ATOMIC_RELAXED);
+
+	rec[0] = e->kfmt;
+	rec[1] = e->afmt;
+	rec[2] = e->klen;
+	rec[3] = e->alen;
+	memcpy(&rec[4], &t, sizeof(t));
+	snap_put(w, rec, SNAP_RECORD);
+
+	switch (e->kfmt){
+		case KEY_SHA256: snap_put(w, e->key.bin, DHT_KEY_BIN); break;
+		case KEY_SHORT:  snap_put(w, e->key.bin, e->klen); break;
+		default:         snap_putstr(w, e->key.ext);
+	}
+	switch (e->afmt){
+		case ADDR_V6:
+		case ADDR_V4:    snap_put(w, e->addr.bin, DHT_ADDR_BIN); break;
+		case ADDR_SHORT: snap_put(w, e->addr.bin, e->alen); break;
+		default:         snap_putstr(w, e->addr.ext);
+	}
+
+	w->count++;
+	return w->error;
+}
+
+/**
+ * @brief Ecrit un instantané binaire de la DHT dans path
+ * @details Les entrées sont écrites telles qu'elles sont stockées, partition
+ * par partition (cf dht_load):
+ * - entête: magic "DHT1", version, nombre d'entrées, date de l'instantané
+ * - par entrée: kfmt, afmt, klen, alen, time (64 bits), puis la clé (32
+ *   octets pour KEY_SHA256, klen pour KEY_SHORT), puis l'adresse (16 octets
+ *   pour ADDR_V6/ADDR_V4, alen pour ADDR_SHORT). Les formats *_LONG sont
+ *   précédés de leur longueur (32 bits, '\0' compris).
+ *
+ * Entiers dans l'ordre des octets de la machine: l'instantané ne sert qu'à
+ * redémarrer le même serveur. L'instantané est écrit à côté (path.tmp) puis
+ * renommé: un arrêt en cours d'écriture laisse l'ancien intact.
+ *
+ * Chaque partition est parcourue verrou en lecture (cf dht_foreach): les
+ * GET continuent, les PUT de la partition en cours attendent.
+ *
+ * @param d DHT
+ * @param path fichier
+ * @return nombre d'entrées écrites ou -1
+ */
+long dht_save(dht* d, const char* path){
+	snap_header h;
+	snap_writer w;
+	char tmp[PATH_MAX];
+
+	  assert_return(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= 
+	                (int)sizeof(tmp), "dht_save: path too long");
+
+	memset(&w, 0, sizeof(w));
+	w.buf = malloc(SNAP_BUF);
+	  assert_return(w.buf == NULL, "malloc");
+
+	w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (w.fd == -1){
+		free(w.buf);
+		warn("dht_save: can't open %s", tmp);
+		return -1;
+	}
+
+	// L'entête est réécrite à la fin, avec le nombre d'entrées
+	memset(&h, 0, sizeof(h));
+	snap_put(&w, &h, sizeof(h));
+	dht_foreach(d, snap_entry, &w);
+	snap_flush(&w);
+
+	h.magic = SNAP_MAGIC;
+	h.version = SNAP_VERSION;
+	h.count = w.count;
+	h.time = time(NULL);
+	if (w.error == 0 && pwrite(w.fd, &h, sizeof(h), 0) != sizeof(h))
+		w.error = errno;
+	if (w.error == 0 && fsync(w.fd) == -1)
+		w.error = errno;
+
+	close(w.fd);
+	free(w.buf);
+
+	if (w.error == 0 && rename(tmp, path) == -1)
+		w.error = errno;
+	if (w.error != 0){
+		unlink(tmp);
+		errno = w.error;
+		warn("dht_save: can't write %s", path);
+		return -1;
+	}
+
+	info("Saved %lu entries to %s", (unsigned long)w.count, path);
+	return w.count;
+}
+
+// Forme d'un champ dans l'instantané
+#define SNAP_RAW   0 // bin octets
+#define SNAP_SHORT 1 // len octets
+#define SNAP_LONG  2 // longueur puis c string
+
+/**
+ * @brief Lit un champ de l'instantané dans k
+ * @return 0, ou -1 si l'instantané est tronqué ou corrompu
+ */
+static int snap_field(const uint8_t** p, const uint8_t* end, int form, 
+					  uint8_t fmt, uint8_t len, long bin, hkey* k){
+	uint32_t n;
+
+	memset(k, 0, sizeof(*k));
+	k->fmt = fmt;
+	k->len = len;
+
+	if (form != SNAP_LONG){
+		n = (form == SNAP_RAW) ? bin : len;
+		if (n > bin || end - *p < n)
+			return -1;
+		memcpy(k->bin, *p, n);
+		*p += n;
+		return 0;
+	}
+
+	if (end - *p < (long)sizeof(n))
+		return -1;
+	memcpy(&n, *p, sizeof(n));
+	*p += sizeof(n);
+	if (n == 0 || (uint64_t)(end - *p) < n || (*p)[n-1] != '\0')
+		return -1;
+	// Pointe dans la projection: la chaîne est copiée à l'ajout
+	k->ext = (char*)*p;
+	*p += n;
+	return 0;
+}
+
+/**
+ * @brief Recharge un instantané écrit par dht_save
+ * @details Le fichier est projeté en mémoire et les entrées insérées
+ * directement sous leur forme stockée: aucun texte à analyser. La DHT est
+ * d'abord dimensionnée pour toutes les entrées (pas de copie en cours de
+ * route, sauf si la réservation échoue), et comme l'instantané est écrit partition par partition, le
+ * verrou d'une partition n'est pris qu'une fois pour toutes ses entrées.
+ *
+ * Les entrées déjà échues (time + GARBAGE_COL_TIME dépassé) sont ignorées,
+ * les autres gardent leur timestamp.
+ *
+ * @param d DHT
+ * @param path fichier
+ * @return nombre d'entrées chargées, ou -1 (errno = ENOENT s'il n'y a pas
+ * d'instantané)
+ */
+long dht_load(dht* d, const char* path){
+	struct stat st;
+	snap_header h;
+	const uint8_t* map;
+	const uint8_t* p;
+	const uint8_t* end;
+	dht_shard* sh = NULL;
+	long loaded = 0, now = time(NULL);
+	uint64_t i, count;
+	int64_t t;
+	hkey k, a;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(h)){
+		close(fd);
+		warn("dht_load: %s is not a snapshot", path);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	  assert_return(map == MAP_FAILED, "mmap %s", path);
+	madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+	memcpy(&h, map, sizeof(h));
+	if (h.magic != SNAP_MAGIC || h.version != SNAP_VERSION){
+		munmap((void*)map, st.st_size);
+		warn("dht_load: %s is not a snapshot", path);
+		return -1;
+	}
+
+	// Un entête abîmé ne doit pas faire réserver plus que ce que le fichier
+	// peut contenir. Sans la réservation, la table grandit au fil du
+	// chargement: plus lent, pas faux
+	count = (st.st_size - sizeof(h)) / SNAP_RECORD;
+	if (h.count < count)
+		count = h.count;
+	if (reserve(d, (count > UINT32_MAX) ? UINT32_MAX : count, false) == -1)
+		warn("dht_load: can't pre-size the DHT for %lu entries, growing as "
+			 "they are loaded", (unsigned long)count);
+
+	p = map + sizeof(h);
+	end = map + st.st_size;
+	for (i = 0; i < h.count; ++i){
+		if (end - p < SNAP_RECORD)
+			break;
+		memcpy(&t, p + 4, sizeof(t));
+		uint8_t kfmt = p[0], afmt = p[1], klen = p[2], alen = p[3];
+		p += SNAP_RECORD;
+
+		if (kfmt < KEY_SHA256 || kfmt > KEY_LONG || 
+			afmt < ADDR_V6 || afmt > ADDR_LONG)
+			break;
+		if (snap_field(&p, end, (kfmt == KEY_SHA256) ? SNAP_RAW :
+					   (kfmt == KEY_SHORT) ? SNAP_SHORT : SNAP_LONG,
+					   kfmt, klen, DHT_KEY_BIN, &k) == -1 ||
+			snap_field(&p, end, (afmt <= ADDR_V4) ? SNAP_RAW :
+					   (afmt == ADDR_SHORT) ? SNAP_SHORT : SNAP_LONG,
+					   afmt, alen, DHT_ADDR_BIN, &a) == -1)
+			break;
+
+		if (t + GARBAGE_COL_TIME < now)
+			continue;
+
+		dht_keycode(&k);
+		if (shard_of(d, &k) != sh){
+			if (sh != NULL)
+				pthread_rwlock_unlock(&sh->lock);
+			sh = shard_of(d, &k);
+			pthread_rwlock_wrlock(&sh->lock);
+		}
+		if (update_locked(sh, &k, &a, t) != -1)
+			loaded++;
+	}
+	if (sh != NULL)
+		pthread_rwlock_unlock(&sh->lock);
+
+	munmap((void*)map, st.st_size);
+
+	check(i == h.count, "Loaded %ld entries from %s (%lu in snapshot)", 
+		  loaded, path, (unsigned long)h.count);
+
+	if (loaded > 0)
+		dht_started(d);
+
+	return loaded;
+}
+
+/**
+ * @brief Libère les entrées échues d'une partition
+ * @details Traite les cases de la roue des secondes écoulées depuis le dernier
+ * passage. Chaque case est d'abord détachée (WHEEL_PENDING) puis vidée par
+ * tranches de DHT_GC_SLICE entrées, en relâchant le verrou entre deux
+ * tranches: un PUT qui rafraîchit une entrée détachée la range simplement
+ * dans sa nouvelle case.
+ *
+ * Les entrées d'un tour de roue suivant (time + GARBAGE_COL_TIME au-delà de
+ * DHT_WHEEL_SLOTS secondes) sont remises dans leur case.
+ *
+ * @param sh partition
+ * @param now date courante
+ * @return nombre d'entrées libérées
+ */
+static unsigned int shard_expire(dht_shard* sh, long int now){
+	unsigned int freed = 0, seen;
+	tlink* t;
+	uint32_t b, n, i;
+	char key[DHT_KEY_STRLEN], ip[DHT_ADDR_STRLEN];
+
+	pthread_rwlock_wrlock(&sh->lock);
+
+	// Après une longue pause, un tour de roue couvre toutes les cases
+	long int sec = sh->wheel_now + 1;
+	if (now - sec >= DHT_WHEEL_SLOTS)
+		sec = now - DHT_WHEEL_SLOTS + 1;
+
+	for (; sec <= now; ++sec){
+		sh->wheel_now = sec;
+		b = sec & (DHT_WHEEL_SLOTS - 1);
+
+		// Détache la case: WHEEL_PENDING est toujours vide ici
+		t = sh->timers;
+		if (t[b].next != b){
+			t[WHEEL_PENDING].next = t[b].next;
+			t[WHEEL_PENDING].prev = t[b].prev;
+			t[t[b].next].prev = WHEEL_PENDING;
+			t[t[b].prev].next = WHEEL_PENDING;
+			t[b].next = t[b].prev = b;
+		}
+
+		seen = 0;
+		while ((n = sh->timers[WHEEL_PENDING].next) != WHEEL_PENDING){
+			if (seen++ == DHT_GC_SLICE){
+				pthread_rwlock_unlock(&sh->lock);
+				sched_yield();
+				pthread_rwlock_wrlock(&sh->lock);
+				seen = 0;
+				continue;
+			}
+
+			i = n - TNODE(0);
+			if (sh->htable[i].time + GARBAGE_COL_TIME < now){
+				info("  Free of (%s, %s)", dht_ipstr(&sh->htable[i], ip), 
+					 dht_keystr(&sh->htable[i], key));
+				index_unlink(sh, i);
+				slot_release(sh, i);
+				sh->count--;
+				freed++;
+			}
+			else {
+				timer_arm(sh, i);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&sh->lock);
+	return freed;
+}
+
+/**
+ * @brief Recopie l'entrée from dans l'emplacement libre to
+ * @details La copie est insérée juste avant l'original dans la chaîne de sa
+ * clé, puis l'original est sauté: un lecteur voit l'une, l'autre, ou les
+ * deux à la suite (cf dht_lookupk), jamais aucune. L'original part en
+ * attente de libération sans toucher à time, il reste lisible.
+ * A appeler verrou de la partition pris en écriture.
+ */
+static void entry_move(dht_shard* sh, uint32_t from, uint32_t to){
+	hash* src = &sh->htable[from];
+	hash* dst = &sh->htable[to];
+	slot* s = index_find_entry(sh, from);
+	uint32_t* link;
+
+	if (s == NULL){
+		warn("entry_move: entry %u not indexed", from);
+		return;
+	}
+
+	link = &s->head;
+	while (*link != from+1)
+		link = &sh->htable[*link-1].next;
+
+	timer_unlink(sh, TNODE(to));
+	memcpy(dst, src, sizeof(hash));
+	dst->next = from+1;
+	__atomic_store_n(link, to+1, __ATOMIC_RELEASE);
+	__atomic_store_n(&dst->next, src->next, __ATOMIC_RELEASE);
+
+	timer_arm(sh, to);
+	limbo_push(sh, from, TLINK_MOVED);
+}
+
+/**
+ * @brief Rend les emplacements libres de la fin du tableau
+ * @details Le cursor redescend jusqu'à la dernière entrée occupée ou en
+ * attente de libération.
+ * A appeler verrou de la partition pris en écriture.
+ */
+static void shard_trim(dht_shard* sh){
+	while (sh->cursor > 0 && sh->htable[sh->cursor-1].kfmt == KEY_FREE){
+		timer_unlink(sh, TNODE(sh->cursor-1));
+		sh->cursor--;
+	}
+}
+
+/**
+ * @brief Remplace htable par un tableau plus petit s'il est occupé à moins
+ * d'un quart
+ * @details Comme à l'agrandissement, l'ancien tableau est retiré: les
+ * lecteurs en cours le lisent encore.
+ * A appeler verrou de la partition pris en écriture, après shard_trim.
+ *
+ * @return 1 si le tableau a rétréci, 0 sinon, -1 en cas d'erreur
+ */
+static int shard_shrink(dht_shard* sh){
+	uint32_t size = sh->size;
+	uint32_t min = (sh->minsize > DHT_TABLE_MIN) ? sh->minsize : DHT_TABLE_MIN;
+
+	if (size <= min || sh->cursor*4 > size)
+		return 0;
+
+	// Le cursor arrive au plus à la moitié du nouveau tableau
+	while (size > min && sh->cursor*4 <= size)
+		size /= 2;
+	if (size < min)
+		size = min;
+
+	if (table_resize(sh, size) == -1)
+		return -1;
+
+	info("  Shrink hash table to %u", sh->size);
+	return 1;
+}
+
+/**
+ * @brief Referme les trous d'une partition
+ * @details Si plus d'un quart des emplacements sous le cursor sont libres ou
+ * en attente de libération, les entrées sont déplacées du haut du tableau
+ * vers les emplacements libres du bas (cf entry_move), en relâchant le verrou
+ * toutes les DHT_GC_SLICE cases examinées.
+ *
+ * Les emplacements quittés ne sont libérés qu'après le passage des lecteurs:
+ * c'est au passage suivant du garbage collector que shard_trim les rend et
+ * que shard_shrink réduit le tableau.
+ *
+ * @param sh partition
+ * @return nombre d'entrées déplacées
+ */
+static unsigned int shard_compact(dht_shard* sh){
+	unsigned int moved = 0, seen = 0;
+	uint32_t lo = 0, hi;
+
+	pthread_rwlock_wrlock(&sh->lock);
+
+	if (sh->cursor == 0 || (sh->cursor - sh->count)*4 <= sh->cursor){
+		pthread_rwlock_unlock(&sh->lock);
+		return 0;
+	}
+
+	// Seul le garbage collector fait descendre le cursor: hi reste valide
+	// d'une tranche à l'autre, les ajouts au-delà sont ignorés
+	hi = sh->cursor - 1;
+	while (lo < hi){
+		if (seen++ == DHT_GC_SLICE){
+			pthread_rwlock_unlock(&sh->lock);
+			sched_yield();
+			pthread_rwlock_wrlock(&sh->lock);
+			seen = 0;
+			continue;
+		}
+
+		if (sh->htable[lo].kfmt != KEY_FREE){
+			lo++;
+		}
+		else if (!slot_live(sh, hi)){
+			hi--;
+		}
+		else {
+			entry_move(sh, hi, lo);
+			lo++;
+			hi--;
+			moved++;
+		}
+	}
+
+	pthread_rwlock_unlock(&sh->lock);
+	return moved;
+}
+
+/**
+ * @brief Garbage collector: libère les entrées non rafraîchies depuis
+ * GARBAGE_COL_TIME secondes
+ * @details Se réveille chaque seconde et ne traite que les cases échues de la
+ * roue temporelle de chaque partition (cf shard_expire): le coût d'un passage
+ * est proportionnel à ce qui expire, pas à la taille de la table.
+ *
+ * Il compacte ensuite les partitions trouées (cf shard_compact) et rend au
+ * système la mémoire des tableaux remplacés.
+ *
+ * Un passage se fait d->gc tenue: dht_free attend qu'il soit fini.
+ *
+ * @param param dht*
+ */
+void* garbage_collector(void* param){
+	dht* d = (dht*)param;
+	unsigned int freed, moved, blocks;
+	int shrunk;
+	long int t;
+	struct timespec next;
+
+	pthread_mutex_lock(&d->gc);
+
+	// Rien à faire avant le premier hash (cf dht_started)
+	while (!__atomic_load_n(&d->started, __ATOMIC_ACQUIRE) && !d->stopping)
+		pthread_cond_wait(&d->gc_wake, &d->gc);
+
+	while (!d->stopping){
+		clock_gettime(CLOCK_REALTIME, &next);
+		next.tv_sec++;
+		while (!d->stopping &&
+			   pthread_cond_timedwait(&d->gc_wake, &d->gc, &next) == 0);
+		if (d->stopping)
+			break;
+
+		t = time(NULL);
+		freed = 0;
+
+		for (int n = 0; n < DHT_SHARDS; ++n)
+			freed += shard_expire(&d->shards[n], t);
+
+		// Libère ce qui a été retiré avant l'entrée du plus ancien lecteur,
+		// rend la fin des tableaux, puis ouvre une nouvelle époque
+		uint32_t min = reader_min(d);
+		blocks = shrunk = moved = 0;
+		for (int n = 0; n < DHT_SHARDS; ++n){
+			pthread_rwlock_wrlock(&d->shards[n].lock);
+			blocks += limbo_reclaim(&d->shards[n], min);
+			shard_trim(&d->shards[n]);
+			if (shard_shrink(&d->shards[n]) == 1)
+				shrunk++;
+			pthread_rwlock_unlock(&d->shards[n].lock);
+
+			moved += shard_compact(&d->shards[n]);
+		}
+		__atomic_add_fetch(&d->epoch, 1, __ATOMIC_SEQ_CST);
+
+		// Les gros blocs libérés restent sinon dans le tas
+		if (blocks > 0)
+			malloc_trim(0);
+
+		if (freed == 0 && moved == 0 && shrunk == 0)
+			continue;
+
+		info("Garbage collection: %u entries freed, %u moved, %d tables "
+			 "shrunk (%lds)", freed, moved, shrunk, time(NULL)-t);
+
+		dht_stats st;
+		dht_getstats(d, &st);
+		info("  %u entries in %u/%u slots, arena %zu/%zu bytes",
+			st.entries, st.slots, st.capacity, st.arena_used, st.arena_reserved);
+	}
+
+	pthread_mutex_unlock(&d->gc);
+
+	return NULL;
+}
@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "dhtclient.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[DHTCLI]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+static long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Nouvel id pour l'emplacement slot
+ * @details Les réponses aux ids précédents de l'emplacement (doublons,
+ * réponses à un renvoi) ne correspondent plus et sont ignorées.
+ */
+static uint32_t next_id(dhtclient* c, int slot){
+	return ++c->seq * DHTCLIENT_INFLIGHT + slot;
+}
+
+/**
+ * @brief Serveur à qui envoyer une requête
+ * @details Sans anneau, le serveur de dhtclient_open. Sinon les
+ * propriétaires de la clé, à tour de rôle à chaque renvoi.
+ */
+static struct sockaddr_in6* destination(dhtclient* c, dhtclient_req* r){
+	int owners[RING_NODES_MAX];
+	int n;
+
+	if (c->ring == NULL)
+		return &c->server;
+	n = ring_owners(c->ring, r->code, owners);
+	return &c->ring->nodes[owners[r->tries % n]];
+}
+
+/**
+ * @brief Met une requête en attente d'envoi (cf dhtclient_poll)
+ */
+static int send_req(dhtclient* c, dhtclient_req* r, long now){
+	r->deadline = now + c->timeout;
+	return (netqueue(&c->batch, destination(c, r), r->buf, r->len) == -1) ?
+		   -1 : 0;
+}
+
+/**
+ * @brief Réencode une requête sous un nouvel id, à partir de r->from
+ */
+static int relabel(dhtclient* c, dhtclient_req* r){
+	uint8_t buf[DHTCLIENT_REQUEST];
+	proto_msg m;
+	int len;
+
+	  assert_return(proto_decode(r->buf, r->len, &m) == -1,
+					"Can't decode request %u", r->id);
+	r->id = m.id = next_id(c, r - c->reqs);
+	m.from = r->from;
+	len = proto_encode(&m, buf, sizeof(buf));
+	  assert_return(len == -1, "Can't encode request %u", r->id);
+	memcpy(r->buf, buf, len);
+	r->len = len;
+
+	return 0;
+}
+
+/**
+ * @brief Garde l'anneau reçu dans un OP_RING ou un OP_MOVED
+ */
+static int load_ring(dhtclient* c, proto_msg* m){
+	if (c->ring == NULL)
+		c->ring = malloc(sizeof(ring));
+	  assert_return(c->ring == NULL, "malloc");
+
+	if (ring_decode(c->ring, m->cur, m->end - m->cur) == -1){
+		free(c->ring);
+		c->ring = NULL;
+		return -1;
+	}
+	info("Ring of %d servers", c->ring->count);
+
+	return 0;
+}
+
+/**
+ * @brief Libère l'emplacement d'une requête terminée, puis appelle son rappel
+ * @details L'emplacement est libre avant le rappel: il peut envoyer une
+ * nouvelle requête sans attendre.
+ */
+static void finish(dhtclient* c, dhtclient_req* r, int status,
+				   const hkey* addrs, int count){
+	dhtclient_cb cb = r->cb;
+	void* arg = r->arg;
+
+	r->busy = false;
+	c->free[c->nb_free++] = r - c->reqs;
+
+	if (cb != NULL)
+		cb(arg, status, addrs, count);
+}
+
+/**
+ * @brief Traite une réponse
+ * @return 1 si elle termine une requête, 0 sinon
+ */
+static int treat(dhtclient* c, void* buf, int len){
+	hkey addrs[DHT_RESULT_MAX];
+	dhtclient_req* r;
+	proto_msg m;
+	int n = 0, tmp = 0;
+
+	if (proto_decode(buf, len, &m) == -1){
+		warn("Bad answer (%d bytes)", len);
+		return 0;
+	}
+
+	// Doublon, ou réponse à une requête déjà terminée
+	r = &c->reqs[m.id % DHTCLIENT_INFLIGHT];
+	if (!r->busy || r->id != m.id)
+		return 0;
+
+	switch (m.op){
+	// Le serveur n'a pas la clé: on garde l'anneau pour toutes les requêtes
+	case OP_MOVED:
+		if (++r->moves > c->retries){
+			warn("Request %u redirected too many times", r->id);
+			finish(c, r, DHTCLIENT_ERROR, NULL, 0);
+			return 1;
+		}
+		if (load_ring(c, &m) == -1){
+			finish(c, r, DHTCLIENT_ERROR, NULL, 0);
+			return 1;
+		}
+		r->tries = 0;
+		if (relabel(c, r) == -1){
+			finish(c, r, DHTCLIENT_ERROR, NULL, 0);
+			return 1;
+		}
+		send_req(c, r, now_ms());
+		return 0;
+
+	// Pas d'anneau (réponse à OP_RING), ou PUT acquitté
+	case OP_END:
+		if (r->op == OP_GET)
+			return 0;
+		finish(c, r, DHTCLIENT_OK, NULL, 0);
+		return 1;
+
+	case OP_RING:
+		if (r->op != OP_RING)
+			return 0;
+		if (load_ring(c, &m) == -1){
+			finish(c, r, DHTCLIENT_ERROR, NULL, 0);
+			return 1;
+		}
+		finish(c, r, DHTCLIENT_OK, NULL, 0);
+		return 1;
+
+	case OP_ADDRS:
+		if (r->op != OP_GET)
+			return 0;
+		while (n < DHT_RESULT_MAX &&
+			   (tmp = proto_page_next(&m, &addrs[n])) == 1)
+			n++;
+		if (tmp == -1)
+			warn("Bad page for request %u", r->id);
+
+		if (m.from == 0){
+			finish(c, r, DHTCLIENT_OK, addrs, n);
+			return 1;
+		}
+
+		// Page suivante, sous un nouvel id
+		if (r->cb != NULL)
+			r->cb(r->arg, DHTCLIENT_MORE, addrs, n);
+		r->from = m.from;
+		r->tries = 0;
+		if (relabel(c, r) == -1){
+			finish(c, r, DHTCLIENT_ERROR, NULL, 0);
+			return 1;
+		}
+		send_req(c, r, now_ms());
+		return 0;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Renvoie les requêtes sans réponse, abandonne les autres
+ * @return nombre de requêtes abandonnées
+ */
+static int expire(dhtclient* c, long now){
+	int done = 0;
+
+	for (int i = 0; i < DHTCLIENT_INFLIGHT; ++i){
+		dhtclient_req* r = &c->reqs[i];
+		if (!r->busy || r->deadline > now)
+			continue;
+		if (r->tries >= c->retries){
+			warn("No answer to request %u", r->id);
+			finish(c, r, DHTCLIENT_NOANSWER, NULL, 0);
+			done++;
+			continue;
+		}
+		r->tries++;
+		info("Timeout, sending request %u again (%d)", r->id, r->tries);
+		send_req(c, r, now);
+	}
+
+	return done;
+}
+
+/**
+ * @brief Encode une requête dans un emplacement libre et la met en attente
+ * @details S'il n'y en a pas, attend que des requêtes se terminent.
+ */
+static int submit(dhtclient* c, proto_msg* m, dhtclient_cb cb, void* arg){
+	dhtclient_req* r;
+	int slot;
+
+	// Depuis un rappel, dhtclient_poll est déjà en train de lire un lot
+	  assert_return(c->nb_free == 0 && c->polling,
+					"%d requests in flight", DHTCLIENT_INFLIGHT);
+	while (c->nb_free == 0)
+		  assert_return(dhtclient_poll(c, -1) == -1, "Can't wait for a slot");
+
+	slot = c->free[--c->nb_free];
+	r = &c->reqs[slot];
+	r->id = m->id = next_id(c, slot);
+	r->len = proto_encode(m, r->buf, sizeof(r->buf));
+	if (r->len == -1){
+		c->free[c->nb_free++] = slot;
+		warn("Can't encode request");
+		return -1;
+	}
+
+	r->busy = true;
+	r->op = m->op;
+	r->code = m->key.code;
+	r->from = m->from;
+	r->tries = 0;
+	r->moves = 0;
+	r->cb = cb;
+	r->arg = arg;
+
+	return send_req(c, r, now_ms());
+}
+
+/**
+ * @brief Ouvre un client vers un serveur de la DHT
+ *
+ * @param c client à initialiser
+ * @param host serveur
+ * @param port port du serveur
+ * @return 0 ou -1
+ */
+int dhtclient_open(dhtclient* c, char* host, char* port){
+	int tmp;
+
+	memset(c, 0, sizeof(*c));
+
+	tmp = netopen(host, port, &c->net, 'w');
+	  assert_return(tmp == -1, "Can't reach [%s]:%s", host, port);
+	c->server = *c->net.sin6;
+
+	// Place pour les réponses de toutes les requêtes en vol: au-delà, le
+	// noyau les jette et elles sont redemandées au bout de timeout ms
+	// (plafonné par net.core.rmem_max)
+	tmp = DHTCLIENT_INFLIGHT * 2 * NET_MTU;
+	if (setsockopt(c->net.socket_desc, SOL_SOCKET, SO_RCVBUF,
+				   &tmp, sizeof(tmp)) == -1)
+		warn("setsockopt SO_RCVBUF");
+
+	c->reqs = calloc(DHTCLIENT_INFLIGHT, sizeof(*c->reqs));
+	if (c->reqs == NULL || netbatch_init(&c->net, &c->batch, 0) == -1){
+		free(c->reqs);
+		netclose(&c->net);
+		warn("Can't allocate the client");
+		return -1;
+	}
+
+	for (int i = 0; i < DHTCLIENT_INFLIGHT; ++i)
+		c->free[i] = DHTCLIENT_INFLIGHT - 1 - i;
+	c->nb_free = DHTCLIENT_INFLIGHT;
+	c->timeout = DHTCLIENT_TIMEOUT;
+	c->retries = DHTCLIENT_RETRIES;
+	// Un client relancé sur le même port ignore les réponses du précédent
+	c->seq = getpid() ^ time(NULL);
+
+	// Demande l'anneau, s'il y en a un, sans l'attendre: en attendant sa
+	// réponse, les requêtes partent au serveur donné
+	proto_msg m = {.op = OP_RING};
+	return submit(c, &m, NULL, NULL);
+}
+
+/**
+ * @brief Ferme le client, sans attendre les requêtes en vol
+ */
+void dhtclient_close(dhtclient* c){
+	c->net.batch = NULL;
+	netbatch_free(&c->batch);
+	netclose(&c->net);
+	free(c->reqs);
+	free(c->ring);
+	c->reqs = NULL;
+	c->ring = NULL;
+}
+
+/**
+ * @brief Demande les adresses d'une clé
+ * @details Le rappel est appelé pour chaque page d'adresses, avec
+ * DHTCLIENT_MORE sauf pour la dernière.
+ *
+ * @param c client
+ * @param k clé (cf dht_keyenc), copiée
+ * @param cb rappel, ou NULL
+ * @param arg argument du rappel
+ * @return 0 ou -1
+ */
+int dhtclient_get(dhtclient* c, const hkey* k, dhtclient_cb cb, void* arg){
+	proto_msg m = {.op = OP_GET, .key = *k};
+	return submit(c, &m, cb, arg);
+}
+
+/**
+ * @brief Ajoute une adresse à une clé
+ *
+ * @param c client
+ * @param k clé (cf dht_keyenc), copiée
+ * @param a adresse (cf dht_addrenc), copiée
+ * @param cb rappel, appelé une fois le PUT acquitté, ou NULL
+ * @param arg argument du rappel
+ * @return 0 ou -1
+ */
+int dhtclient_put(dhtclient* c, const hkey* k, const hkey* a,
+				  dhtclient_cb cb, void* arg){
+	proto_msg m = {.op = OP_PUT, .key = *k, .addr = *a};
+	return submit(c, &m, cb, arg);
+}
+
+/**
+ * @brief Envoie les requêtes en attente et traite les réponses
+ * @details Attend au plus ms millisecondes (-1: jusqu'au prochain renvoi)
+ * qu'une réponse arrive, lit toutes celles arrivées et appelle leurs rappels,
+ * puis renvoie les requêtes dont le délai est écoulé.
+ *
+ * @param c client
+ * @param ms attente maximale, 0 pour ne pas attendre
+ * @return nombre de requêtes terminées, ou -1
+ */
+int dhtclient_poll(dhtclient* c, int ms){
+	struct pollfd pfd = {.fd = c->net.socket_desc, .events = POLLIN};
+	long now = now_ms(), next = -1;
+	int done = 0, tmp;
+	char* buf;
+
+	// Un échec d'envoi est rattrapé par les renvois
+	netflush(&c->batch);
+
+	for (int i = 0; i < DHTCLIENT_INFLIGHT; ++i){
+		if (c->reqs[i].busy && (next == -1 || c->reqs[i].deadline < next))
+			next = c->reqs[i].deadline;
+	}
+	// Rien en vol: pas de réponse à attendre
+	if (next == -1 && ms < 0)
+		return 0;
+	if (next != -1 && (ms < 0 || next - now < ms))
+		ms = (next > now) ? next - now : 0;
+
+	tmp = poll(&pfd, 1, ms);
+	  assert_return(tmp == -1 && errno != EINTR, "poll");
+
+	if (tmp == 1){
+		tmp = netlisten_batch(&c->net);
+		  assert_return(tmp == -1, "Can't read the answers");
+		c->polling = true;
+		for (int i = 0; i < tmp; ++i){
+			buf = netbatch_get(&c->net, i, NULL);
+			if (buf != NULL)
+				done += treat(c, buf, c->batch.in[i].msg_len);
+		}
+		c->polling = false;
+	}
+
+	done += expire(c, now_ms());
+	netflush(&c->batch);
+
+	return done;
+}
+
+/**
+ * @brief Attend la fin de toutes les requêtes en vol
+ * @return 0 ou -1
+ */
+int dhtclient_wait(dhtclient* c){
+	while (dhtclient_pending(c) > 0)
+		  assert_return(dhtclient_poll(c, -1) == -1, "dhtclient_wait");
+	return 0;
+}
+
+/**
+ * @brief Nombre de requêtes en vol
+ */
+int dhtclient_pending(const dhtclient* c){
+	return DHTCLIENT_INFLIGHT - c->nb_free;
+}
+
+// Résultat d'une requête bloquante
+typedef struct s_dhtclient_wait {
+	char (*ips)[DHT_ADDR_STRLEN];
+	int max;
+	int count;
+	int status;
+	int done;
+} dhtclient_wait_ctx;
+
+static void wait_cb(void* arg, int status, const hkey* addrs, int count){
+	dhtclient_wait_ctx* w = arg;
+	char str[DHT_ADDR_STRLEN];
+
+	for (int i = 0; i < count; ++i, ++w->count){
+		if (w->count < w->max)
+			snprintf(w->ips[w->count], DHT_ADDR_STRLEN, "%s",
+					 proto_addrstr(&addrs[i], str));
+	}
+	w->status = status;
+	w->done = (status != DHTCLIENT_MORE);
+}
+
+static int wait_for(dhtclient* c, dhtclient_wait_ctx* w){
+	while (!w->done)
+		  assert_return(dhtclient_poll(c, -1) == -1, "Can't wait for an answer");
+	return (w->status == DHTCLIENT_OK) ? 0 : -1;
+}
+
+/**
+ * @brief Demande les adresses d'une clé et attend la réponse
+ *
+ * @param c client
+ * @param k clé (cf dht_keyenc)
+ * @param ips reçoit les max premières adresses, sous forme de texte
+ * @param max taille de ips
+ * @return nombre d'adresses de la clé (éventuellement plus que max), ou -1
+ */
+int dhtclient_get_wait(dhtclient* c, const hkey* k,
+					   char (*ips)[DHT_ADDR_STRLEN], int max){
+	dhtclient_wait_ctx w = {.ips = ips, .max = max};
+
+	  assert_return(dhtclient_get(c, k, &wait_cb, &w) == -1, "GET failed");
+	  assert_return(wait_for(c, &w) == -1, "No answer to the GET");
+	return w.count;
+}
+
+/**
+ * @brief Ajoute une adresse à une clé et attend l'acquittement
+ * @return 0 ou -1
+ */
+int dhtclient_put_wait(dhtclient* c, const hkey* k, const hkey* a){
+	dhtclient_wait_ctx w = {0};
+
+	  assert_return(dhtclient_put(c, k, a, &wait_cb, &w) == -1, "PUT failed");
+	  assert_return(wait_for(c, &w) == -1, "No answer to the PUT");
+	return 0;
+}
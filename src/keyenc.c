@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "keyenc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[KEYENC]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+/**
+ * @brief FNV-1a 32 bits, pour les clés qui ne sont pas des SHA-256
+ */
+static uint32_t fnv1a(const uint8_t* p, size_t len){
+	uint32_t code = 2166136261u;
+
+	for (size_t i = 0; i < len; ++i){
+		code ^= p[i];
+		code *= 16777619u;
+	}
+
+	return code;
+}
+
+/**
+ * @brief Code de hachage d'un SHA-256 binaire
+ * @details Les 32 octets sont repliés par XOR puis mélangés (finaliseur de
+ * murmur3): un vrai SHA-256 n'en a pas besoin, mais une clé hexa au préfixe
+ * constant ne doit pas faire dégénérer le sondage.
+ */
+static uint32_t bincode(const uint8_t* bin){
+	uint32_t w, code = 0;
+
+	for (int i = 0; i < DHT_KEY_BIN; i += sizeof(w)){
+		memcpy(&w, &bin[i], sizeof(w));
+		code ^= w;
+	}
+
+	code ^= code >> 16;
+	code *= 0x85ebca6bu;
+	code ^= code >> 13;
+	code *= 0xc2b2ae35u;
+	code ^= code >> 16;
+
+	return code;
+}
+
+static int hexval(char c){
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+ * @brief Calcule le code de hachage d'une clé déjà encodée
+ * @details Pour les clés reçues sous forme binaire (cf proto.h), qui ne
+ * passent pas par dht_keyenc. Même code que dht_keyenc pour une même clé.
+ *
+ * @param k clé encodée, k->code est rempli
+ */
+void dht_keycode(hkey* k){
+	switch (k->fmt){
+		case KEY_SHA256:
+			k->code = bincode(k->bin);
+			break;
+		case KEY_SHORT:
+			k->code = fnv1a(k->bin, k->len);
+			break;
+		default:
+			k->code = fnv1a((const uint8_t*)k->ext, strlen(k->ext));
+	}
+}
+
+/**
+ * @brief Encode une clé texte sous sa forme stockée dans la DHT
+ * @details Un SHA-256 en hexa minuscule devient 32 octets binaires. Le reste
+ * est gardé sous forme de texte.
+ *
+ * Pour KEY_LONG, k->ext pointe sur h: la clé n'est copiée qu'à l'ajout.
+ *
+ * @param h c string clé
+ * @param k clé encodée
+ */
+void dht_keyenc(const char* h, hkey* k){
+	size_t len = strlen(h);
+
+	memset(k, 0, sizeof(*k));
+
+	if (len == 2*DHT_KEY_BIN){
+		int hi, lo;
+		size_t i;
+		for (i = 0; i < DHT_KEY_BIN; ++i){
+			hi = hexval(h[2*i]);
+			lo = hexval(h[2*i+1]);
+			if (hi < 0 || lo < 0)
+				break;
+			k->bin[i] = (hi << 4) | lo;
+		}
+
+		if (i == DHT_KEY_BIN){
+			k->fmt = KEY_SHA256;
+			k->code = bincode(k->bin);
+			return;
+		}
+		memset(k->bin, 0, DHT_KEY_BIN);
+	}
+
+	k->code = fnv1a((const uint8_t*)h, len);
+
+	if (len <= DHT_KEY_BIN){
+		k->fmt = KEY_SHORT;
+		k->len = len;
+		memcpy(k->bin, h, len);
+	}
+	else {
+		k->fmt = KEY_LONG;
+		k->ext = (char*)h;
+	}
+}
+
+/**
+ * @brief Encode une IP texte sous sa forme stockée dans la DHT
+ * @details Seules les adresses écrites sous forme canonique passent en
+ * binaire, pour que dht_ipstr restitue exactement ce que le client a envoyé.
+ * Les "IPs" qui n'en sont pas (cf test.sh) restent du texte.
+ *
+ * @param ip c string ip
+ * @param a adresse encodée
+ */
+void dht_addrenc(const char* ip, hkey* a){
+	char buf[DHT_ADDR_STRLEN];
+	size_t len = strlen(ip);
+
+	memset(a, 0, sizeof(*a));
+
+	if (inet_pton(AF_INET6, ip, a->bin) == 1 &&
+		inet_ntop(AF_INET6, a->bin, buf, sizeof(buf)) != NULL &&
+		strcmp(buf, ip) == 0)
+	{
+		a->fmt = ADDR_V6;
+		return;
+	}
+
+	memset(a->bin, 0, DHT_KEY_BIN);
+	if (inet_pton(AF_INET, ip, &a->bin[12]) == 1 &&
+		inet_ntop(AF_INET, &a->bin[12], buf, sizeof(buf)) != NULL &&
+		strcmp(buf, ip) == 0)
+	{
+		a->fmt = ADDR_V4;
+		a->bin[10] = 0xff;
+		a->bin[11] = 0xff;
+		return;
+	}
+
+	memset(a->bin, 0, DHT_KEY_BIN);
+	if (len <= DHT_ADDR_BIN){
+		a->fmt = ADDR_SHORT;
+		a->len = len;
+		memcpy(a->bin, ip, len);
+	}
+	else {
+		a->fmt = ADDR_LONG;
+		a->ext = (char*)ip;
+	}
+}
+
+/**
+ * @brief Restitue la clé d'une entrée sous forme de texte
+ *
+ * @param e entrée
+ * @param buf buffer d'au moins DHT_KEY_STRLEN octets
+ * @return buf, ou la clé elle-même pour KEY_LONG
+ */
+const char* dht_keystr(const hash* e, char* buf){
+	static const char hex[] = "0123456789abcdef";
+
+	switch (e->kfmt){
+		case KEY_SHA256:
+			for (int i = 0; i < DHT_KEY_BIN; ++i){
+				buf[2*i]   = hex[e->key.bin[i] >> 4];
+				buf[2*i+1] = hex[e->key.bin[i] & 0xf];
+			}
+			buf[2*DHT_KEY_BIN] = '\0';
+			return buf;
+		case KEY_SHORT:
+			memcpy(buf, e->key.bin, e->klen);
+			buf[e->klen] = '\0';
+			return buf;
+		case KEY_LONG:
+			return e->key.ext;
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * @brief Restitue l'IP d'une entrée sous forme de texte
+ *
+ * @param e entrée
+ * @param buf buffer d'au moins DHT_ADDR_STRLEN octets
+ * @return buf, ou l'IP elle-même pour ADDR_LONG
+ */
+const char* dht_ipstr(const hash* e, char* buf){
+	switch (e->afmt){
+		case ADDR_V6:
+			return inet_ntop(AF_INET6, e->addr.bin, buf, DHT_ADDR_STRLEN);
+		case ADDR_V4:
+			return inet_ntop(AF_INET, &e->addr.bin[12], buf, DHT_ADDR_STRLEN);
+		case ADDR_SHORT:
+			memcpy(buf, e->addr.bin, e->alen);
+			buf[e->alen] = '\0';
+			return buf;
+		case ADDR_LONG:
+			return e->addr.ext;
+		default:
+			return NULL;
+	}
+}
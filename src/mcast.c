@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "mcast.h"
+#include "swim.h"
+#include "sync.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[MCAST ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// Corps d'un OP_HELLO: adresse, port
+#define MCAST_NODE 18
+
+// Socket du groupe: destination des envois, et reçoit tout ce qui y passe
+static nethandle mc_sock;
+static dht* mc_dht;
+static struct sockaddr_in6 mc_self;
+// Id de nos messages, pour ignorer ceux qui nous reviennent
+static uint32_t mc_origin;
+static int mc_interval = MCAST_INTERVAL;
+static pthread_t mc_thread;
+static int mc_running = false;
+static int mc_stopping = false;
+
+// Annonce en cours de remplissage, protégée par mc_lock
+static pthread_mutex_t mc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mc_announce = false;
+static uint8_t mc_buf[NET_PAYLOAD];
+static proto_page mc_page;
+static uint32_t mc_seq = 0;
+// Instant (ms) du premier PUT de l'annonce en cours
+static long mc_first = 0;
+
+static long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Envoie l'annonce en cours au groupe, et en commence une autre
+ * @details mc_lock pris
+ */
+static int flush_locked(void){
+	int len, tmp = 0;
+
+	if (mc_page.count > 0){
+		len = proto_page_end(&mc_page, ++mc_seq);
+		tmp = netsend_binary(&mc_sock, mc_buf, len);
+		if (tmp == -1)
+			warn("Announce %u lost (%d PUT)", mc_seq, mc_page.count);
+	}
+	proto_announce_init(&mc_page, mc_buf, sizeof(mc_buf), mc_origin);
+	mc_first = 0;
+
+	return (tmp == -1) ? -1 : 0;
+}
+
+/**
+ * @brief Annonce notre adresse d'écoute au groupe
+ */
+static int hello(void){
+	uint8_t body[MCAST_NODE], buf[PROTO_HEADER + MCAST_NODE];
+	proto_msg m = {.op = OP_HELLO, .id = mc_origin, .cur = body,
+				   .end = body + sizeof(body)};
+	int len;
+
+	memcpy(body, &mc_self.sin6_addr, 16);
+	memcpy(body + 16, &mc_self.sin6_port, 2);
+	len = proto_encode(&m, buf, sizeof(buf));
+	  assert_return(len == -1, "Can't encode hello");
+
+	return (netsend_binary(&mc_sock, buf, len) == -1) ? -1 : 0;
+}
+
+/**
+ * @brief Traite un message reçu du groupe
+ * @details Un OP_HELLO qui annonce [::] (serveur lié à toutes ses adresses)
+ * désigne l'adresse d'où il a été envoyé.
+ */
+static int treat(void* buf, int len, nethandle* sender){
+	struct sockaddr_in6 node;
+	proto_msg m;
+
+	  assert_return(proto_decode(buf, len, &m) == -1, "Bad multicast message");
+	if (m.id == mc_origin)
+		return 0;
+
+	switch (m.op){
+		case OP_ANNOUNCE:
+			return sync_insert(mc_dht, &m);
+
+		case OP_HELLO:
+			  assert_return(m.end - m.cur < MCAST_NODE, "Truncated hello");
+			memset(&node, 0, sizeof(node));
+			node.sin6_family = AF_INET6;
+			memcpy(&node.sin6_addr, m.cur, 16);
+			memcpy(&node.sin6_port, m.cur + 16, 2);
+			if (IN6_IS_ADDR_UNSPECIFIED(&node.sin6_addr)){
+				node.sin6_addr = sender->sin6->sin6_addr;
+				node.sin6_scope_id = sender->sin6->sin6_scope_id;
+			}
+			return swim_add(&node);
+
+		default:
+			warn("Unexpected opcode %d on the multicast group", m.op);
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Boucle du groupe: réception, annonces en retard, OP_HELLO
+ * @details Se réveille au moins toutes les mc_interval ms pour envoyer
+ * l'annonce en cours si son premier PUT a assez attendu.
+ */
+static void* mcast_loop(void* param){
+	struct pollfd pfd = {.fd = mc_sock.socket_desc, .events = POLLIN};
+	long next_hello = 0, now;
+	nethandle sender;
+	(void)param;
+
+	while (!__atomic_load_n(&mc_stopping, __ATOMIC_ACQUIRE)){
+		if (poll(&pfd, 1, mc_interval) == 1 &&
+			netlisten(&mc_sock, &sender) > 0)
+			treat(mc_sock.buf, mc_sock.length, &sender);
+
+		now = now_ms();
+		pthread_mutex_lock(&mc_lock);
+		if (mc_first != 0 && now - mc_first >= mc_interval)
+			flush_locked();
+		pthread_mutex_unlock(&mc_lock);
+
+		if (now >= next_hello){
+			hello();
+			next_hello = now + MCAST_HELLO;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Rejoint le groupe multicast et lance sa boucle
+ *
+ * @param d DHT où insérer les annonces reçues
+ * @param s socket d'écoute du serveur: son adresse est annoncée
+ * @param group adresse du groupe
+ * @param port port du groupe
+ * @param iface interface, NULL pour celle de la route du groupe
+ * @param interval millisecondes au plus entre un PUT et son annonce
+ * @param announce false pour n'utiliser le groupe que pour la découverte
+ * (anneau, cf ring.h: les PUT ne vont qu'à leurs propriétaires)
+ * @return 0 ou -1
+ */
+int mcast_start(dht* d, nethandle* s, char* group, char* port, char* iface,
+				int interval, int announce){
+	int tmp;
+
+	  assert_return(mc_running, "Multicast already started");
+	tmp = netmulticast(group, port, iface, &mc_sock);
+	  assert_return(tmp == -1, "Can't join the multicast group");
+	mc_sock.bufsize = NET_PAYLOAD + 1;
+
+	mc_dht = d;
+	mc_self = *s->sin6;
+	mc_origin = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^
+				mc_self.sin6_port;
+	mc_interval = interval;
+	mc_announce = announce;
+	proto_announce_init(&mc_page, mc_buf, sizeof(mc_buf), mc_origin);
+
+	tmp = pthread_create(&mc_thread, NULL, &mcast_loop, NULL);
+	if (tmp != 0){
+		netclose(&mc_sock);
+		warn("Can't start the multicast thread");
+		return -1;
+	}
+	__atomic_store_n(&mc_running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief Annonce un PUT au groupe, avec ses voisins
+ * @details Appelé par les workers après chaque PUT. L'annonce part dès
+ * qu'elle est pleine, sinon au plus tard mc_interval ms après son premier
+ * PUT (cf mcast_loop). Sans effet sans --multicast, ou en anneau.
+ *
+ * @param k clé
+ * @param a adresse
+ * @return 0 ou -1
+ */
+int mcast_put(const hkey* k, const hkey* a){
+	long now = time(NULL);
+	int tmp = 0;
+
+	if (!__atomic_load_n(&mc_running, __ATOMIC_ACQUIRE) || !mc_announce)
+		return 0;
+
+	pthread_mutex_lock(&mc_lock);
+	if (proto_batch_add(&mc_page, k, a, now) == -1){
+		tmp = flush_locked();
+		if (proto_batch_add(&mc_page, k, a, now) == -1)
+			tmp = -1;
+	}
+	if (mc_first == 0 && mc_page.count > 0)
+		mc_first = now_ms();
+	pthread_mutex_unlock(&mc_lock);
+
+	return tmp;
+}
+
+/**
+ * @brief Envoie la dernière annonce et quitte le groupe
+ * @details A appeler une fois les workers arrêtés.
+ */
+void mcast_stop(void){
+	if (!__atomic_load_n(&mc_running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&mc_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(mc_thread, NULL);
+
+	pthread_mutex_lock(&mc_lock);
+	flush_locked();
+	pthread_mutex_unlock(&mc_lock);
+
+	netclose(&mc_sock);
+	__atomic_store_n(&mc_running, false, __ATOMIC_RELEASE);
+}
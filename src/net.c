@@ -2,6 +2,8 @@
 #include "net.h"
 
 #include <net/if.h>
+#include <ifaddrs.h>
+#include <sys/ioctl.h>
 
 // Macros d'affichage.
 // Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
@@ -85,14 +87,17 @@ struct addrinfo *resolveHost(char* hostname, char* port){
  * @param host c string host
  * @param port c string port
  * @param s pointeur sur nethandle de destination
- * @param c_mode 'r' pour écouter, ou 'w' pour envoyer
+ * @param c_mode 'r' pour écouter, 'w' pour envoyer, ou 's' pour écouter sur
+ * une adresse partagée avec d'autres sockets (SO_REUSEPORT: le noyau répartit
+ * les datagrammes entre toutes les sockets liées à la même adresse)
  * @return 0 ou -1 si erreur
  */
 int netopen(char* host, char* port, nethandle* s, char c_mode){
 	int mode = SEND;
+	int shared = (c_mode == 's' || c_mode == 'S');
 
 	// Si je suis en mode SEND, je ne binderai pas ma socket
-	if (c_mode == 'r' || c_mode == 'R')
+	if (c_mode == 'r' || c_mode == 'R' || shared)
 		mode = LISTEN;
 
 	memset(s, 0, sizeof(*s));
@@ -107,6 +112,16 @@ int netopen(char* host, char* port, nethandle* s, char c_mode){
 			continue;
 		}
 
+		if (shared){
+			int one = 1;
+			if (setsockopt(s->socket_desc, SOL_SOCKET, SO_REUSEPORT,
+						   &one, sizeof(one)) == -1){
+				close(s->socket_desc);
+				warn("setsockopt SO_REUSEPORT");
+				continue;
+			}
+		}
+
 		if (mode == LISTEN){
 			if (host != NULL){
 				if (bind(s->socket_desc, p->ai_addr, p->ai_addrlen) == -1) {
@@ -253,142 +268,137 @@ int addrinfo_to_nethandle(struct addrinfo* ainfo, nethandle* s){
  * Car recvfrom renvoie un sockaddr pour nous permettre de recontacter le noeud
  * nous ayant envoyé un message
  * 
- * @param sockaddr_in6 Sockaddr à convertir
+ * Aucune allocation et aucune socket: la réponse partira de la socket d'écoute
+ * (donc du port du serveur) vers l'adresse stockée dans s->peer.
+ * Le nethandle ne possède rien, il ne faut pas le passer à netclose.
+ * 
+ * @param sin6 Sockaddr à convertir
+ * @param listen Nethandle ayant reçu le message
  * @param s Pointeur vers nethandle dans lequel la conversion sera faite
  * 
  * @return 0 ou -1
  */
-int sockaddr_to_nethandle(struct sockaddr_in6* sin6, nethandle* s){
-	// todo: gestion d'erreurs
-	memset(s, 0, sizeof(nethandle));
-
-
+int sockaddr_to_nethandle(struct sockaddr_in6* sin6, nethandle* listen, 
+						  nethandle* s){
 	assert_return(sin6->sin6_family != AF_INET6, "sockaddr_to_nethandle IPV4");
 
-	s->sin6 = sin6;
-	s->addr = malloc(INET6_ADDRSTRLEN);
-	  assert_return(s->addr == NULL, "malloc");
-	memset(s->addr, 0, INET6_ADDRSTRLEN);
-
-	const char* addr;
-	addr = inet_ntop(
-		AF_INET6, 
-		// Convertit la sock_addr dans addrinfo en sockaddr_in6* pour récupérer
-		// l'adresse ipv6 (récupérée par getaddrinfo)
-		&s->sin6->sin6_addr, 
-		s->addr, 
-		INET6_ADDRSTRLEN
-	);
-
-	s->sainfo = malloc(sizeof(struct addrinfo));
-	  assert_return(s->sainfo == NULL, "malloc");
-	*s->sainfo = (struct addrinfo){
-		0, 
-		AF_INET6, 
-		SOCK_DGRAM, 
-		IPPROTO_UDP, 
-		28, 
-		(struct sockaddr*)&s->sin6, 
-		NULL, 
-		NULL
-	};
-	s->addrlen = 28;
-	s->socket_desc = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (sin6 != &s->peer)
+		s->peer = *sin6;
+	s->sin6 = &s->peer;
+	s->sin6len = sizeof(s->peer);
+	s->addrlen = sizeof(s->peer);
+	s->socket_desc = listen->socket_desc;
+	s->batch = listen->batch;
+	s->sainfo = NULL;
+	s->buf = NULL;
+	s->length = 0;
+
+	// Le texte ne sert qu'aux logs
+	s->addr = s->peeraddr;
+	s->peeraddr[0] = '\0';
+	if (get_debug_level() >= 1){
+		inet_ntop(AF_INET6, &s->peer.sin6_addr, s->peeraddr, 
+				  sizeof(s->peeraddr));
+	}
 
 	return 0;
 }
 
-// /*
-
-/*
- * Enormément de problèmes sur cette fonction
- * Je n'arrive même pas à la faire marcher même en hardcodant tout pour qu'elle 
- * ne fonctionne qu'avec le loopback
- * 
- * rip projet
+/**
+ * @brief Rejoint un groupe multicast IPv6
+ * @details Une socket à part, liée à [::]:port avec SO_REUSEPORT: tous les
+ * serveurs d'une même machine peuvent écouter le même groupe. Les messages
+ * envoyés au groupe (netsend sur multi) reviennent aussi sur la machine
+ * (IPV6_MULTICAST_LOOP), émetteur compris: plusieurs serveurs se trouvent
+ * ainsi sur une seule machine, sans réseau.
+ *
+ * Sous Linux, lo n'a pas le drapeau MULTICAST: l'envoi y échoue
+ * (ENETUNREACH). En local, passer par une vraie interface avec un groupe de
+ * portée interface (ff01::...), qui ne la quitte jamais.
+ *
+ * ```C
+ *		nethandle multi;
+ *		netmulticast("ff02::4448:54", "9999", "eth0", &multi);
+ *		netsend(&multi, "hello");
+ *		netlisten(&multi, &sender);
+ * ```
+ * @param group adresse du groupe (ff..::..)
+ * @param port port du groupe, le même pour tous ses membres
+ * @param iface interface (eth0...), NULL pour celle de la route du groupe
+ * @param multi nethandle à remplir: multi->sin6 est le groupe
+ * @return 0 ou -1
  */
-int netmulticast(nethandle* s, nethandle* multi){
-	assert_return(s == NULL, "netjoingroup got null");
-	assert_return(s->sin6->sin6_family != AF_INET6, "netjoingroup got ipv4");
-
-	// On fait une requête pour rejoindre un groupe multicast
-	int tmp;
-	struct ipv6_mreq joinRequest;
-	struct addrinfo *resmulti;
-	struct addrinfo hints;
+int netmulticast(char* group, char* port, char* iface, nethandle* multi){
+	struct ipv6_mreq req;
+	struct sockaddr_in6 any;
+	unsigned int index = 0;
+	int one = 1, tmp;
+
+	if (iface != NULL){
+		index = if_nametoindex(iface);
+		  assert_return(index == 0, "Unknown interface %s", iface);
+	}
 
-	/**
-	 * Création socket
-	 * 
-	 * Problème ici
-	 * Est-ce que j'ouvre une nouvelle socket multicast ? Ca ne marche pas
-	 * Est-ce que j'utilise l'ancienne socket locale ? Marche pas non plus
-	 */
-	// socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-	multi->socket_desc = s->socket_desc;
-	  assert_return(multi->socket_desc == -1, "socket");
-	
-	/**
-	 * Récupération de l'interface et de l'adresse multicast
-	 * 
-	 * Je fait un resolve sur une ip multicast connue (pour tester)
-	 * 
-	 * Problème ici
-	 * Est-ce que j'envoie mes paquets sur la sockaddr_in6 de ff01::1 ?
-	 * Ca ne marche pas dans tous les cas
-	 */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_INET6;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
-	
-	// tmp = getaddrinfo("ff01::1", NULL, NULL, &resmulti);
-	//   assert_return(tmp == -1, "waw");
-	// tmp = addrinfo_to_nethandle(resmulti, multi);
-	//   assert_return(tmp == -1, "waw2");
-	// multi->sainfo->ai_canonname = "ff01::1";
-	// multi->addr = multi->sainfo->ai_canonname;
-
-	/**
-	 * Construction de la joinrequest
-	 */
-	
-	// Sans hardcoder:
-		// struct sockaddr_in6 *sin6_multi = (struct sockaddr_in6*)&resmulti->ai_addr;
-		// struct sockaddr_in6 *sin6_s     = (struct sockaddr_in6*)&s->sainfo->ai_addr;
-
-	// Initialisation de la joinrequest (pas très utile mais j'essaye tout)
-	memset(&joinRequest, 0, sizeof(joinRequest));
-
-	// Sans hardcoder: 
-		// Même interface que le nethandle en argument
-		// Adresse multicast renvoyée par le getaddrinfo plus haut
-
-		// joinRequest.ipv6mr_interface = sin6_s->sin6_scope_id;
-		// joinRequest.ipv6mr_multiaddr = sin6_multi->sin6_addr;
-	// En hardcodant: 
-		joinRequest.ipv6mr_interface = if_nametoindex("lo");
-		inet_pton(AF_INET6,"ff01::1",&joinRequest.ipv6mr_multiaddr);
-
-	// Est-ce que je fais le sockopt sur la socket locale ?
-	// Est-ce que je le fais sur une nouvelle socket ?
-	// Aucun ne marche.
-	tmp = setsockopt(multi->socket_desc, IPPROTO_IPV6, IPV6_JOIN_GROUP,
-				   &joinRequest, sizeof(joinRequest));
-	assert_return(tmp == -1, "setsockopt");
+	tmp = netopen(group, port, multi, 'w');
+	  assert_return(tmp == -1, "Can't resolve group [%s]:%s", group, port);
+
+	if (iface != NULL){
+		struct ifreq ifr;
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, iface, IFNAMSIZ-1);
+		if (ioctl(multi->socket_desc, SIOCGIFFLAGS, &ifr) == 0 &&
+			!(ifr.ifr_flags & IFF_MULTICAST)){
+			netclose(multi);
+			warn("%s can't send multicast (no MULTICAST flag)", iface);
+			return -1;
+		}
+	}
+	if (!IN6_IS_ADDR_MULTICAST(&multi->sin6->sin6_addr)){
+		netclose(multi);
+		warn("%s is not a multicast address", group);
+		return -1;
+	}
+	multi->sin6->sin6_scope_id = index;
+
+	memset(&any, 0, sizeof(any));
+	any.sin6_family = AF_INET6;
+	any.sin6_addr = in6addr_any;
+	any.sin6_port = multi->sin6->sin6_port;
+
+	memset(&req, 0, sizeof(req));
+	req.ipv6mr_multiaddr = multi->sin6->sin6_addr;
+	req.ipv6mr_interface = index;
+
+	if (setsockopt(multi->socket_desc, SOL_SOCKET, SO_REUSEADDR, &one, 
+				   sizeof(one)) == -1 ||
+		setsockopt(multi->socket_desc, SOL_SOCKET, SO_REUSEPORT, &one, 
+				   sizeof(one)) == -1 ||
+		bind(multi->socket_desc, (struct sockaddr*)&any, sizeof(any)) == -1 ||
+		setsockopt(multi->socket_desc, IPPROTO_IPV6, IPV6_JOIN_GROUP, &req, 
+				   sizeof(req)) == -1 ||
+		setsockopt(multi->socket_desc, IPPROTO_IPV6, IPV6_MULTICAST_IF, 
+				   &index, sizeof(index)) == -1 ||
+		setsockopt(multi->socket_desc, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, 
+				   &one, sizeof(one)) == -1){
+		warn("Can't join [%s]:%s on %s", group, port, 
+			 iface ? iface : "the default interface");
+		netclose(multi);
+		return -1;
+	}
 
+	success("Joined multicast group [%s]:%s", group, port);
 	return 0;
-	// ^ Comprendre: 
-	// return (rand() % 2 == 0); 
 }
-//*/
 
 /**
  * @brief Attend un message; renvoie le nb d'octets reçus
  * @details 
- * Message dans s->buf
+ * Message dans s->buf, terminé par un '\0'. La taille de s->buf est fixée au
+ * premier appel: s->bufsize si l'appelant l'a renseigné (BUFF_SIZE pour les
+ * gros messages), sinon d'après le MTU (cf netmtu)
  * Si sender != NULL, place dans sender les informations pour
- * contacter celui qui a envoyé le message reçu
+ * contacter celui qui a envoyé le message reçu (sans allocation, cf
+ * sockaddr_to_nethandle: sender n'a pas à être netclose)
  * 
  * @param s mon nethandle renvoyé par netopen()
  * @param sender Pointeur sur nethandle ou NULL
@@ -398,32 +408,39 @@ int netmulticast(nethandle* s, nethandle* multi){
 int netlisten(nethandle* s, nethandle* sender){
 	struct sockaddr_storage storage;
 	socklen_t storagesize = sizeof(storage);
-	memset(&storage, 0, storagesize);
 
 
 	if (s->buf == NULL){
-		s->buf = malloc(BUFF_SIZE);
+		if (s->bufsize <= 0)
+			s->bufsize = netmtu(s) + 1;
+		s->buf = malloc(s->bufsize);
 		  assert_return(s->buf == NULL, "malloc");
 		s->length = 0;
 	}
-	memset(s->buf, 0, BUFF_SIZE);
 	
+	// Pas de memset: seul le '\0' final compte
+	// MSG_TRUNC: recvfrom renvoie la vraie taille d'un message tronqué
 	s->length = recvfrom(
 		s->socket_desc, 
 		s->buf, 
-		BUFF_SIZE, 
-		0, // no flags
+		s->bufsize - 1, 
+		MSG_TRUNC,
 		(struct sockaddr*)&storage, // pour récupérer d'où vient le message
 		&storagesize // taille du storage
 	);
 	assert_return(s->length == -1, "Recvfrom failed");
 	assert_return(s->length ==  0, "Socket %d closed", s->socket_desc);
+	if (s->length > s->bufsize - 1){
+		warn("Datagram truncated (%d > %d bytes)", s->length, s->bufsize - 1);
+		s->length = s->bufsize - 1;
+	}
+	((char*)s->buf)[s->length] = '\0';
 
 	if (sender != NULL){
 		assert_return(storage.ss_family != AF_INET6, 
 					  "netlisten: Received IPV4 sender (%d)", 
 					  storage.ss_family);
-		if (sockaddr_to_nethandle( (struct sockaddr_in6*)&storage, sender) != 0){
+		if (sockaddr_to_nethandle((struct sockaddr_in6*)&storage, s, sender) != 0){
 			warn("sockaddr_to_nethandle");
 		}
 	}
@@ -437,7 +454,8 @@ int netlisten(nethandle* s, nethandle* sender){
  * @details 
  * 
  * @param s nethandle du destinataire renvoyé par netopen() en mode 'w' 
- * ou par listen
+ * ou par listen. Si s->batch est renseigné (expéditeur d'un message reçu par
+ * netlisten_batch), le message est seulement mis en attente: cf netflush
  * @param data buffer de données
  * @param length taille buffer
  * 
@@ -445,6 +463,9 @@ int netlisten(nethandle* s, nethandle* sender){
  */
 int netsend_binary(nethandle* s, void* data, int length){
 	int tmp;
+
+	if (s->batch != NULL)
+		return netqueue(s->batch, s->sin6, data, length);
 	
 	tmp = sendto(
 		s->socket_desc, 
@@ -475,4 +496,320 @@ int netsend(nethandle* s, char* str){
 	tmp = netsend_binary(s, str, strlen(str));
 	  assert_return(tmp == -1, "Sendto %s failed (%s)", s->addr, str);
 	return tmp;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Borne le temps d'attente de netlisten sur s
+ * @details Passé ce délai netlisten renvoie -1 (errno EAGAIN): un
+ * datagramme perdu ne bloque plus le client indéfiniment.
+ * 
+ * @param s nethandle renvoyé par netopen()
+ * @param ms délai en millisecondes, 0 pour attendre indéfiniment
+ * @return 0 ou -1
+ */
+int nettimeout(nethandle* s, int ms){
+	struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+	int tmp = setsockopt(s->socket_desc, SOL_SOCKET, SO_RCVTIMEO, 
+						 &tv, sizeof(tv));
+	  assert_return(tmp == -1, "setsockopt SO_RCVTIMEO");
+	return 0;
+}
+
+/**
+ * @brief Ouvre une socket à part pour dialoguer avec un expéditeur
+ * @details Contrairement à sockaddr_to_nethandle, s a sa propre socket,
+ * connectée à peer: le noyau lui choisit un port et l'adresse locale de la
+ * route vers peer (dont netmtu lit le MTU). Les réponses de peer arrivent
+ * donc sur s (cf netlisten), et pas sur les sockets d'écoute du serveur.
+ * 
+ * @param peer expéditeur (cf netlisten, netbatch_get)
+ * @param s nethandle à remplir, à fermer avec netclose
+ * @return 0 ou -1
+ */
+int netpeer(nethandle* peer, nethandle* s){
+	memset(s, 0, sizeof(*s));
+
+	s->socket_desc = socket(AF_INET6, SOCK_DGRAM, 0);
+	  assert_return(s->socket_desc == -1, "socket");
+	if (connect(s->socket_desc, (struct sockaddr*)peer->sin6, 
+				sizeof(*peer->sin6)) == -1){
+		close(s->socket_desc);
+		warn("connect");
+		return -1;
+	}
+
+	s->peer = *peer->sin6;
+	s->sin6 = &s->peer;
+	s->sin6len = sizeof(s->peer);
+	s->addrlen = sizeof(s->peer);
+	s->addr = s->peeraddr;
+	inet_ntop(AF_INET6, &s->peer.sin6_addr, s->peeraddr, sizeof(s->peeraddr));
+
+	return 0;
+}
+
+/**
+ * @brief Découpe "HOST:PORT" sur place
+ * @details Le port suit le dernier ':', HOST peut donc être une IPv6,
+ * éventuellement entre crochets.
+ * 
+ * @param str "HOST:PORT", modifiée
+ * @param host pointe dans str
+ * @param port pointe dans str
+ * @return 0 ou -1
+ */
+int netsplit(char* str, char** host, char** port){
+	char* sep = strrchr(str, ':');
+
+	if (sep == NULL || sep == str || sep[1] == '\0')
+		return -1;
+
+	*sep = '\0';
+	*host = str;
+	*port = sep + 1;
+	if (str[0] == '[' && sep[-1] == ']'){
+		sep[-1] = '\0';
+		(*host)++;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Plus gros datagramme qui tient dans un paquet sur l'interface de s
+ * @details MTU de l'interface portant l'adresse locale de s, moins les
+ * entêtes IPv6 et UDP. Pour une socket non liée ou liée à [::], on ne sait
+ * pas par où partiront les paquets: on suppose NET_MTU.
+ * 
+ * @param s nethandle renvoyé par netopen()
+ * @return taille en octets
+ */
+int netmtu(nethandle* s){
+	struct sockaddr_in6 local;
+	socklen_t len = sizeof(local);
+	struct ifaddrs *ifa, *p;
+	struct ifreq ifr;
+	int mtu = NET_MTU;
+
+	if (getsockname(s->socket_desc, (struct sockaddr*)&local, &len) == -1 ||
+		getifaddrs(&ifa) == -1)
+		return NET_PAYLOAD;
+
+	for (p = ifa; p != NULL; p = p->ifa_next){
+		if (p->ifa_addr == NULL || p->ifa_addr->sa_family != AF_INET6)
+			continue;
+		if (memcmp(&((struct sockaddr_in6*)p->ifa_addr)->sin6_addr,
+				   &local.sin6_addr, sizeof(local.sin6_addr)) != 0)
+			continue;
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, p->ifa_name, IFNAMSIZ-1);
+		if (ioctl(s->socket_desc, SIOCGIFMTU, &ifr) == 0)
+			mtu = ifr.ifr_mtu;
+		break;
+	}
+	freeifaddrs(ifa);
+
+	mtu -= NET_HEADERS;
+	if (mtu > BUFF_SIZE - 1)
+		mtu = BUFF_SIZE - 1;
+	if (mtu < NET_PAYLOAD)
+		mtu = NET_PAYLOAD;
+
+	info("  MTU payload of socket %d: %d bytes", s->socket_desc, mtu);
+	return mtu;
+}
+
+/**
+ * @brief Prépare un lot de réception/envoi pour la socket s
+ * @details Les expéditeurs renvoyés par netbatch_get répondront dans ce lot.
+ * 
+ * @param s nethandle d'écoute renvoyé par netopen()
+ * @param b lot à initialiser
+ * @param size plus gros message accepté, 0 pour le MTU de l'interface
+ * (BUFF_SIZE pour accepter les gros messages)
+ * @return 0 ou -1
+ */
+int netbatch_init(nethandle* s, netbatch* b, int size){
+	memset(b, 0, sizeof(*b));
+
+	if (size <= 0)
+		size = netmtu(s);
+	b->slot = size + 1;
+
+	b->inbuf = malloc(NET_BATCH * b->slot);
+	  assert_return(b->inbuf == NULL, "malloc");
+	b->outbuf = malloc(NET_OUTBUF);
+	  assert_return(b->outbuf == NULL, "malloc");
+
+	// Les descripteurs de réception ne changent jamais, seules les tailles
+	// sont remises à jour à chaque appel
+	for (int i = 0; i < NET_BATCH; ++i){
+		b->iniov[i].iov_base = b->inbuf + i * b->slot;
+		b->iniov[i].iov_len  = b->slot - 1; // place pour le '\0'
+		b->in[i].msg_hdr.msg_iov = &b->iniov[i];
+		b->in[i].msg_hdr.msg_iovlen = 1;
+		b->in[i].msg_hdr.msg_name = &b->from[i];
+	}
+
+	b->socket_desc = s->socket_desc;
+	s->batch = b;
+
+	return 0;
+}
+
+void netbatch_free(netbatch* b){
+	free(b->inbuf);
+	free(b->outbuf);
+	b->inbuf = NULL;
+	b->outbuf = NULL;
+}
+
+/**
+ * @brief Attend au moins un message et lit tous ceux déjà arrivés
+ * @details Jusqu'à NET_BATCH datagrammes en un seul appel système. 
+ * Chaque message est terminé par un '\0'.
+ * 
+ * @param s nethandle d'écoute passé à netbatch_init
+ * @return Nombre de messages reçus ou -1
+ */
+int netlisten_batch(nethandle* s){
+	netbatch* b = s->batch;
+	  assert_return(b == NULL, "netlisten_batch without netbatch_init");
+
+	for (int i = 0; i < NET_BATCH; ++i)
+		b->in[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+
+	b->count = recvmmsg(b->socket_desc, b->in, NET_BATCH, MSG_WAITFORONE, 
+						NULL);
+	assert_return(b->count == -1, "Recvmmsg failed");
+
+	for (int i = 0; i < b->count; ++i)
+		b->inbuf[i * b->slot + b->in[i].msg_len] = '\0';
+
+	// Une socket fermée (shutdown) renvoie 0 message: à l'appelant de savoir
+	// s'il s'arrête. Un datagramme vide n'est pas une fermeture (cf
+	// netbatch_get, qui l'ignore)
+	return b->count;
+}
+
+/**
+ * @brief Renvoie le i-ème message du dernier netlisten_batch
+ * 
+ * @param s nethandle d'écoute
+ * @param i numéro du message
+ * @param sender Rempli comme par netlisten (réponses mises en attente dans
+ * le lot)
+ * @return Message terminé par '\0', ou NULL (datagramme vide ou tronqué)
+ */
+char* netbatch_get(nethandle* s, int i, nethandle* sender){
+	netbatch* b = s->batch;
+
+	if (b->in[i].msg_len == 0)
+		return NULL;
+
+	// Une commande tronquée serait mal interprétée
+	if (b->in[i].msg_hdr.msg_flags & MSG_TRUNC){
+		warn("Datagram truncated to %zu bytes, dropped (cf --large)", 
+			 b->slot - 1);
+		return NULL;
+	}
+
+	if (sender != NULL){
+		if (sockaddr_to_nethandle(&b->from[i], s, sender) != 0){
+			warn("sockaddr_to_nethandle");
+			return NULL;
+		}
+		sender->length = b->in[i].msg_len;
+	}
+
+	return b->inbuf + i * b->slot;
+}
+
+/**
+ * @brief Met un message en attente d'envoi
+ * @details Le message est copié: data peut être réutilisé de suite.
+ * Envoie le lot si il est plein. Un message trop gros pour le lot est envoyé
+ * directement.
+ * 
+ * @return length ou -1
+ */
+int netqueue(netbatch* b, struct sockaddr_in6* to, void* data, int length){
+	if ((size_t)length > NET_OUTBUF){
+		int tmp = netflush(b);
+		  assert_return(tmp == -1, "netflush");
+		tmp = sendto(b->socket_desc, data, length, 0, 
+					 (struct sockaddr*)to, sizeof(*to));
+		return tmp == -1 ? -1 : length;
+	}
+
+	if (b->nout == NET_BATCH || b->outused + length > NET_OUTBUF){
+		int tmp = netflush(b);
+		  assert_return(tmp == -1, "netflush");
+	}
+
+	int n = b->nout++;
+	memcpy(b->outbuf + b->outused, data, length);
+	b->to[n] = *to;
+	b->outiov[n].iov_base = b->outbuf + b->outused;
+	b->outiov[n].iov_len  = length;
+	b->outused += length;
+
+	memset(&b->out[n], 0, sizeof(b->out[n]));
+	b->out[n].msg_hdr.msg_iov = &b->outiov[n];
+	b->out[n].msg_hdr.msg_iovlen = 1;
+	b->out[n].msg_hdr.msg_name = &b->to[n];
+	b->out[n].msg_hdr.msg_namelen = sizeof(b->to[n]);
+
+	return length;
+}
+
+/**
+ * @brief Dernier message en attente d'envoi vers to
+ * @details Permet de compléter ce message sur place au lieu d'en mettre un
+ * autre en attente (cf sync_recv, qui élargit le dernier OP_ACK).
+ * 
+ * @param b lot
+ * @param to destinataire
+ * @param length taille du message
+ * @return Le message, ou NULL si le dernier message en attente n'est pas
+ * pour to (ou s'il n'y en a pas)
+ */
+void* netqueue_last(netbatch* b, struct sockaddr_in6* to, int* length){
+	struct sockaddr_in6* last;
+
+	if (b->nout == 0)
+		return NULL;
+
+	last = &b->to[b->nout - 1];
+	if (last->sin6_port != to->sin6_port ||
+		memcmp(&last->sin6_addr, &to->sin6_addr, sizeof(to->sin6_addr)) != 0)
+		return NULL;
+
+	*length = b->outiov[b->nout - 1].iov_len;
+	return b->outiov[b->nout - 1].iov_base;
+}
+
+/**
+ * @brief Envoie tous les messages en attente, en un minimum d'appels système
+ * 
+ * @return Nombre de messages envoyés ou -1
+ */
+int netflush(netbatch* b){
+	int sent = 0, tmp = 0;
+
+	while (sent < b->nout){
+		tmp = sendmmsg(b->socket_desc, b->out + sent, b->nout - sent, 0);
+		if (tmp == -1){
+			warn("Sendmmsg failed");
+			// Les messages restants sont perdus, comme avec sendto
+			break;
+		}
+		sent += tmp;
+	}
+
+	b->nout = 0;
+	b->outused = 0;
+
+	return tmp == -1 ? -1 : sent;
+}
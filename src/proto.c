@@ -0,0 +1,701 @@
+#include "macros.h"
+#include "proto.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[PROTO ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// Champs portés par chaque opcode
+#define F_KEY  1
+#define F_ADDR 2
+#define F_AGE  4
+#define F_FROM 8
+#define F_PAGE 16 // cf proto_page_init
+#define F_RANGE 32 // premier et dernier lot acquittés (32 bits)
+#define F_DIGESTS 64 // DHT_DIGEST_FANOUT condensés (64 bits)
+#define F_BUCKETS 128 // DHT_DIGEST_BUCKETS bits
+#define F_TAIL 256 // octets opaques jusqu'à la fin du message
+
+static const uint16_t op_fields[] = {
+	[OP_PUT]          = F_KEY | F_ADDR,
+	[OP_GET]          = F_KEY | F_FROM,
+	[OP_PLZGIBHASHES] = 0,
+	[OP_KKTAKETHIS]   = F_KEY | F_ADDR | F_AGE,
+	[OP_ADDRS]        = F_PAGE,
+	[OP_END]          = 0,
+	[OP_SYNC]         = F_FROM,
+	[OP_BATCH]        = F_PAGE,
+	[OP_ACK]          = F_RANGE,
+	[OP_DIGEST]       = F_FROM,
+	[OP_DIGESTS]      = F_FROM | F_DIGESTS,
+	[OP_PULL]         = F_FROM | F_BUCKETS,
+	[OP_RING]         = F_TAIL,
+	[OP_MOVED]        = F_TAIL,
+	[OP_PING]         = F_TAIL,
+	[OP_PING_REQ]     = F_TAIL,
+	[OP_PING_ACK]     = F_TAIL,
+	[OP_ANNOUNCE]     = F_PAGE,
+	[OP_HELLO]        = F_TAIL,
+};
+
+#define OP_MAX ((int)(sizeof(op_fields) / sizeof(op_fields[0])) - 1)
+
+// Forme d'un champ sur le réseau
+#define FIELD_BAD  -1
+#define FIELD_RAW   0 // octets bruts de taille fixe
+#define FIELD_SHORT 1 // texte court, copié dans hkey.bin
+#define FIELD_LONG  2 // texte long, hkey.ext pointe dans le message
+
+static int key_field(uint8_t fmt){
+	switch (fmt){
+		case KEY_SHA256: return FIELD_RAW;
+		case KEY_SHORT:  return FIELD_SHORT;
+		case KEY_LONG:   return FIELD_LONG;
+		default:         return FIELD_BAD;
+	}
+}
+
+static int addr_field(uint8_t fmt){
+	switch (fmt){
+		case ADDR_V6:
+		case ADDR_V4:    return FIELD_RAW;
+		case ADDR_SHORT: return FIELD_SHORT;
+		case ADDR_LONG:  return FIELD_LONG;
+		default:         return FIELD_BAD;
+	}
+}
+
+/**
+ * @brief Ecrit un entier en varint (LEB128: 7 bits par octet, poids faibles
+ * en premier, bit de poids fort = octet suivant)
+ * @return Nombre d'octets écrits (au plus PROTO_VARINT_MAX)
+ */
+static int varint_put(uint8_t* p, uint64_t v){
+	int n = 0;
+
+	while (v >= 0x80){
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+/**
+ * @brief Lit un varint (cf varint_put)
+ * @return Nombre d'octets lus, -1 si le varint déborde de [p, end[
+ */
+static int varint_get(const uint8_t* p, const uint8_t* end, uint64_t* v){
+	int n = 0;
+	*v = 0;
+
+	while (p + n < end && n < PROTO_VARINT_MAX){
+		*v |= (uint64_t)(p[n] & 0x7f) << (7*n);
+		if ((p[n++] & 0x80) == 0)
+			return n;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Ecrit une clé ou une adresse encodée
+ *
+ * @param p destination
+ * @param end fin du buffer
+ * @param f champ
+ * @param kind FIELD_*
+ * @param bin taille de la forme brute
+ * @return Nombre d'octets écrits, -1 si le buffer est trop petit
+ */
+static int field_put(uint8_t* p, uint8_t* end, const hkey* f, int kind,
+					 int bin){
+	const char* str;
+	size_t len;
+	int n;
+
+	if (kind == FIELD_RAW){
+		if (end - p < bin)
+			return -1;
+		memcpy(p, f->bin, bin);
+		return bin;
+	}
+
+	str = (kind == FIELD_SHORT) ? (const char*)f->bin : f->ext;
+	len = (kind == FIELD_SHORT) ? f->len : strlen(f->ext);
+
+	if ((size_t)(end - p) < PROTO_VARINT_MAX + len + 1)
+		return -1;
+
+	n = varint_put(p, len);
+	memcpy(p + n, str, len);
+	p[n + len] = '\0';
+
+	return n + len + 1;
+}
+
+/**
+ * @brief Lit une clé ou une adresse encodée (cf field_put)
+ * @details Sans copie pour les formats longs: f->ext pointe dans le message,
+ * qui doit donc vivre aussi longtemps que f.
+ *
+ * @return Nombre d'octets lus, -1 si le champ est invalide
+ */
+static int field_get(uint8_t* p, uint8_t* end, hkey* f, uint8_t fmt,
+					 int kind, int bin){
+	uint64_t len;
+	int n;
+
+	memset(f, 0, sizeof(*f));
+	f->fmt = fmt;
+
+	if (kind == FIELD_RAW){
+		if (end - p < bin)
+			return -1;
+		memcpy(f->bin, p, bin);
+		return bin;
+	}
+
+	n = varint_get(p, end, &len);
+	if (n == -1 || len >= (uint64_t)(end - p - n))
+		return -1;
+	// Texte terminé par un '\0' et sans '\0' interne
+	if (p[n + len] != '\0' || memchr(p + n, '\0', len) != NULL)
+		return -1;
+
+	// Même découpage court/long que dht_keyenc et dht_addrenc
+	if (kind == FIELD_SHORT){
+		if (len > (uint64_t)bin)
+			return -1;
+		f->len = len;
+		memcpy(f->bin, p + n, len);
+	}
+	else {
+		if (len <= (uint64_t)bin)
+			return -1;
+		f->ext = (char*)p + n;
+	}
+
+	return n + len + 1;
+}
+
+/**
+ * @brief Indique si un message reçu est au format binaire
+ *
+ * @param buf message
+ * @param len taille du message
+ * @return true ou false
+ */
+int proto_is_binary(const void* buf, int len){
+	return len >= PROTO_HEADER &&
+		   (((const uint8_t*)buf)[0] & 0xf0) == PROTO_MAGIC;
+}
+
+/**
+ * @brief Encode un message binaire
+ * @details Seuls les champs de l'opcode sont lus dans m (cf op_fields).
+ * Les pages OP_ADDRS s'écrivent avec proto_page_init.
+ *
+ * ```C
+ *		proto_msg m = {.op = OP_GET, .id = 42};
+ *		dht_keyenc(hash, &m.key);
+ *		int len = proto_encode(&m, buf, sizeof(buf));
+ *		netsend_binary(&s, buf, len);
+ * ```
+ * @param m message
+ * @param buf destination
+ * @param size taille de buf
+ * @return Taille du message, -1 si buf est trop petit ou m invalide
+ */
+int proto_encode(const proto_msg* m, void* buf, int size){
+	uint8_t* p = buf;
+	uint8_t* end = p + size;
+	uint32_t id = htonl(m->id);
+	int fields, kind, n;
+
+	assert_return(m->op == 0 || m->op > OP_MAX, "Bad opcode %d", m->op);
+	assert_return(size < PROTO_HEADER, "proto_encode: buffer too small");
+	fields = op_fields[m->op];
+	assert_return(fields & F_PAGE, "proto_encode: use proto_page_init");
+
+	p[0] = PROTO_MAGIC | PROTO_VERSION;
+	p[1] = m->op;
+	p[2] = (fields & F_KEY)  ? m->key.fmt  : 0;
+	p[3] = (fields & F_ADDR) ? m->addr.fmt : 0;
+	memcpy(&p[4], &id, sizeof(id));
+	p += PROTO_HEADER;
+
+	if (fields & F_KEY){
+		kind = key_field(m->key.fmt);
+		  assert_return(kind == FIELD_BAD, "Bad key format %d", m->key.fmt);
+		n = field_put(p, end, &m->key, kind, DHT_KEY_BIN);
+		  assert_return(n == -1, "proto_encode: key doesn't fit");
+		p += n;
+	}
+
+	if (fields & F_ADDR){
+		kind = addr_field(m->addr.fmt);
+		  assert_return(kind == FIELD_BAD, "Bad address format %d", 
+						m->addr.fmt);
+		n = field_put(p, end, &m->addr, kind, DHT_ADDR_BIN);
+		  assert_return(n == -1, "proto_encode: address doesn't fit");
+		p += n;
+	}
+
+	if (fields & F_AGE){
+		long int age = time(NULL) - m->time;
+		  assert_return(end - p < PROTO_VARINT_MAX,
+						"proto_encode: age doesn't fit");
+		p += varint_put(p, (age > 0) ? age : 0);
+	}
+
+	if (fields & F_FROM){
+		  assert_return(end - p < PROTO_VARINT_MAX,
+						"proto_encode: position doesn't fit");
+		p += varint_put(p, m->from);
+	}
+
+	if (fields & F_RANGE){
+		uint32_t from = htonl(m->from), to = htonl(m->to);
+		  assert_return(end - p < (int)(sizeof(from) + sizeof(to)),
+						"proto_encode: range doesn't fit");
+		memcpy(p, &from, sizeof(from));
+		memcpy(p + sizeof(from), &to, sizeof(to));
+		p += sizeof(from) + sizeof(to);
+	}
+
+	if (fields & F_DIGESTS){
+		  assert_return(end - p < (int)sizeof(m->digests),
+						"proto_encode: digests don't fit");
+		for (int i = 0; i < DHT_DIGEST_FANOUT; ++i){
+			for (int b = 0; b < 8; ++b)
+				*p++ = m->digests[i] >> (56 - 8*b);
+		}
+	}
+
+	if (fields & F_BUCKETS){
+		  assert_return(end - p < DHT_DIGEST_BUCKETS / 8,
+						"proto_encode: buckets don't fit");
+		memcpy(p, m->buckets, DHT_DIGEST_BUCKETS / 8);
+		p += DHT_DIGEST_BUCKETS / 8;
+	}
+
+	if ((fields & F_TAIL) && m->cur != NULL){
+		  assert_return(end - p < m->end - m->cur,
+						"proto_encode: tail doesn't fit");
+		memcpy(p, m->cur, m->end - m->cur);
+		p += m->end - m->cur;
+	}
+
+	return p - (uint8_t*)buf;
+}
+
+/**
+ * @brief Décode un message binaire
+ * @details Le code de hachage de la clé est calculé (cf dht_keycode): m->key
+ * est directement utilisable par dht_getk et dht_updatek.
+ *
+ * @param buf message (cf proto_is_binary), doit survivre à m
+ * @param len taille du message
+ * @param m message décodé
+ * @return 0 ou -1 si le message est invalide
+ */
+int proto_decode(void* buf, int len, proto_msg* m){
+	uint8_t* p = buf;
+	uint8_t* end = p + len;
+	uint32_t id;
+	int fields, kind, n;
+
+	assert_return(!proto_is_binary(buf, len), "Not a binary message");
+	assert_return((p[0] & 0x0f) != PROTO_VERSION,
+				  "Unsupported protocol version %d", p[0] & 0x0f);
+	assert_return(p[1] == 0 || p[1] > OP_MAX, "Bad opcode %d", p[1]);
+
+	memset(m, 0, sizeof(*m));
+	m->op = p[1];
+	memcpy(&id, &p[4], sizeof(id));
+	m->id = ntohl(id);
+	fields = op_fields[m->op];
+
+	uint8_t kfmt = p[2];
+	uint8_t afmt = p[3];
+	p += PROTO_HEADER;
+
+	if (fields & F_KEY){
+		kind = key_field(kfmt);
+		  assert_return(kind == FIELD_BAD, "Bad key format %d", kfmt);
+		n = field_get(p, end, &m->key, kfmt, kind, DHT_KEY_BIN);
+		  assert_return(n == -1, "Bad key");
+		dht_keycode(&m->key);
+		p += n;
+	}
+
+	if (fields & F_ADDR){
+		kind = addr_field(afmt);
+		  assert_return(kind == FIELD_BAD, "Bad address format %d", afmt);
+		n = field_get(p, end, &m->addr, afmt, kind, DHT_ADDR_BIN);
+		  assert_return(n == -1, "Bad address");
+		p += n;
+	}
+
+	if (fields & F_AGE){
+		uint64_t age;
+		long int now = time(NULL);
+		n = varint_get(p, end, &age);
+		  assert_return(n == -1, "Bad age");
+		m->time = (age < (uint64_t)now) ? now - (long int)age : 1;
+		p += n;
+	}
+
+	if (fields & F_FROM){
+		uint64_t from;
+		n = varint_get(p, end, &from);
+		  assert_return(n == -1 || from > UINT32_MAX, "Bad position");
+		m->from = from;
+		p += n;
+	}
+
+	if (fields & F_RANGE){
+		uint32_t from, to;
+		  assert_return(end - p < (int)(sizeof(from) + sizeof(to)), 
+						"Bad range");
+		memcpy(&from, p, sizeof(from));
+		memcpy(&to, p + sizeof(from), sizeof(to));
+		m->from = ntohl(from);
+		m->to = ntohl(to);
+		p += sizeof(from) + sizeof(to);
+	}
+
+	if (fields & F_DIGESTS){
+		  assert_return(end - p < (int)sizeof(m->digests), "Bad digests");
+		for (int i = 0; i < DHT_DIGEST_FANOUT; ++i){
+			for (int b = 0; b < 8; ++b)
+				m->digests[i] = (m->digests[i] << 8) | *p++;
+		}
+	}
+
+	if (fields & F_BUCKETS){
+		  assert_return(end - p < DHT_DIGEST_BUCKETS / 8, "Bad buckets");
+		m->buckets = p;
+		p += DHT_DIGEST_BUCKETS / 8;
+	}
+
+	if (fields & F_TAIL){
+		m->cur = p;
+		m->end = end;
+	}
+
+	if (fields & F_PAGE){
+		uint16_t count;
+		uint32_t next;
+		  assert_return(end - p < PROTO_PAGE_HEADER - PROTO_HEADER, 
+						"Bad page");
+		memcpy(&count, p, sizeof(count));
+		memcpy(&next, p + sizeof(count), sizeof(next));
+		m->count = ntohs(count);
+		m->from = ntohl(next);
+		m->cur = p + sizeof(count) + sizeof(next);
+		m->end = end;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Remplit la clé, l'adresse et le timestamp d'un message depuis une
+ * entrée de la DHT
+ * @details Les formats longs pointent dans l'entrée, qui ne doit pas être
+ * libérée avant l'encodage du message.
+ */
+void proto_fromhash(const hash* e, proto_msg* m){
+	memset(&m->key, 0, sizeof(m->key));
+	memset(&m->addr, 0, sizeof(m->addr));
+
+	m->key.fmt = e->kfmt;
+	m->key.len = e->klen;
+	if (e->kfmt == KEY_LONG)
+		m->key.ext = e->key.ext;
+	else
+		memcpy(m->key.bin, e->key.bin, DHT_KEY_BIN);
+
+	m->addr.fmt = e->afmt;
+	m->addr.len = e->alen;
+	if (e->afmt == ADDR_LONG)
+		m->addr.ext = e->addr.ext;
+	else
+		memcpy(m->addr.bin, e->addr.bin, DHT_ADDR_BIN);
+
+	m->time = e->time;
+}
+
+/**
+ * @brief Entête commun des pages OP_ADDRS et des lots OP_BATCH
+ */
+static int page_init(proto_page* pg, void* buf, int size, uint8_t op, 
+					 uint32_t id){
+	uint8_t* p = buf;
+
+	  assert_return(size < PROTO_PAGE_HEADER, 
+					"proto_page_init: buffer too small");
+
+	id = htonl(id);
+	p[0] = PROTO_MAGIC | PROTO_VERSION;
+	p[1] = op;
+	p[2] = 0;
+	p[3] = 0;
+	memcpy(&p[4], &id, sizeof(id));
+
+	pg->buf = buf;
+	pg->size = size;
+	pg->len = PROTO_PAGE_HEADER;
+	pg->count = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Commence une page OP_ADDRS
+ * @details Les adresses sont ajoutées une à une par proto_page_add tant
+ * qu'elles tiennent dans buf, puis proto_page_end écrit le nombre d'adresses
+ * et la suite.
+ *
+ * ```C
+ *		proto_page pg;
+ *		proto_page_init(&pg, buf, NET_PAYLOAD, id);
+ *		while (encore && proto_page_add(&pg, &addr) == 0)
+ *			...
+ *		netsend_binary(&s, buf, proto_page_end(&pg, suite));
+ * ```
+ * @param pg page
+ * @param buf destination
+ * @param size taille de buf (NET_PAYLOAD: la page tient dans un datagramme)
+ * @param id id de la requête OP_GET
+ * @return 0 ou -1 si buf est trop petit
+ */
+int proto_page_init(proto_page* pg, void* buf, int size, uint32_t id){
+	return page_init(pg, buf, size, OP_ADDRS, id);
+}
+
+/**
+ * @brief Ajoute une adresse à une page
+ *
+ * @param pg page (cf proto_page_init)
+ * @param a adresse encodée
+ * @return 0, ou -1 si la page est pleine (ou l'adresse invalide)
+ */
+int proto_page_add(proto_page* pg, const hkey* a){
+	uint8_t* p = pg->buf + pg->len;
+	uint8_t* end = pg->buf + pg->size;
+	int kind = addr_field(a->fmt);
+	int n;
+
+	if (kind == FIELD_BAD || pg->count == UINT16_MAX || end - p < 1)
+		return -1;
+
+	n = field_put(p + 1, end, a, kind, DHT_ADDR_BIN);
+	if (n == -1)
+		return -1;
+
+	p[0] = a->fmt;
+	pg->len += n + 1;
+	pg->count++;
+
+	return 0;
+}
+
+/**
+ * @brief Termine une page ou un lot
+ *
+ * @param pg page (cf proto_page_init) ou lot (cf proto_batch_init)
+ * @param next position de la prochaine adresse, 0 si c'est la dernière page,
+ * ou numéro du lot
+ * @return Taille du message
+ */
+int proto_page_end(proto_page* pg, uint32_t next){
+	uint16_t count = htons(pg->count);
+
+	next = htonl(next);
+	memcpy(pg->buf + PROTO_HEADER, &count, sizeof(count));
+	memcpy(pg->buf + PROTO_HEADER + sizeof(count), &next, sizeof(next));
+
+	return pg->len;
+}
+
+/**
+ * @brief Lit l'adresse suivante d'une page reçue
+ * @details Sans copie pour ADDR_LONG: a->ext pointe dans le message.
+ *
+ * ```C
+ *		hkey a;
+ *		while ((tmp = proto_page_next(&m, &a)) == 1)
+ *			puts(proto_addrstr(&a, str));
+ * ```
+ * @param m page décodée par proto_decode
+ * @param a adresse lue
+ * @return 1, 0 à la fin de la page, -1 si la page est invalide
+ */
+int proto_page_next(proto_msg* m, hkey* a){
+	int kind, n;
+
+	if (m->count == 0)
+		return 0;
+
+	assert_return(m->cur >= m->end, "Truncated page");
+	kind = addr_field(m->cur[0]);
+	  assert_return(kind == FIELD_BAD, "Bad address format %d", m->cur[0]);
+	n = field_get(m->cur + 1, m->end, a, m->cur[0], kind, DHT_ADDR_BIN);
+	  assert_return(n == -1, "Bad address");
+
+	m->cur += n + 1;
+	m->count--;
+
+	return 1;
+}
+
+/**
+ * @brief Commence un lot OP_BATCH
+ * @details Comme une page OP_ADDRS: les tuples sont ajoutés par
+ * proto_batch_add tant qu'ils tiennent dans buf, puis proto_page_end écrit
+ * le nombre de tuples et le numéro du lot.
+ *
+ * @param pg lot
+ * @param buf destination
+ * @param size taille de buf
+ * @param id id de la requête OP_SYNC
+ * @return 0 ou -1 si buf est trop petit
+ */
+int proto_batch_init(proto_page* pg, void* buf, int size, uint32_t id){
+	return page_init(pg, buf, size, OP_BATCH, id);
+}
+
+/**
+ * @brief Commence une annonce OP_ANNOUNCE
+ * @details Un lot OP_BATCH sous un autre opcode (cf proto_batch_init)
+ *
+ * @param id identifiant du serveur émetteur (cf mcast.h)
+ */
+int proto_announce_init(proto_page* pg, void* buf, int size, uint32_t id){
+	return page_init(pg, buf, size, OP_ANNOUNCE, id);
+}
+
+/**
+ * @brief Ajoute un tuple à un lot
+ *
+ * @param pg lot (cf proto_batch_init)
+ * @param k clé encodée
+ * @param a adresse encodée
+ * @param t timestamp du tuple
+ * @return 0, ou -1 si le lot est plein (ou le tuple invalide)
+ */
+int proto_batch_add(proto_page* pg, const hkey* k, const hkey* a, long t){
+	uint8_t* p = pg->buf + pg->len;
+	uint8_t* end = pg->buf + pg->size;
+	int kkind = key_field(k->fmt);
+	int akind = addr_field(a->fmt);
+	long int age = time(NULL) - t;
+	int n, len = 2;
+
+	if (kkind == FIELD_BAD || akind == FIELD_BAD || 
+		pg->count == UINT16_MAX || end - p < 2)
+		return -1;
+
+	n = field_put(p + len, end, k, kkind, DHT_KEY_BIN);
+	if (n == -1)
+		return -1;
+	len += n;
+
+	n = field_put(p + len, end, a, akind, DHT_ADDR_BIN);
+	if (n == -1 || end - p - len - n < PROTO_VARINT_MAX)
+		return -1;
+	len += n;
+
+	p[0] = k->fmt;
+	p[1] = a->fmt;
+	len += varint_put(p + len, (age > 0) ? age : 0);
+	pg->len += len;
+	pg->count++;
+
+	return 0;
+}
+
+/**
+ * @brief Lit le tuple suivant d'un lot reçu
+ * @details Sans copie pour les formats longs (cf proto_page_next). La clé
+ * est prête pour dht_updatek (cf dht_keycode).
+ *
+ * @param m lot décodé par proto_decode
+ * @param k clé lue
+ * @param a adresse lue
+ * @param t timestamp lu
+ * @return 1, 0 à la fin du lot, -1 si le lot est invalide
+ */
+int proto_batch_next(proto_msg* m, hkey* k, hkey* a, long* t){
+	uint8_t* p = m->cur;
+	uint64_t age;
+	long int now;
+	int kind, n;
+
+	if (m->count == 0)
+		return 0;
+
+	assert_return(m->end - p < 2, "Truncated batch");
+	kind = key_field(p[0]);
+	  assert_return(kind == FIELD_BAD, "Bad key format %d", p[0]);
+	n = field_get(p + 2, m->end, k, p[0], kind, DHT_KEY_BIN);
+	  assert_return(n == -1, "Bad key");
+	dht_keycode(k);
+	p += 2 + n;
+
+	kind = addr_field(m->cur[1]);
+	  assert_return(kind == FIELD_BAD, "Bad address format %d", m->cur[1]);
+	n = field_get(p, m->end, a, m->cur[1], kind, DHT_ADDR_BIN);
+	  assert_return(n == -1, "Bad address");
+	p += n;
+
+	n = varint_get(p, m->end, &age);
+	  assert_return(n == -1, "Bad age");
+	now = time(NULL);
+	*t = (age < (uint64_t)now) ? now - (long int)age : 1;
+
+	m->cur = p + n;
+	m->count--;
+
+	return 1;
+}
+
+/**
+ * @brief Restitue une adresse encodée sous forme de texte (cf dht_ipstr)
+ *
+ * @param a adresse encodée
+ * @param buf buffer d'au moins DHT_ADDR_STRLEN octets
+ * @return buf, ou l'adresse elle-même pour ADDR_LONG
+ */
+const char* proto_addrstr(const hkey* a, char* buf){
+	hash e;
+
+	memset(&e, 0, sizeof(e));
+	e.afmt = a->fmt;
+	e.alen = a->len;
+	if (a->fmt == ADDR_LONG)
+		e.addr.ext = a->ext;
+	else
+		memcpy(e.addr.bin, a->bin, DHT_ADDR_BIN);
+
+	return dht_ipstr(&e, buf);
+}
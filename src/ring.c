@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "ring.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[ RING ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+static int node_cmp(const void* a, const void* b){
+	const struct sockaddr_in6* x = a;
+	const struct sockaddr_in6* y = b;
+	int c = memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+
+	if (c != 0)
+		return c;
+	return (int)ntohs(x->sin6_port) - (int)ntohs(y->sin6_port);
+}
+
+static int point_cmp(const void* a, const void* b){
+	const ring_point* x = a;
+	const ring_point* y = b;
+
+	if (x->point != y->point)
+		return (x->point < y->point) ? -1 : 1;
+	// Collision: départagée par le serveur, pour rester déterministe
+	return (int)x->node - (int)y->node;
+}
+
+/**
+ * @brief Position du noeud virtuel v d'un serveur
+ * @details FNV-1a de l'adresse, du port et de v, puis un mélange final
+ * (murmur3): les noeuds virtuels d'un même serveur s'éparpillent.
+ */
+static uint32_t vnode_point(const struct sockaddr_in6* a, uint16_t v){
+	uint8_t bytes[sizeof(a->sin6_addr) + 4];
+	uint32_t h = 2166136261u;
+
+	memcpy(bytes, &a->sin6_addr, sizeof(a->sin6_addr));
+	memcpy(bytes + sizeof(a->sin6_addr), &a->sin6_port, 2);
+	bytes[sizeof(a->sin6_addr) + 2] = v >> 8;
+	bytes[sizeof(a->sin6_addr) + 3] = v;
+
+	for (size_t i = 0; i < sizeof(bytes); ++i){
+		h ^= bytes[i];
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/**
+ * @brief Place les serveurs sur l'anneau
+ * @details Trie les serveurs (et retire les doublons) puis calcule et trie
+ * leurs noeuds virtuels. A rappeler après toute modification de nodes.
+ *
+ * @param r anneau, r->count serveurs dans r->nodes
+ * @return 0 ou -1 si l'anneau est vide
+ */
+int ring_build(ring* r){
+	int n = 0;
+
+	  assert_return(r->count <= 0, "Empty ring");
+
+	qsort(r->nodes, r->count, sizeof(r->nodes[0]), &node_cmp);
+	for (int i = 0; i < r->count; ++i){
+		if (n > 0 && node_cmp(&r->nodes[n-1], &r->nodes[i]) == 0)
+			continue;
+		r->nodes[n++] = r->nodes[i];
+	}
+	r->count = n;
+
+	if (r->replicas < 1)
+		r->replicas = 1;
+	if (r->replicas > r->count)
+		r->replicas = r->count;
+
+	r->npoints = 0;
+	for (int i = 0; i < r->count; ++i){
+		for (int v = 0; v < RING_VNODES; ++v){
+			r->points[r->npoints].point = vnode_point(&r->nodes[i], v);
+			r->points[r->npoints].node = i;
+			r->npoints++;
+		}
+	}
+	qsort(r->points, r->npoints, sizeof(r->points[0]), &point_cmp);
+
+	return 0;
+}
+
+/**
+ * @brief Lit une liste de serveurs "HOST:PORT,HOST:PORT,..."
+ * @details Chaque serveur est résolu une fois pour toutes (cf netopen).
+ *
+ * @param r anneau à remplir (r->self = -1, cf ring_find)
+ * @param list liste, modifiée
+ * @param replicas copies de chaque tuple
+ * @return 0 ou -1
+ */
+int ring_parse(ring* r, char* list, int replicas){
+	char *save = NULL, *item, *host, *port;
+	nethandle h;
+
+	memset(r, 0, sizeof(*r));
+	r->self = -1;
+	r->replicas = replicas;
+
+	for (item = strtok_r(list, ",", &save); item != NULL;
+		 item = strtok_r(NULL, ",", &save)){
+		  assert_return(r->count == RING_NODES_MAX,
+						"More than %d servers", RING_NODES_MAX);
+		  assert_return(netsplit(item, &host, &port) == -1,
+						"Bad server '%s', HOST:PORT expected", item);
+		  assert_return(netopen(host, port, &h, 'w') == -1,
+						"Can't resolve [%s]:%s", host, port);
+		r->nodes[r->count++] = *h.sin6;
+		netclose(&h);
+	}
+
+	return ring_build(r);
+}
+
+/**
+ * @brief Position d'une adresse parmi les serveurs de l'anneau
+ * @return indice dans r->nodes, -1 si a n'est pas un serveur de l'anneau
+ */
+int ring_find(const ring* r, const struct sockaddr_in6* a){
+	for (int i = 0; i < r->count; ++i){
+		if (node_cmp(&r->nodes[i], a) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Serveurs propriétaires d'une clé
+ * @details Les r->replicas premiers serveurs distincts à partir du premier
+ * point >= code, en tournant. owners[0] est le propriétaire principal.
+ *
+ * @param r anneau
+ * @param code code de hachage de la clé (cf dht_keycode)
+ * @param owners au moins r->replicas indices dans r->nodes
+ * @return nombre de propriétaires
+ */
+int ring_owners(const ring* r, uint32_t code, int* owners){
+	int lo = 0, hi = r->npoints, n = 0;
+
+	// Premier point >= code
+	while (lo < hi){
+		int mid = (lo + hi) / 2;
+		if (r->points[mid].point < code)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int i = 0; i < r->npoints && n < r->replicas; ++i){
+		int node = r->points[(lo + i) % r->npoints].node;
+		int seen = false;
+		for (int k = 0; k < n && !seen; ++k)
+			seen = (owners[k] == node);
+		if (!seen)
+			owners[n++] = node;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Indique si ce serveur est l'un des propriétaires d'une clé
+ */
+int ring_owns(const ring* r, uint32_t code){
+	int owners[RING_NODES_MAX];
+	int n = ring_owners(r, code, owners);
+
+	for (int i = 0; i < n; ++i){
+		if (owners[i] == r->self)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Encode la liste des serveurs (cf OP_RING)
+ * @details Seule la liste voyage: le destinataire recalcule les points.
+ *
+ * @return taille écrite, -1 si p est trop petit
+ */
+int ring_encode(const ring* r, uint8_t* p, int size){
+	  assert_return(size < RING_HEADER + r->count * RING_NODE,
+					"ring_encode: buffer too small");
+
+	p[0] = r->count;
+	p[1] = r->replicas;
+	p[2] = RING_VNODES >> 8;
+	p[3] = RING_VNODES & 0xff;
+	p += RING_HEADER;
+
+	for (int i = 0; i < r->count; ++i){
+		memcpy(p, &r->nodes[i].sin6_addr, 16);
+		memcpy(p + 16, &r->nodes[i].sin6_port, 2);
+		p += RING_NODE;
+	}
+
+	return RING_HEADER + r->count * RING_NODE;
+}
+
+/**
+ * @brief Décode une liste de serveurs reçue et construit l'anneau
+ * @details Un anneau à un autre nombre de noeuds virtuels placerait les
+ * clés ailleurs: il est refusé.
+ *
+ * @param r anneau (r->self = -1)
+ * @return 0 ou -1
+ */
+int ring_decode(ring* r, const uint8_t* p, int len){
+	  assert_return(len < RING_HEADER, "Truncated ring");
+	  assert_return(((p[2] << 8) | p[3]) != RING_VNODES,
+					"Ring with %d virtual nodes", (p[2] << 8) | p[3]);
+	  assert_return(p[0] == 0 || p[0] > RING_NODES_MAX ||
+					len < RING_HEADER + p[0] * RING_NODE, "Bad ring");
+
+	memset(r, 0, sizeof(*r));
+	r->self = -1;
+	r->count = p[0];
+	r->replicas = p[1];
+	p += RING_HEADER;
+
+	for (int i = 0; i < r->count; ++i){
+		r->nodes[i].sin6_family = AF_INET6;
+		memcpy(&r->nodes[i].sin6_addr, p, 16);
+		memcpy(&r->nodes[i].sin6_port, p + 16, 2);
+		p += RING_NODE;
+	}
+
+	return ring_build(r);
+}
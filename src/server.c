@@ -3,17 +3,16 @@
 //   Implémentation naïve du mécanisme général d'une DHT      //
 ////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
 #include "macros.h"
 #include "net.h"
-
-// cf dht_get, dht_update et garbage_collector
-#ifndef HASH_DEPRECATION_TIME
-	#define HASH_DEPRECATION_TIME 30
-#endif
-
-#ifndef GARBAGE_COL_TIME
-	#define GARBAGE_COL_TIME 300
-#endif
+#include "dht.h"
+#include "proto.h"
+#include "wal.h"
+#include "sync.h"
+#include "ring.h"
+#include "swim.h"
+#include "mcast.h"
 
 // Macros d'affichage.
 #define FILE "[SERVER]"
@@ -29,481 +28,451 @@
 #define assert_return(...) __assert_return(FILE, __VA_ARGS__)
 
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <signal.h>
+#include <getopt.h>
+#include <limits.h>
 
-typedef struct s_hash {
-	char* hash;
-	char* ip;
-	long int time; // timestamp de la dernière mise à jour
-} hash;
+// Nombre max de mots lus dans une commande (les suivants sont ignorés)
+#define CMD_MAX_WORDS 8
 
-/**
- * @brief La structure de la DHT
- * @details 
- * 
- * # Le tableau continu
- * 
- * Ma DHT est un tableau continu de hashs, façon FAT32
- * 
- * J'ai opté pour ne pas utiliser de liste chainée. 
- * Les listes chainées ont des
- * performances abominables chez moi. Chaque hash est à un emplacement 
- * différent dans la mémoire, or j'alloue de gros buffers assez régulièrement p
- * our récupérer et réceptionner des paquets ce qui force les maillons de mes 
- * chaines à être espacés dans la mémoire de plusieurs KO. 
- * Le cache trashing est énorme.
- * 
- * Le compilateur gère également beaucoup mieux les tableaux contigus (voire la
- * différence de performances en -O3)
- * 
- * Le top aurait été un arbre de recherche ou une table de hachage.
- * Mais j'ai préféré mettre en place ce qui touchait au réseau que d'améliorer
- * mes performances.
- * 
- * J'ai également hésité à utiliser les fonctions de la libc mais je me suis dit
- * que je me serais pris zéro.
- * https://www.gnu.org/software/libc/manual/html_node/Hash-Search-Function.html#Hash-Search-Function
- * https://www.gnu.org/software/libc/manual/html_node/Tree-Search-Function.html
- * 
- * # Les mutex et la concurrence
- * 
- * J'ai deux mutex servant a gérer la concurrence entre le garbage collector et
- * les accès à la DHT
- * Le garbage collector et les accès à la DHT sont mutuellement exclusifs.
- * Impossible de stocker une mutex par hash; il faudrait vérifier que la mutex
- * existe avant de la bloquer ce qui n'est pas atomique et rendrait le programme
- * non-déterministe
- */
-typedef struct s_dht {
-	// Gros tableau dynamique
-	hash* htable;
-	// indique le dernier hash plein (mis à jour aux appels de dht_add qui
-	// rajoutent un hash en fin de table)
-	unsigned int cursor;
-	// taille allouée pour htable (en unités)
-	unsigned int size;
-	// premier hash vide 
-	// (mis à jour par le garbage collector
-	// (et par dht_add lorsqu'il écrase le firstEmpty)
-	unsigned int firstEmpty;
-
-	// A verrouiller lorsque la DHT est en train d'être lue/écrite
-	pthread_mutex_t mutex;
-	// Locked à l'initialisation, unlocked à l'ajout du premier hash. 
-	// Le garbage collector a besoin de cette mutex *ouverte* pour se lancer
-	pthread_mutex_t gc;
-} dht;
+// Secondes entre deux instantanés de la DHT (cf --snapshot)
+#ifndef SNAPSHOT_PERIOD
+	#define SNAPSHOT_PERIOD 60
+#endif
 
 /**
- * @brief Libère un tableau de mots renvoyé par string_split
- * @details 
- * 
- * @param words 
+ * Un mot d'une commande: pointe directement dans le buffer de réception
  */
-void free_split(char** words){
-	if (words==NULL)
-		return;
-
-	for (int i = 0; words[i] != NULL; ++i)
-		free(words[i]);
-	free(words);
-}
+typedef struct s_token {
+	char* str;
+	int len;
+} token;
+
+enum e_opcode {
+	CMD_UNKNOWN,
+	CMD_PUT,
+	CMD_GET,
+	CMD_PLZGIBHASHES,
+	CMD_KKTAKETHIS,
+	CMD_I_EXIST,
+	CMD_STATS
+};
+
+// Anneau de serveurs (cf --ring), NULL si ce serveur garde toutes les clés
+ring* _G_RING = NULL;
 
 /**
- * @brief Découpe une string en fonction d'un substring entier
- * @details Saute les rendus "strings vides" mais peut être configuré
- * 
- * Ce n'est pas juste trivial; cette fonction gère l'overlap. 
- * Ce n'est pas la même fonctionnalité que strtok ou quelque autre fonction
- * de la libc.
- * 
- * Exemple:
+ * @brief Découpe une commande en mots, sur place
+ * @details Aucune allocation: chaque mot est une tranche (pointeur, taille)
+ * du buffer, et le premier séparateur qui le suit est remplacé par un '\0'
+ * pour que le mot reste utilisable comme c string.
+ * Séparateurs: espaces, tabulations et fins de ligne (nc en rajoute une)
  * 
  * ```C
- * string_split("A  | | B | C |", " | ");
+ *		token words[CMD_MAX_WORDS];
+ *		int n = tokenize(cmd, words, CMD_MAX_WORDS);
+ *		for (int i = 0; i < n; ++i)
+ *			printf("%.*s\n", words[i].len, words[i].str);
  * ```
- * Renverrait un tableau de cette forme:
- * t[0] = "A "  (pas " A " ou "A")
- * t[1] = "| B"
- * t[2] = "C |" (pas "C" ou segfault)
- * t[3] = (null)
- * 
- * t[3] = NULL pour signifier la fin du tableau.
+ * @param str Commande terminée par '\0', modifiée
+ * @param words Tableau de mots à remplir
+ * @param max Taille de words
  * 
- * ```C
- *		char** tab = string_split("A, B, C", ", ");
- *		for (int i = 0; tab[i] != NULL; ++i)
- *			printf("%s\n", tab[i]);
- * ```
- * @param str String à découper
- * @param substring Substring de séparation
- * 
- * @return Un tableau de char* terminé par NULL.
+ * @return Nombre de mots
  */
-char** string_split(char* str, char* substring){
-	char** mots;
-	unsigned int iMot = 0;      // Numéro du mot
-	//char* iMot = 0x1;          // 
-	unsigned int i = 0;			 // Position dans la string
-	unsigned int j = 0;			 // Position dans la substring
-	unsigned int tailleMot = 0;	 // Taille du mot courant
-
-	mots = malloc(sizeof(char*));
+static int tokenize(char* str, token* words, int max){
+	int n = 0;
+	char* p = str;
+
+	while (n < max){
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+		if (*p == '\0')
+			break;
 
-	/*
-	 * Nous parcourons le string et comparons chaque caractère
-	 * par rapport au début du substring.
-	 * Si nous trouvons que str[i] == substring[j], alors nous
-	 * incrémentons j
-	 * 
-	 * Nous ajoutons aussi virtuellement un match à la toute fin
-	 * de notre chaîne; car on souhaite aussi découper C dans "A,B,C"
-	 * Même si C n'est pas suivi d'une virgule.
-	 */
+		words[n].str = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && 
+			   *p != '\r')
+			p++;
+		words[n].len = p - words[n].str;
+		n++;
 
-	while (str != NULL) {
-		// Si finalement on ne trouve pas notre substring
-		if (str[i] != substring[j] && str[i] != '\0') {
-			// Nous revenons avant ces cases que nous avons cru être le début
-			// de notre substring et reprenons la détection à la case d'après
-			i = i - j;
-			i++;
-			tailleMot += 1;
-			j = 0;
-		}
-		// Sinon, si ce que nous avons en face ressemble à notre substring
-		else if (str[i] == substring[j] || str[i] == '\0'){
-			j++;
-			// Si nous avons un match complet
-			if (substring[j] == '\0' || str[i] == '\0'){
-				char c = str[i];
-				j--;
-
-				// On set remet au début de notre mot
-				i -= j; 		// en enlevant la taille de notre substring
-				i -= tailleMot; // et de notre mot
-				
-				/* 
-				 * Si nous avons atteint la fin de notre string mais que nous
-				 * étions en train de matcher quelque-chose, alors,
-				 * ce que nous croyions être un match n'était en fait rien.
-				 * Notre mot est donc plus grand que prévu.
-				 */
-				if (c == '\0')
-					tailleMot += j;
-
-				if (tailleMot > 0){
-					// On rajoute un pointeur dans le tableau de mots
-					mots = realloc(mots, (iMot+2) * sizeof(char*));
-					// (le tableau est 1 case trop grande, pour le NULL)
-
-					// Et on alloue de l'espace pour ce mot
-					mots[iMot] = malloc(tailleMot);
-					// printf("mots[%d] = %p\n", iMot, mots[iMot]);
-
-					// On copie le mot dans notre tableau et on finit par un '\0'
-					for (unsigned int n = 0; n < tailleMot; ++n)
-						mots[iMot][n] = str[i+n];
-					mots[iMot][tailleMot] = '\0';
-
-					// Ca fait un mot de plus.
-					iMot++;
-				}
-				if (c == '\0')
-					break;
-
-				// Réinitisalisation de la recherche
-				i += j;
-				i += tailleMot;
-				j = 0;
-				tailleMot = 0; 
-			}
-			i++;
-		} 
+		if (*p == '\0')
+			break;
+		*p++ = '\0';
 	}
 
-
-	// printf("mots[%d] = %p\n", iMot, mots[iMot]);
-	mots[iMot] = NULL;
-	// mots[0] = (char*)iMot;
-
-	return mots;
-}
-
-int dht_init(dht* d){
-	int tmp;
-
-	memset(d, 0, sizeof(dht));	  
-	tmp = pthread_mutex_init(&d->mutex, NULL);
-	  assert_return(tmp == -1, "mutex init");
-
-	tmp = pthread_mutex_init(&d->gc, NULL);
-	  assert_return(tmp == -1, "mutex gc init");
-
-	pthread_mutex_lock(&d->gc);
-
-	return 0;
+	return n;
 }
 
 /**
- * @brief Libère la mémoire allouée dans la DHT
- * @details 
- * 
- * @param d [description]
+ * @brief Reconnait le premier mot d'une commande
+ * @details Toutes les commandes ont des longueurs différentes, sauf put et
+ * get: la longueur sélectionne un unique candidat, confirmé par un memcmp.
  */
-void dht_free(dht* d){
-	for (unsigned int i = 0; i < d->cursor; ++i){
-		if (d->htable[i].hash != NULL){
-			free(d->htable[i].hash);
-			free(d->htable[i].ip);		
-		}
+static enum e_opcode opcode(token* t){
+	switch (t->len){
+		case 3:
+			if (memcmp(t->str, "put", 3) == 0)
+				return CMD_PUT;
+			if (memcmp(t->str, "get", 3) == 0)
+				return CMD_GET;
+			break;
+		case 5:
+			if (memcmp(t->str, "stats", 5) == 0)
+				return CMD_STATS;
+			break;
+		case 7:
+			if (memcmp(t->str, "i_exist", 7) == 0)
+				return CMD_I_EXIST;
+			break;
+		case 10:
+			if (memcmp(t->str, "kktakethis", 10) == 0)
+				return CMD_KKTAKETHIS;
+			break;
+		case 12:
+			if (memcmp(t->str, "plzgibhashes", 12) == 0)
+				return CMD_PLZGIBHASHES;
+			break;
 	}
-	free(d->htable);
-	d->htable = NULL;
-}
 
-/**
- * @brief Renvoie l'adresse du hash qui match le tuple (h, ip)
- * @details Pour vérifier si un hash est déjà présent sous une même IP. Ca 
- * change si on fait un dht_add ou un dht_update à l'appel de la commande PUT.
- * 
- * @param d DHT sur laquelle effectuer les opérations
- * @param h string hash
- * @param ip string ip
- * @return ptr hash
- */
-hash* dht_getWithIP(dht* d, char* h, char* ip){
-	if (d->cursor <= 0)
-		return NULL;
-
-	hash* ret = NULL;
-	pthread_mutex_lock(&d->mutex);
-
-	for (unsigned int i = 0; i < d->cursor; ++i){
-		if (d->htable[i].hash != NULL){
-			if ( (strcmp(h, d->htable[i].hash) == 0) &&
-				 (strcmp(ip  , d->htable[i].ip)   == 0) )
-			{
-				ret = &d->htable[i];
-				break;
-			}
-		}
-	}
-	pthread_mutex_unlock(&d->mutex);
-	return ret;
+	return CMD_UNKNOWN;
 }
 
 /**
- * @brief Renvoie l'adresse du hash dont le hash string est exactement p_search
+ * @brief Partage un hash
  * @details 
+ * Partage un hash à "serv", un ou plusieurs autres serveurs selon si 
+ * l'adresse est multicast
  * 
- * Ex: 
- * `dht_get(&d, "8962235e792f6b112f04f");` 
- * // Renvoie le premier hash correspondant à '8962235e792f6b112f04f' ou NULL
- * si aucun.
- * `dht_get(&d, NULL);` 
- * // Renvoie le 2e match ou NULL si aucun.
- * `dht_get(&d, NULL);`
- * // Renvoie le 3e match ou NULL si aucun.
+ * Au format binaire (OP_KKTAKETHIS) si la demande était binaire, sinon avec
+ * la commande texte kktakethis.
  * 
- * @param d DHT sur laquelle effectuer les opérations
- * @param p_search String hash
+ * @param h c string hash
+ * @param serv nethandle*
+ * @param req Demande binaire à laquelle on répond, NULL pour le format texte
  * 
- * @return ptr hash ou NULL si pas d'occurrence de hash
+ * @return 0 ou -1
  */
-hash* dht_get(dht* d, char* p_search){
-	if (d->cursor <= 0)
-		return NULL;
-
-	static unsigned int i = 0;
-	static char* search = NULL;
+int share_hash(hash* h, nethandle* serv, proto_msg* req){
+	int tmp;
 
-	if (p_search != NULL){
-		i = 0;
-		search = p_search;
+	if (req != NULL){
+		proto_msg m = {.op = OP_KKTAKETHIS, .id = req->id};
+		uint8_t buf[NET_PAYLOAD];
+		proto_fromhash(h, &m);
+		tmp = proto_encode(&m, buf, sizeof(buf));
+		  assert_return(tmp == -1, "share_hash encode");
+		tmp = netsend_binary(serv, buf, tmp);
+		  assert_return(tmp == -1, "share_hash netsend");
+		return 0;
 	}
 
-	hash* ret = NULL;
-	pthread_mutex_lock(&d->mutex);
-
-	for (; i < d->cursor; ++i){
-		if (d->htable[i].hash != NULL) {
-			if (strcmp(d->htable[i].hash, search) == 0){
-				ret = &d->htable[i++];
-				break;
-			}
-		}
-	}
+	char kbuf[DHT_KEY_STRLEN], abuf[DHT_ADDR_STRLEN];
+	const char* key = dht_keystr(h, kbuf);
+	const char* ip  = dht_ipstr(h, abuf);
 
-	pthread_mutex_unlock(&d->mutex);
-	return ret;
-}
+	// "kktakethis " + clé + ' ' + IP + ' ' + timestamp (20 caractères et
+	// signe au plus)
+	char str[11 + DHT_KEY_STRLEN + DHT_ADDR_STRLEN + 24];
+	int len = snprintf(str, sizeof(str), "kktakethis %s %s %ld", 
+					   key, ip, h->time);
 
-/**
- * @brief Rajoute toujours un hash à la DHT au premier emplacement libre
- * @details Ne vérifie pas si le hash existe déjà dans le tableau.
- * Gère tout seul l'agrandissement du tableau.
- * Met à jour "firstEmpty" au prochain hash null si "firstEmpty" est écrasé
- * Vérifie que le hash ne dépasse pas le HASH_DEPRECATION_TIME avant de le
- * renvoyer
- * 
- * @param d DHT sur laquelle effectuer les opérations
- * @param h Hash
- * @param ip IP
- * @return -1 ou 0
- */
-int dht_add(dht* d, char* h, char* ip){
-	assert_return(h  == NULL, "Bad command (put - no hash provided)");
-	assert_return(ip == NULL, "Bad command (put - no IP provided)");
-
-	pthread_mutex_lock(&d->mutex);
-
-	// On cherche le premier emplacement libre
-	int firstHash = (d->htable == NULL);
-	hash* s = NULL;
-	unsigned int found = 0;
-	unsigned int i;
-	for (i = d->firstEmpty; i < d->cursor; ++i){
-		if (d->htable[i].hash == NULL){
-			found = i;
-			break;
-		}
-	}
-
-	// Si on en a trouvé un
-	if (found){
-		info("Trouvé");
-		// On note la position du suivant tant que le tableau est dans le cache
-		for (; i < d->cursor; ++i){
-			if (d->htable[i].hash == NULL){
-				break;
-			}
-		}
-		d->firstEmpty = i;
-	}
-	else {
-		found = d->cursor++;
-		d->firstEmpty = d->cursor;
-	}
-
-	// Si on manque de place, on agrandit le tableau
-	if (d->cursor >= d->size){
-		d->size += 512;
-		info("  Redim hash table to %d", d->size);
-		d->htable = realloc(d->htable, d->size*sizeof(hash));
-		  assert_return(d->htable == NULL, "malloc");
+	// Clé ou IP *_LONG: le format binaire (plzgibhashes binaire) les partage
+	if (len < 0 || len >= (int)sizeof(str)){
+		warn("  '%.32s...' too long to be shared as text, skipped", key);
+		return 0;
 	}
 
-	s = &d->htable[found];
-
-	s->hash = malloc(strlen(h));
-	  assert_return(s->hash == NULL, "malloc");
-	strcpy(s->hash, h);
-
-	s->ip = malloc(strlen(ip));
-	  assert_return(s->ip == NULL, "malloc");
-	strcpy(s->ip, ip);
-
-	s->time = time(NULL);
+	info("  Sharing '%s'", str);
 
-	pthread_mutex_unlock(&d->mutex);
+	tmp = netsend(serv, str);
+	  assert_return(tmp == -1, "share_hash netsend");
 
-	info("  Added hash %s (%s)", s->hash, s->ip);
+	return 0;
+}
 
-	if (firstHash){
-		// Le premier hash a été ajouté
-		// On débloque le garbage collector qui attend p-e depuis le démarrage
-		pthread_mutex_unlock(&d->gc);
-	}
+/**
+ * Destinataire d'un partage, cf share_hash_cb
+ */
+typedef struct s_share {
+	nethandle* serv;
+	proto_msg* req;
+} share;
 
+/**
+ * @brief share_hash au format attendu par dht_foreach
+ */
+static int share_hash_cb(hash* h, void* arg){
+	share* sh = arg;
+	int tmp = share_hash(h, sh->serv, sh->req);
+	  assert_return(tmp, "share hash fail");
 	return 0;
 }
 
 /**
- * @brief Rajoute un tuple dans la DHT ou en met un à jour
- * @details Un hash peut être mis à jour tant qu'il est dans la table.
- * Le garbage collector passe toutes les GARBAGE_COL_TIME secondes
+ * @param d 
+ * @param serv Serveur distant
+ * @param req Demande binaire (terminée par un OP_END), NULL pour le format 
+ * texte
  * 
- * @param d DHT sur laquelle effectuer les opérations
- * @param h Hash
- * @param ip IP
- * @return -1 ou 0
+ * @return 
  */
-int dht_update(dht* d, char* h, char* ip, char* t){
-	assert_return(h == NULL, "Bad command (put - no hash provided)");
-	assert_return(ip   == NULL, "Bad command (put - no IP provided)");
+int share_hashes(dht* d, nethandle* multicast, proto_msg* req){
+	share sh = {multicast, req};
+	int tmp;
 
-	hash* found = dht_getWithIP(d, h, ip);
-	if (found == NULL) {
-		return dht_add(d, h, ip);
-	}
-	else {
-		if (t == NULL) {
-			found->time = time(NULL);
-		} else {
-			found->time = atol(t);
-		}
-		info("  Updated hash %s (%s)", found->hash, found->ip);
-		return 0;
+	info("Sharing all of my hashes with %s.", multicast->addr);
+	tmp = dht_foreach(d, &share_hash_cb, &sh);
+
+	if (req != NULL){
+		uint8_t buf[PROTO_HEADER];
+		proto_msg end = {.op = OP_END, .id = req->id};
+		if (netsend_binary(multicast, buf, 
+						   proto_encode(&end, buf, sizeof(buf))) == -1)
+			tmp = -1;
 	}
 
-	return -1;
+	return tmp;
 }
 
 /**
- * @brief Partage un hash
- * @details 
- * Partage un hash à "serv", un ou plusieurs autres serveurs selon si 
- * l'adresse est multicast
- * 
- * @param h c string hash
- * @param serv nethandle*
- * 
- * @return 0 ou -1
+ * @brief Acquitte un PUT binaire par un OP_END
+ * @details Sans acquittement, libdhtclient renvoie le PUT (cf dhtclient.h).
+ * Un PUT est idempotent: un doublon ne fait que rafraîchir le tuple.
  */
-int share_hash(hash* h, nethandle* serv){
-	(void) serv;
-	int tmp;
-
-	char t[21];
-	sprintf(t, "%ld", h->time);
+static int put_ack(proto_msg* req, nethandle* sender){
+	uint8_t out[PROTO_HEADER];
+	proto_msg end = {.op = OP_END, .id = req->id};
+	int len = proto_encode(&end, out, sizeof(out));
 
-	int len = strlen(h->hash) + strlen(h->ip) + strlen(t);
-
-	char str[len+11];
+	return (netsend_binary(sender, out, len) == -1) ? -1 : 0;
+}
 
-	sprintf(str, "kktakethis %s %s %ld", h->hash, h->ip, h->time);
+/**
+ * @brief Envoie un message binaire au serveur node de l'anneau
+ * @details Depuis la socket qui a reçu la requête (cf sockaddr_to_nethandle)
+ */
+static int ring_send(nethandle* via, int node, void* buf, int len){
+	nethandle to;
+	int tmp = sockaddr_to_nethandle(&_G_RING->nodes[node], via, &to);
+	  assert_return(tmp == -1, "ring_send: bad node %d", node);
+	return netsend_binary(&to, buf, len);
+}
 
-	info("  Sharing '%s'", str);
+/**
+ * @brief Range un PUT en mode anneau (cf ring.h)
+ * @details
+ * - pas propriétaire de la clé: le PUT est transmis au propriétaire
+ *   principal (au suivant s'il est mort, cf swim_alive), le client n'a pas
+ *   à connaître l'anneau
+ * - propriétaire: le tuple est inséré puis copié chez les autres
+ *   propriétaires, en OP_KKTAKETHIS qui n'est pas propagé à son tour
+ *
+ * Un PUT transmis par un autre serveur de l'anneau n'est jamais retransmis:
+ * si les deux anneaux diffèrent, il est gardé ici plutôt que de tourner en
+ * rond.
+ *
+ * N'acquitte rien: c'est à l'appelant d'acquitter un PUT binaire (cf
+ * put_ack), un put texte n'a pas de réponse.
+ *
+ * @param d DHT
+ * @param m PUT décodé, modifié
+ * @param sender Expéditeur
+ * @return 0 ou -1
+ */
+static int ring_put(dht* d, proto_msg* m, nethandle* sender){
+	int owners[RING_NODES_MAX];
+	int n = ring_owners(_G_RING, m->key.code, owners);
+	int mine = ring_owns(_G_RING, m->key.code);
+	uint8_t buf[NET_PAYLOAD];
+	int len, code = 0;
+
+	if (!mine && ring_find(_G_RING, sender->sin6) == -1){
+		int i = 0;
+		while (i < n - 1 && !swim_alive(&_G_RING->nodes[owners[i]]))
+			i++;
+		m->op = OP_PUT;
+		len = proto_encode(m, buf, sizeof(buf));
+		  assert_return(len == -1, "ring_put: can't encode");
+		  assert_return(ring_send(sender, owners[i], buf, len) == -1,
+						"ring_put: can't forward");
+		return 0;
+	}
+	if (!mine)
+		warn("  PUT forwarded by %s for a key it owns", sender->addr);
+
+	  assert_return(dht_updatek(d, &m->key, &m->addr, 0) == -1, 
+					"ring_put: insert failed");
+
+	m->op = OP_KKTAKETHIS;
+	m->time = time(NULL);
+	len = proto_encode(m, buf, sizeof(buf));
+	  assert_return(len == -1, "ring_put: can't encode");
+	for (int i = 0; i < n; ++i){
+		if (owners[i] != _G_RING->self && 
+			swim_alive(&_G_RING->nodes[owners[i]]) &&
+			ring_send(sender, owners[i], buf, len) == -1)
+			code = -1;
+	}
 
-	tmp = netsend(serv, str);
-	  assert_return(tmp == -1, "share_hash netsend");
+	return code;
+}
 
-	return 0;
+/**
+ * @brief Répond la liste des serveurs de l'anneau
+ * @param op OP_RING, ou OP_MOVED pour un GET adressé au mauvais serveur
+ */
+static int ring_reply(uint8_t op, proto_msg* req, nethandle* sender){
+	uint8_t body[RING_HEADER + RING_NODES_MAX * RING_NODE];
+	uint8_t out[NET_PAYLOAD];
+	proto_msg m = {.op = op, .id = req->id};
+	int len = ring_encode(_G_RING, body, sizeof(body));
+
+	m.cur = body;
+	m.end = body + len;
+	len = proto_encode(&m, out, sizeof(out));
+	  assert_return(len == -1, "ring_reply: can't encode");
+
+	return (netsend_binary(sender, out, len) == -1) ? -1 : 0;
 }
 
 /**
- * @param d 
- * @param serv Serveur distant
+ * @brief Traite une requête au format binaire (cf proto.h)
+ * @details Même sémantique que les commandes texte de treat_cmd, sans aucun
+ * formatage ni parsing de texte: la clé et l'adresse décodées sont passées
+ * telles quelles à la DHT, et les réponses portent l'id de la requête.
  * 
- * @return 
+ * Un GET reçoit un unique datagramme contenant toutes les adresses qui y
+ * tiennent (cf proto_page_add), et la position de la suite s'il en reste.
+ *
+ * OP_SYNC, OP_PULL, OP_DIGEST, OP_BATCH et OP_END sont les messages d'une
+ * synchronisation ou d'une réparation entre serveurs (cf sync.h).
+ *
+ * En mode anneau, un PUT est rangé chez les propriétaires de la clé (cf
+ * ring_put) et un GET adressé à un autre serveur reçoit un OP_MOVED. Sinon,
+ * avec --multicast, un PUT est annoncé aux autres serveurs (cf mcast_put).
+ * Un PUT reçu d'un client est acquitté par un OP_END (cf put_ack).
+ * 
+ * @param d DHT sur laquelle effectuer les opérations
+ * @param buf Message reçu
+ * @param len Taille du message
+ * @param sender Expéditeur, destinataire des réponses
+ * @return -1 ou 0
  */
-int share_hashes(dht* d, nethandle* multicast){
-	int tmp;
+int treat_binary(dht* d, void* buf, int len, nethandle* sender){
+	int code = -1;
+	proto_msg m;
 
-	info("Sharing all of my hashes with %s.", multicast->addr);
-	hash* h;
-	for (unsigned int i = 0; i < d->cursor; ++i){
-		h = &d->htable[i];
+	  assert_return(proto_decode(buf, len, &m) == -1, "Bad binary message");
 
-		if (h->hash != NULL){
-			tmp = share_hash(h, multicast);
-			  assert_return(tmp, "share hash fail for %s %s", h->ip, h->hash);
+	switch (m.op){
+	case OP_PUT:
+		if (_G_RING){
+			code = ring_put(d, &m, sender);
+			// Le client, pas un serveur de l'anneau qui transmet
+			if (code == 0 && ring_find(_G_RING, sender->sin6) == -1)
+				code = put_ack(&m, sender);
+			break;
 		}
+		code = (dht_updatek(d, &m.key, &m.addr, 0) == -1) ? -1 : 0;
+		if (code == 0)
+			code = put_ack(&m, sender);
+		if (code == 0)
+			code = mcast_put(&m.key, &m.addr);
+		break;
+
+	// Une seule page par requête: le client redemande la suite (m.from)
+	case OP_GET: {
+		proto_page pg;
+		dht_result r;
+		uint8_t out[NET_PAYLOAD];
+		uint32_t next;
+		unsigned int i;
+
+		if (_G_RING && !ring_owns(_G_RING, m.key.code)){
+			code = ring_reply(OP_MOVED, &m, sender);
+			break;
+		}
+
+		dht_lookupk(d, &m.key, m.from, &r);
+		next = r.next;
+
+		proto_page_init(&pg, out, sizeof(out), m.id);
+		for (i = 0; i < r.count; ++i){
+			if (proto_page_add(&pg, &r.addrs[i]) == 0)
+				continue;
+			// Page pleine: la suite commence ici, sauf pour une adresse qui
+			// ne tiendrait même pas seule dans une page
+			if (pg.count == 0){
+				warn("  Address too long for a datagram, skipped");
+				continue;
+			}
+			next = m.from + i;
+			break;
+		}
+
+		code = netsend_binary(sender, out, proto_page_end(&pg, next));
+		if (code != -1)
+			code = 0;
+		break;
 	}
 
-	return 0;
+	case OP_PLZGIBHASHES:
+		code = share_hashes(d, sender, &m);
+		break;
+
+	case OP_KKTAKETHIS:
+		code = (dht_updatek(d, &m.key, &m.addr, m.time) == -1) ? -1 : 0;
+		break;
+
+	// Synchronisation en masse et anti-entropie (cf sync.h)
+	case OP_SYNC:
+	case OP_PULL:
+		code = sync_serve(d, sender, &m);
+		break;
+
+	case OP_DIGEST:
+		code = sync_digest(d, &m, sender);
+		break;
+
+	case OP_BATCH:
+		code = sync_recv(d, &m, sender);
+		break;
+
+	case OP_END:
+		success("Sync %u from %s done", m.id, sender->addr);
+		code = 0;
+		break;
+
+	// Appartenance au groupe (cf swim.h)
+	case OP_PING:
+	case OP_PING_REQ:
+	case OP_PING_ACK:
+		code = swim_recv(&m, sender);
+		break;
+
+	// Sans anneau, un OP_END: toutes les clés sont ici
+	case OP_RING:
+		if (_G_RING){
+			code = ring_reply(OP_RING, &m, sender);
+		}
+		else {
+			uint8_t out[PROTO_HEADER];
+			proto_msg end = {.op = OP_END, .id = m.id};
+			code = netsend_binary(sender, out, 
+								  proto_encode(&end, out, sizeof(out)));
+			code = (code == -1) ? -1 : 0;
+		}
+		break;
+
+	default:
+		warn("Bad binary message (opcode %d)", m.op);
+	}
+
+	return code;
 }
 
 /**
@@ -512,112 +481,227 @@ int share_hashes(dht* d, nethandle* multicast){
  * Commandes comprises:
  * - put [str hash] [str ip]
  * - get [str hash]
+ * - plzgibhashes
+ * - kktakethis [str hash] [str ip] [timestamp]
+ * - i_exist
+ * - stats
  * Séparateur d'arguments: espace+
+ *
+ * En mode anneau, put est rangé chez les propriétaires de la clé (cf
+ * ring_put), et get d'une clé qui n'est pas ici répond ses propriétaires.
+ * 
+ * cmd est découpée sur place (cf tokenize), sans aucune allocation.
  * 
  * @param d DHT sur laquelle effectuer les opérations
- * @param cmd Commande en question
+ * @param cmd Commande en question (modifiée)
  * @param sender Certaines commandes ont des valeurs de retour à renvoyer à 
  * celui qui les a envoyé
  * @return -1 ou 0
  */
 int treat_cmd(dht* d, char* cmd, nethandle* sender){
 	int code = -1;
-	char** words = string_split(cmd, " ");
-	hash* result;
+	token words[CMD_MAX_WORDS];
+	int n = tokenize(cmd, words, CMD_MAX_WORDS);
+	char ip[DHT_ADDR_STRLEN];
+
+	if (n == 0){
+		warn("Bad command (empty)");
+		return -1;
+	}
 
+	switch (opcode(&words[0])){
 	// put hash ip
-	if (strcmp(words[0], "put") == 0){
-		// todo: regarder ce qu'on me donne
-		code =  dht_update(d, words[1], words[2], NULL);
+	case CMD_PUT:
+		if (n < 3){
+			warn("Bad command (put HASH IP)");
+			break;
+		}
+		if (_G_RING){
+			proto_msg m = {.op = OP_PUT};
+			dht_keyenc(words[1].str, &m.key);
+			dht_addrenc(words[2].str, &m.addr);
+			code = ring_put(d, &m, sender);
+			break;
+		}
+		// Les autres serveurs l'apprennent par le groupe multicast, avec les
+		// PUT voisins (cf mcast_put)
+		hkey k, a;
+		dht_keyenc(words[1].str, &k);
+		dht_addrenc(words[2].str, &a);
+		code = (dht_updatek(d, &k, &a, 0) == -1) ? -1 : 0;
+		if (code == 0)
+			code = mcast_put(&k, &a);
+		break;
 
-		
-		////////////////////////////////////////////////////
-		//                                                //
-		//                Question 1.2                    //
-		//                                                //
-		//     Le multicast en marche pas, mais           //
-		//     en assumant qu'il marche voici comment     //
-		//     le programme fonctionnerait                //
-		//                                                //
-		////////////////////////////////////////////////////
-		
-		/*
-		result = dht_getWithIP(d, words[1], words[2]);
-			// Envoie le hash avec share_hash et non put pour éviter les boucles
-			// de serveurs qui s'entre-partagent à l'infini un même hash
-		code += share_hash(result, groupe_multicast);
-		//*/
-	}
 	// get hash
-	else if (strcmp(words[0], "get") == 0) {
-		// Look for hashes
-		result = dht_get(d, words[1]);
-		if (result){
-			info("  Found hash %s", result->hash);
+	case CMD_GET: {
+		if (n < 2){
+			warn("Bad command (get HASH)");
+			break;
 		}
-		else {
-			info("  No hash %s", words[1]);
+		// Copie des IPs, par paquets de DHT_RESULT_MAX (cf dht_lookup)
+		dht_result r;
+		uint32_t from = 0;
+		code = 0;
+
+		// Pas ici: une ligne "moved [IP]:PORT" par propriétaire
+		hkey k;
+		dht_keyenc(words[1].str, &k);
+		if (_G_RING && !ring_owns(_G_RING, k.code)){
+			int owners[RING_NODES_MAX];
+			int nb = ring_owners(_G_RING, k.code, owners);
+			char str[INET6_ADDRSTRLEN + 16];
+			for (int i = 0; i < nb; ++i){
+				struct sockaddr_in6* a = &_G_RING->nodes[owners[i]];
+				inet_ntop(AF_INET6, &a->sin6_addr, ip, sizeof(ip));
+				sprintf(str, "moved [%s]:%d", ip, ntohs(a->sin6_port));
+				if (netsend(sender, str) == -1)
+					code = -1;
+			}
+			if (netsend(sender, "(null)") == -1)
+				code = -1;
+			break;
 		}
 
-		// Send every hash
-		while (result != NULL) {
-			// Si hash encore valide
-			if (result->time+HASH_DEPRECATION_TIME >= time(NULL)){
-				code = netsend(sender, result->ip);
-				if (code == 0){
-					info("    Sent ip %s", result->ip);
-				} else {
-					warn("  netsend failure for %s (%s)", result->ip, result->hash);
+		do {
+			dht_lookup(d, words[1].str, from, &r);
+			if (from == 0 && r.count == 0){
+				info("  No hash %s", words[1].str);
+			}
+
+			// Send every hash
+			for (unsigned int i = 0; i < r.count; ++i){
+				const char* str = proto_addrstr(&r.addrs[i], ip);
+				if (netsend(sender, (char*)str) == -1){
+					warn("  netsend failure for %s (%s)", str, words[1].str);
+					code = -1;
+				}
+				else {
+					info("    Sent ip %s", str);
 				}
-			} else {
-				info("    Deprecated hash %s", result->ip);
 			}
-			result = dht_get(d, NULL);
-		}
-		code = netsend(sender, "(null)");
-		info("    Sent (null) terminator");
+			from = r.next;
+		} while (from != 0);
 
+		if (netsend(sender, "(null)") == -1)
+			code = -1;
+		info("    Sent (null) terminator");
+		break;
 	}
+
 	// share hashes
-	else if (strcmp(words[0], "plzgibhashes") == 0) {
-		code = share_hashes(d, sender);
-	}
+	case CMD_PLZGIBHASHES:
+		code = share_hashes(d, sender, NULL);
+		break;
+
 	// receive a hash from another server
-	else if (strcmp(words[0], "kktakethis") == 0) {
+	case CMD_KKTAKETHIS:
 		info("Received kktakethis from %s", sender->addr);
-		// todo: mutex
-		if (words[1] && words[2] && words[3]){
-			code = dht_update(d, words[1], words[2], words[3]);
+		if (n >= 4){
+			code = dht_update(d, words[1].str, words[2].str, words[3].str);
 		}
+		break;
+
+	// occupation de la DHT (cf dht_getstats)
+	case CMD_STATS: {
+		dht_stats st;
+		char str[320];
+		int alive, suspect, dead;
+		dht_getstats(d, &st);
+		n = sprintf(str, "entries %u slots %u capacity %u keys %u index %u "
+						 "table %zu arena %zu/%zu big %zu",
+					st.entries, st.slots, st.capacity, st.keys, st.isize,
+					st.table_bytes, st.arena_used, st.arena_reserved, 
+					st.arena_big);
+		if (swim_count(&alive, &suspect, &dead) == 0)
+			sprintf(str + n, " alive %d suspect %d dead %d", 
+					alive, suspect, dead);
+		code = netsend(sender, str);
+		break;
 	}
-	else if (strcmp(words[0], "i_exist") == 0) {
-		// todo: keep alive
-	}
-	else {
-		warn("Bad command (unknown): %s ('%s')", cmd, words[0]);
+
+	// i_exist: un serveur rejoint le groupe (cf swim_hello)
+	case CMD_I_EXIST:
+		code = swim_hello(sender);
+		break;
+
+	default:
+		warn("Bad command (unknown): '%s'", words[0].str);
 	}
 
-	free_split(words);
 	return code;
 }
 
+/**
+ * Un thread de traitement: sa socket (toutes liées à la même adresse avec
+ * SO_REUSEPORT) et sa boucle réception -> treat_cmd
+ */
+typedef struct s_worker {
+	pthread_t thread;
+	int id;
+	// CPU sur lequel épingler le thread, -1 pour laisser faire le noyau
+	int cpu;
+	nethandle s;
+	// Datagrammes reçus et réponses en attente de ce thread
+	netbatch batch;
+	dht* d;
+} worker;
+
 /**
  * @brief [Internal] Quitte le programme en libérant la mémoire
- * @details Appelé lorsque le serveur reçoit sig_term ou sig_int
+ * @details Appelé par le thread principal lorsque le serveur reçoit sig_term
+ * ou sig_int (cf sigwait dans main). On n'est donc pas dans un gestionnaire
+ * de signal: on peut réveiller les workers et les attendre avant de libérer
+ * la DHT sous leurs pieds.
+ *
+ * Les synchronisations en cours (cf sync_serve) sont interrompues, les
+ * derniers PUT sont annoncés au groupe multicast (cf mcast_stop).
+ * Avec --snapshot, la DHT est sauvegardée une dernière fois, une fois les
+ * workers arrêtés. Avec --wal, c'est un point de reprise (cf wal_checkpoint)
+ * suivi de la fermeture du journal.
  * 
  * @param signal
  */
-nethandle* _G_PTR_NET_DHT = NULL;
-dht*       _G_PTR_DHT     = NULL;
+worker* _G_WORKERS    = NULL;
+int     _G_NB_WORKERS = 0;
+dht*    _G_PTR_DHT    = NULL;
+char*   _G_SNAPSHOT   = NULL;
+wal*    _G_WAL        = NULL;
+// Garbage collector, arrêté par dht_free
+pthread_t _G_GC;
+// Posé par handle_signal avant de fermer les sockets des workers
+int     _G_STOPPING   = false;
 
 void handle_signal(int signal){
 	switch (signal) {
 		case SIGINT:
 		case SIGTERM:
-			if (_G_PTR_NET_DHT)
-				netclose(_G_PTR_NET_DHT);
-			if (_G_PTR_DHT)
+			// Les sondes partent des sockets des workers
+			swim_stop();
+			// shutdown réveille les recvmmsg bloqués: les workers voient
+			// _G_STOPPING et s'arrêtent
+			__atomic_store_n(&_G_STOPPING, true, __ATOMIC_RELEASE);
+			for (int i = 0; i < _G_NB_WORKERS; ++i)
+				shutdown(_G_WORKERS[i].s.socket_desc, SHUT_RDWR);
+			for (int i = 0; i < _G_NB_WORKERS; ++i){
+				pthread_join(_G_WORKERS[i].thread, NULL);
+				netbatch_free(&_G_WORKERS[i].batch);
+				netclose(&_G_WORKERS[i].s);
+			}
+			mcast_stop();
+			sync_stop();
+			if (_G_PTR_DHT && _G_WAL){
+				wal_checkpoint(_G_WAL, _G_PTR_DHT, _G_SNAPSHOT);
+				wal_close(_G_WAL);
+			}
+			else if (_G_PTR_DHT && _G_SNAPSHOT){
+				dht_save(_G_PTR_DHT, _G_SNAPSHOT);
+			}
+			if (_G_PTR_DHT){
 				dht_free(_G_PTR_DHT);
+				pthread_join(_G_GC, NULL);
+			}
+			free(_G_WORKERS);
 			errno = 0;
 			err("Termination signal");
 			exit(EXIT_FAILURE);
@@ -627,59 +711,207 @@ void handle_signal(int signal){
 }
 
 /**
- * @brief Garbage collector en thread séparé
- * @details Libère les hash vieux de GARBAGE_COL_TIME
+ * @brief Boucle d'un thread de traitement
+ * @details Ecoute sa socket et exécute les commandes reçues, par lots: un
+ * appel système pour lire jusqu'à NET_BATCH commandes, un (ou quelques) pour
+ * envoyer toutes leurs réponses.
+ * S'arrête seulement sur _G_STOPPING (cf handle_signal): une erreur de
+ * lecture ou un datagramme vide n'arrête jamais un worker, dont la socket
+ * SO_REUSEPORT continuerait sinon de recevoir sa part des messages.
  * 
- * @param param [description]
- * @return [description]
+ * @param param worker*
+ * @return NULL
  */
-void* garbage_collector(void* param){
-	dht* d = (dht*)param;
-	hash* h;
-	long int t;
-	int size = sizeof(hash);
-
-	pthread_mutex_lock(&d->gc);
-
-	while (d->htable != NULL){
-		sleep(HASH_DEPRECATION_TIME);
-	
-		pthread_mutex_lock(&d->mutex);
-		info("Garbage collection started");
-		t = time(NULL);
-
-		for (unsigned int i = 0; i < d->cursor; ++i){
-			h = &d->htable[i];
-			if ( h->hash != NULL && (h->time + GARBAGE_COL_TIME) < t){
-				info("  Free of (%s, %s)", h->ip, h->hash);
-				free(h->ip);
-				free(h->hash);
-				memset(h, 0, size);
-				if (i < d->firstEmpty){
-					d->firstEmpty = i;
-				}
-			}
-		}	
+void* worker_loop(void* param){
+	worker* w = (worker*)param;
+	int tmp;
+
+	if (w->cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		tmp = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		check(tmp == 0, "Worker %d pinned on CPU %d", w->id, w->cpu);
+	}
+
+	// Ecoute de la socket
+	// sender ne possède rien (cf sockaddr_to_nethandle), il reste sur la pile
+	nethandle sender;
+	char* cmd;
+	int n;
+	while (true) {
+		n = netlisten_batch(&w->s);
+		if (__atomic_load_n(&_G_STOPPING, __ATOMIC_ACQUIRE))
+			break;
+		if (n == -1) {
+			warn("Worker %d: listen failed", w->id);
+			continue;
+		}
 		
-		pthread_mutex_unlock(&d->mutex);
-		info("Garbage collection done (%lds)", time(NULL)-t);
+		for (int i = 0; i < n; ++i){
+			cmd = netbatch_get(&w->s, i, &sender);
+			if (cmd == NULL)
+				continue;
+
+			// Traitement & exécution de la commande
+			// Les réponses partent toutes ensemble au netflush
+			if (proto_is_binary(cmd, sender.length)){
+				tmp = treat_binary(w->d, cmd, sender.length, &sender);
+			}
+			else {
+				tmp = treat_cmd(w->d, cmd, &sender);
+			}
+			// info("Recv : '%s'", cmd);
+
+			if (tmp == -1){
+				warn("Failed: '%s'", proto_is_binary(cmd, sender.length) ? 
+					 "(binary)" : cmd);
+			}
+			else {
+				// success("Treated: '%s'", cmd);
+			}
+		}
+
+		netflush(&w->batch);
 	}
-	
-	pthread_mutex_lock(&d->gc);
 
 	return NULL;
 }
 
+void usage(char* name){
+	err("Usage: %s IP PORT [--threads N] [--pin] [--large] [--expect N] "
+		"[--hugepages] [--snapshot FILE] [--snapshot-every SEC] [--wal PREFIX] "
+		"[--wal-interval MS] [--sync-from HOST:PORT] [--peer HOST:PORT] "
+		"[--repair-every SEC] [--ring HOST:PORT,...] [--replicas R] "
+		"[--join HOST:PORT,...] [--probe-every MS] [--multicast GROUP:PORT] "
+		"[--multicast-if IFACE] [--announce-every MS]\n", name);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {	
 	int tmp;
+	int nb_threads = 1;
+	int pin = false;
+	int large = false;
+	long expect = 0;
+	int huge = false;
+	int snap_period = SNAPSHOT_PERIOD;
+	char* wal_prefix = NULL;
+	int wal_interval = WAL_INTERVAL;
+	char* sync_from = NULL;
+	char* peer = NULL;
+	int repair_period = SYNC_REPAIR_PERIOD;
+	char* ring_list = NULL;
+	int replicas = RING_REPLICAS;
+	char* join = NULL;
+	int probe_period = SWIM_PERIOD;
+	char* multicast = NULL;
+	char* multicast_if = NULL;
+	int announce_period = MCAST_INTERVAL;
+
+	static struct option options[] = {
+		{"threads",   required_argument, NULL, 't'},
+		{"pin",       no_argument,       NULL, 'p'},
+		{"large",     no_argument,       NULL, 'l'},
+		{"expect",    required_argument, NULL, 'e'},
+		{"hugepages", no_argument,       NULL, 'H'},
+		{"snapshot",  required_argument, NULL, 's'},
+		{"snapshot-every", required_argument, NULL, 'S'},
+		{"wal",       required_argument, NULL, 'w'},
+		{"wal-interval", required_argument, NULL, 'W'},
+		{"sync-from", required_argument, NULL, 'f'},
+		{"peer",      required_argument, NULL, 'P'},
+		{"repair-every", required_argument, NULL, 'R'},
+		{"ring",      required_argument, NULL, 'r'},
+		{"replicas",  required_argument, NULL, 'N'},
+		{"join",      required_argument, NULL, 'j'},
+		{"probe-every", required_argument, NULL, 'i'},
+		{"multicast", required_argument, NULL, 'm'},
+		{"multicast-if", required_argument, NULL, 'M'},
+		{"announce-every", required_argument, NULL, 'a'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((tmp = getopt_long(argc, argv, "t:ple:Hs:S:w:W:f:P:R:r:N:j:i:m:M:a:", options, NULL)) 
+		   != -1){
+		switch (tmp){
+			case 't':
+				nb_threads = atoi(optarg);
+				  assert(nb_threads <= 0, "Bad thread count");
+				break;
+			case 'p':
+				pin = true;
+				break;
+			case 'l':
+				large = true;
+				break;
+			case 'e':
+				expect = atol(optarg);
+				  assert(expect <= 0 || expect > UINT32_MAX, "Bad entry count");
+				break;
+			case 'H':
+				huge = true;
+				break;
+			case 's':
+				_G_SNAPSHOT = optarg;
+				break;
+			case 'S':
+				snap_period = atoi(optarg);
+				  assert(snap_period <= 0, "Bad snapshot period");
+				break;
+			case 'w':
+				wal_prefix = optarg;
+				break;
+			case 'W':
+				wal_interval = atoi(optarg);
+				  assert(wal_interval <= 0, "Bad WAL interval");
+				break;
+			case 'f':
+				sync_from = optarg;
+				break;
+			case 'P':
+				peer = optarg;
+				break;
+			case 'R':
+				repair_period = atoi(optarg);
+				  assert(repair_period <= 0, "Bad repair period");
+				break;
+			case 'r':
+				ring_list = optarg;
+				break;
+			case 'N':
+				replicas = atoi(optarg);
+				  assert(replicas <= 0, "Bad replica count");
+				break;
+			case 'j':
+				join = optarg;
+				break;
+			case 'i':
+				probe_period = atoi(optarg);
+				  assert(probe_period <= 0, "Bad probe period");
+				break;
+			case 'm':
+				multicast = optarg;
+				break;
+			case 'M':
+				multicast_if = optarg;
+				break;
+			case 'a':
+				announce_period = atoi(optarg);
+				  assert(announce_period <= 0, "Bad announce period");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
 	// check the number of args on command line
-	if(argc != 3){
-		err("Usage: %s IP PORT\n", argv[0]);
-		exit(EXIT_FAILURE);
+	if(argc - optind != 2){
+		usage(argv[0]);
 	}
 
-	char* host = argv[1];
-	char* port = argv[2];
+	char* host = argv[optind];
+	char* port = argv[optind+1];
 
 	// Port valide ?
 	tmp = atoi(port);
@@ -690,78 +922,173 @@ int main(int argc, char **argv) {
 	 * 
 	 * Avant de faire du malloc en masse on essaye de limiter les dégats
 	 * si l'utilisateur tue le serveur
+	 *
+	 * SIGINT et SIGTERM sont bloqués ici, donc dans tous les threads créés
+	 * ensuite: c'est le thread principal qui les attend avec sigwait et
+	 * appelle handle_signal.
 	 */
-	struct sigaction sa;
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = &handle_signal;
-	tmp = sigaction(SIGINT, &sa, NULL);
-	  assert(tmp == -1, "Can't handle SIGINT");
-	tmp = sigaction(SIGTERM, &sa, NULL);
-	  assert(tmp == -1, "Can't handle SIGTERM");
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	tmp = pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	  assert(tmp != 0, "Can't block SIGINT/SIGTERM");
 
 
 	/*
 	 * # Coeur du serveur #
-	 * - Ouverture d'une socket d'écoute sur l'ip et le port demandé
+	 * - Ouverture d'une socket d'écoute par thread sur l'ip et le port demandé
 	 * - Ecoute sur la socket
 	 * - Execution des commandes
 	 */
-	nethandle s;
 	dht my_dht;
 	dht_init(&my_dht);
+	if (huge){
+		tmp = dht_hugepages(&my_dht);
+		  assert(tmp == -1, "Can't use huge pages");
+	}
+	if (expect > 0){
+		tmp = dht_reserve(&my_dht, expect);
+		  assert(tmp == -1, "Can't reserve %ld entries", expect);
+	}
+	// Le journal est purgé à chaque instantané: il lui en faut un
+	static char wal_snapshot[PATH_MAX];
+	if (wal_prefix && _G_SNAPSHOT == NULL){
+		tmp = snprintf(wal_snapshot, sizeof(wal_snapshot), "%s.snap", 
+					   wal_prefix);
+		  assert(tmp >= (int)sizeof(wal_snapshot), "WAL prefix too long");
+		_G_SNAPSHOT = wal_snapshot;
+	}
+
+	// Redémarrage à chaud: on repart du dernier instantané
+	if (_G_SNAPSHOT && dht_load(&my_dht, _G_SNAPSHOT) == -1 && errno != ENOENT)
+		warn("Can't load snapshot %s, starting empty", _G_SNAPSHOT);
+
+	// Puis on rejoue la fin du journal, qu'un point de reprise purge aussitôt.
+	// Le journal n'est branché sur la DHT qu'ensuite: le rejeu n'est pas
+	// journalisé une seconde fois
+	static wal my_wal;
+	if (wal_prefix){
+		tmp = wal_open(&my_wal, wal_prefix, wal_interval);
+		  assert(tmp == -1, "Can't open the WAL");
+		tmp = wal_replay(&my_wal, &my_dht);
+		  assert(tmp == -1, "Can't replay the WAL");
+		tmp = wal_start(&my_wal);
+		  assert(tmp == -1, "Can't start the WAL");
+		tmp = wal_checkpoint(&my_wal, &my_dht, _G_SNAPSHOT);
+		  assert(tmp == -1, "Can't checkpoint the WAL");
+		my_dht.wal = &my_wal;
+		_G_WAL = &my_wal;
+	}
+
+	worker* workers = calloc(nb_threads, sizeof(worker));
+	  assert(workers == NULL, "calloc");
 
 	// Pour garder une trace vers mes pointeurs à libérer en cas de sigterm
 	_G_PTR_DHT = &my_dht;
-	_G_PTR_NET_DHT = &s;
+	_G_WORKERS = workers;
 
 	info("[W:Warning] [I:Info] [S:Success] [E:Error]");
 
 	// Lancement du nettoyeur de DHT
-	pthread_t t_gc; 
-	tmp = pthread_create(&t_gc, NULL, &garbage_collector, &my_dht);
-	  assert(tmp == -1, "Can't create the garbage collector");
-
-	// Ouverture de la socket
-	tmp = netopen(host, port, &s, 'r');
-	  assert(tmp == -1, "Can't open host. Bad host/port ?");
-	
-	//nethandle multi;
-	//tmp = netmulticast(&s, &multi);
-	//  	if (tmp == -1){
-	//  		err("Can't join a multicast group");
-	//  	}
+	tmp = pthread_create(&_G_GC, NULL, &garbage_collector, &my_dht);
+	  assert(tmp != 0, "Can't create the garbage collector");
+
+	// Ouverture des sockets, puis des threads
+	// Avec un seul thread, pas besoin de partager l'adresse
+	long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 0; i < nb_threads; ++i){
+		workers[i].id  = i;
+		workers[i].d   = &my_dht;
+		workers[i].cpu = (pin && nb_cpus > 0) ? i % nb_cpus : -1;
+
+		tmp = netopen(host, port, &workers[i].s, nb_threads > 1 ? 's' : 'r');
+		  assert(tmp == -1, "Can't open host. Bad host/port ?");
+		tmp = netbatch_init(&workers[i].s, &workers[i].batch, 
+							large ? BUFF_SIZE - 1 : 0);
+		  assert(tmp == -1, "Can't allocate worker %d buffers", i);
+	}
+	// L'adresse d'écoute situe ce serveur sur l'anneau
+	static ring my_ring;
+	if (ring_list != NULL){
+		tmp = ring_parse(&my_ring, ring_list, replicas);
+		  assert(tmp == -1, "Bad --ring, HOST:PORT,... expected");
+		my_ring.self = ring_find(&my_ring, workers[0].s.sin6);
+		  assert(my_ring.self == -1, "[%s]:%s is not in --ring", host, port);
+		_G_RING = &my_ring;
+		success("Node %d of a ring of %d, %d replica(s)", my_ring.self, 
+				my_ring.count, my_ring.replicas);
+	}
 
-	// Ecoute de la socket
-	nethandle sender;
-	while (true) {
-		memset(&sender, 0, sizeof(sender));
+	for (int i = 0; i < nb_threads; ++i){
+		tmp = pthread_create(&workers[i].thread, NULL, &worker_loop, &workers[i]);
+		  assert(tmp != 0, "Can't create worker %d", i);
+		_G_NB_WORKERS++;
+	}
+	success("%d worker(s) listening on [%s]:%s", nb_threads, host, port);
+
+	// Appartenance au groupe: les serveurs de l'anneau en font partie d'office,
+	// ceux du groupe multicast s'y annoncent (cf mcast.h)
+	if (join != NULL || _G_RING != NULL || multicast != NULL){
+		tmp = swim_start(&workers[0].s, join, probe_period);
+		  assert(tmp == -1, "Can't join the group");
+		for (int i = 0; _G_RING && i < _G_RING->count; ++i)
+			swim_add(&_G_RING->nodes[i]);
+	}
+	if (multicast != NULL){
+		char *group, *group_port;
+		tmp = netsplit(multicast, &group, &group_port);
+		  assert(tmp == -1, "Bad --multicast, GROUP:PORT expected");
+		tmp = mcast_start(&my_dht, &workers[0].s, group, group_port, 
+						  multicast_if, announce_period, _G_RING == NULL);
+		  assert(tmp == -1, "Can't use multicast group [%s]:%s", group, 
+				 group_port);
+	}
 
-		// Todo: multithreading
-		tmp = netlisten(&s, &sender);
-		if (tmp == -1) {
-			warn("Listen failed");
-			break;
-		}
-		
-		// Traitement & exécution de la commande
-		tmp = treat_cmd(&my_dht, s.buf, &sender);
-		// info("Recv : '%s'", s.buf);
+	// Rattrapage: un autre serveur nous envoie sa DHT (cf sync.h)
+	char* peer_host;
+	char* peer_port;
+	if (sync_from != NULL){
+		tmp = netsplit(sync_from, &peer_host, &peer_port);
+		  assert(tmp == -1, "Bad --sync-from, HOST:PORT expected");
+		tmp = sync_request(&workers[0].s, peer_host, peer_port, 
+						   workers[0].batch.slot - 1);
+		check(tmp == 0, "Sync requested from [%s]:%s", peer_host, peer_port);
+	}
 
-		if (tmp == -1){
-			warn("Failed: '%s'", s.buf);
-		}
-		else {
-			// success("Treated: '%s'", s.buf);
+	// Puis réparations périodiques: seuls les écarts sont échangés
+	if (peer != NULL){
+		tmp = netsplit(peer, &peer_host, &peer_port);
+		  assert(tmp == -1, "Bad --peer, HOST:PORT expected");
+		tmp = sync_peer(&my_dht, peer_host, peer_port, repair_period);
+		  assert(tmp == -1, "Can't start repairs with [%s]:%s", peer_host, 
+				 peer_port);
+	}
+
+	// Attente des signaux
+	// Avec --snapshot, l'attente est interrompue toutes les snap_period
+	// secondes pour sauvegarder la DHT
+	struct timespec period = { snap_period, 0 };
+	int sig;
+	while (true) {
+		if (_G_SNAPSHOT == NULL){
+			if (sigwait(&sigs, &sig) == 0)
+				handle_signal(sig);
+			continue;
 		}
 
-		netclose(&sender);
+		sig = sigtimedwait(&sigs, NULL, &period);
+		if (sig > 0)
+			handle_signal(sig);
+		else if (errno == EAGAIN && _G_WAL)
+			wal_checkpoint(_G_WAL, &my_dht, _G_SNAPSHOT);
+		else if (errno == EAGAIN)
+			dht_save(&my_dht, _G_SNAPSHOT);
 	}
 
-	pthread_join(t_gc, NULL);
+	pthread_join(_G_GC, NULL);
 
 	info("Leaving !");
 
-	netclose(&s);
-
 	return 0;
 }
@@ -0,0 +1,689 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "swim.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[ SWIM ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// "[adresse]:port"
+#define SWIM_NODE_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/**
+ * Un membre du groupe, tel que ce serveur le voit
+ */
+typedef struct s_member {
+	struct sockaddr_in6 addr;
+	uint8_t state;
+	uint32_t incarnation;
+	// SWIM_SUSPECT: début de la suspicion (ms)
+	long since;
+} member;
+
+/**
+ * Une nouvelle à diffuser: le dernier état connu d'un membre, ou de soi
+ */
+typedef struct s_update {
+	struct sockaddr_in6 addr;
+	uint8_t state;
+	uint32_t incarnation;
+	// Messages qui l'ont déjà portée
+	int sent;
+} update;
+
+// Tout l'état ci-dessous est protégé par swim_lock
+static pthread_mutex_t swim_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalée à la réception de l'ACK attendu, et par swim_stop
+static pthread_cond_t swim_cond;
+static pthread_t swim_thread;
+static int swim_running = false;
+static int swim_stopping = false;
+
+// Socket du serveur, hors de tout lot de réponses
+static nethandle swim_sock;
+static struct sockaddr_in6 swim_self;
+static uint32_t swim_incarnation;
+static int swim_period = SWIM_PERIOD;
+
+static member members[SWIM_MEMBERS_MAX];
+static int nb_members = 0;
+// Ordre des sondes (indices dans members), rebattu à chaque tour
+static int order[SWIM_MEMBERS_MAX];
+static int next_probe = 0;
+
+// Une nouvelle au plus par membre, plus une pour soi
+static update updates[SWIM_MEMBERS_MAX + 1];
+static int nb_updates = 0;
+
+// Sonde en cours, et dernière sonde acquittée
+static uint32_t probe_seq = 0;
+static uint32_t probe_acked = 0;
+
+static long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int same_node(const struct sockaddr_in6* a, 
+					 const struct sockaddr_in6* b){
+	return a->sin6_port == b->sin6_port &&
+		   memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+static const char* node_str(const struct sockaddr_in6* a, char* buf){
+	char ip[INET6_ADDRSTRLEN];
+	inet_ntop(AF_INET6, &a->sin6_addr, ip, sizeof(ip));
+	snprintf(buf, SWIM_NODE_STRLEN, "[%s]:%d", ip, ntohs(a->sin6_port));
+	return buf;
+}
+
+static void node_put(uint8_t* p, const struct sockaddr_in6* a){
+	memcpy(p, &a->sin6_addr, sizeof(a->sin6_addr));
+	memcpy(p + sizeof(a->sin6_addr), &a->sin6_port, sizeof(a->sin6_port));
+}
+
+static void node_get(const uint8_t* p, struct sockaddr_in6* a){
+	memset(a, 0, sizeof(*a));
+	a->sin6_family = AF_INET6;
+	memcpy(&a->sin6_addr, p, sizeof(a->sin6_addr));
+	memcpy(&a->sin6_port, p + sizeof(a->sin6_addr), sizeof(a->sin6_port));
+}
+
+/**
+ * @brief log2(n+1) arrondi au-dessus, pour n membres (soi compris)
+ */
+static int log_members(void){
+	int l = 1;
+	while ((1 << l) < nb_members + 2)
+		l++;
+	return l;
+}
+
+static int member_find(const struct sockaddr_in6* a){
+	for (int i = 0; i < nb_members; ++i){
+		if (same_node(&members[i].addr, a))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Ajoute un membre vivant
+ * @details Il sera sondé dans ce tour, à une place au hasard parmi celles qui
+ * restent. Table pleine: il prend la place d'un mort.
+ *
+ * @return indice dans members, ou -1
+ */
+static int member_add(const struct sockaddr_in6* a, uint32_t inc){
+	int i = nb_members;
+
+	if (nb_members == SWIM_MEMBERS_MAX){
+		for (i = 0; i < nb_members && members[i].state != SWIM_DEAD; ++i)
+			;
+		  assert_return(i == nb_members, "More than %d members",
+						SWIM_MEMBERS_MAX);
+	}
+	else {
+		int j = next_probe + rand() % (nb_members + 1 - next_probe);
+		order[nb_members] = order[j];
+		order[j] = i;
+		nb_members++;
+	}
+
+	members[i].addr = *a;
+	members[i].state = SWIM_ALIVE;
+	members[i].incarnation = inc;
+	members[i].since = 0;
+
+	return i;
+}
+
+/**
+ * @brief Met une nouvelle en file, à la place de la précédente du membre
+ */
+static void gossip(const struct sockaddr_in6* a, uint8_t state, uint32_t inc){
+	int i;
+
+	for (i = 0; i < nb_updates && !same_node(&updates[i].addr, a); ++i)
+		;
+	if (i == nb_updates){
+		if (nb_updates == SWIM_MEMBERS_MAX + 1)
+			return;
+		nb_updates++;
+	}
+
+	updates[i].addr = *a;
+	updates[i].state = state;
+	updates[i].incarnation = inc;
+	updates[i].sent = 0;
+}
+
+/**
+ * @brief Rediffuse l'état de tout le groupe
+ * @details Pour un nouveau membre, qui n'a entendu aucune des nouvelles
+ * passées.
+ */
+static void gossip_all(void){
+	gossip(&swim_self, SWIM_ALIVE, swim_incarnation);
+	for (int i = 0; i < nb_members; ++i){
+		if (members[i].state != SWIM_DEAD)
+			gossip(&members[i].addr, members[i].state, 
+				   members[i].incarnation);
+	}
+}
+
+/**
+ * @brief Applique une nouvelle sur un membre
+ * @details swim_lock pris. Règles de SWIM, i l'incarnation de la nouvelle et
+ * j celle connue:
+ * - vivant(i) l'emporte sur tout état si i > j, mort compris (redémarrage)
+ * - suspect(i) l'emporte sur vivant(j) si i >= j, sur suspect(j) si i > j
+ * - mort(i) l'emporte sur vivant(j) et suspect(j) si i >= j
+ *
+ * Une nouvelle acceptée est rediffusée. Suspecté ou déclaré mort soi-même,
+ * on se défend avec une incarnation plus grande.
+ *
+ * @return 1 si a est un nouveau membre, 0 sinon
+ */
+static int apply(const struct sockaddr_in6* a, uint8_t state, uint32_t inc){
+	char str[SWIM_NODE_STRLEN];
+	member* m;
+	int i;
+
+	if (same_node(a, &swim_self)){
+		if (state != SWIM_ALIVE && inc >= swim_incarnation){
+			swim_incarnation = inc + 1;
+			gossip(&swim_self, SWIM_ALIVE, swim_incarnation);
+			warn("Suspected, refuting (incarnation %u)", swim_incarnation);
+		}
+		return 0;
+	}
+
+	i = member_find(a);
+	if (i == -1){
+		if (state == SWIM_DEAD || (i = member_add(a, inc)) == -1)
+			return 0;
+		members[i].state = state;
+		members[i].since = now_ms();
+		gossip(a, state, inc);
+		success("%s joined", node_str(a, str));
+		return 1;
+	}
+
+	m = &members[i];
+	switch (state){
+		case SWIM_ALIVE:
+			if (inc <= m->incarnation)
+				return 0;
+			break;
+		case SWIM_SUSPECT:
+			if (m->state == SWIM_DEAD || inc < m->incarnation ||
+				(m->state == SWIM_SUSPECT && inc == m->incarnation))
+				return 0;
+			break;
+		case SWIM_DEAD:
+			if (m->state == SWIM_DEAD || inc < m->incarnation)
+				return 0;
+			break;
+		default:
+			return 0;
+	}
+
+	if (state != m->state && state == SWIM_ALIVE){
+		success("%s alive", node_str(a, str));
+	}
+	else if (state != m->state && state == SWIM_SUSPECT){
+		warn("%s suspected", node_str(a, str));
+	}
+	else if (state != m->state){
+		warn("%s dead", node_str(a, str));
+	}
+	if (state == SWIM_SUSPECT && m->state != SWIM_SUSPECT)
+		m->since = now_ms();
+	m->state = state;
+	m->incarnation = inc;
+	gossip(a, state, inc);
+
+	return 0;
+}
+
+/**
+ * @brief Encode un message, avec autant de nouvelles qu'il en tient
+ * @details swim_lock pris. Les nouvelles les moins diffusées passent en
+ * premier, à commencer par celle qui concerne le destinataire: un suspect
+ * apprend ainsi au plus tôt qu'il doit se défendre. Une nouvelle répétée
+ * SWIM_RETRANSMIT * log2(n+1) fois est oubliée.
+ *
+ * @param op OP_PING, OP_PING_REQ ou OP_PING_ACK
+ * @param seq numéro de la sonde
+ * @param to destinataire
+ * @param node membre porté par le message, NULL pour aucun
+ * @return taille du message, ou -1
+ */
+static int encode(uint8_t op, uint32_t seq, const struct sockaddr_in6* to,
+				  const struct sockaddr_in6* node, uint8_t* buf, int size){
+	uint8_t body[SWIM_HEADER + SWIM_PIGGYBACK * SWIM_UPDATE];
+	uint8_t picked[SWIM_MEMBERS_MAX + 1] = {0};
+	uint8_t* p = body + SWIM_HEADER;
+	uint32_t inc = htonl(swim_incarnation);
+	int limit = SWIM_RETRANSMIT * log_members();
+	int count = 0;
+
+	memcpy(body, &inc, sizeof(inc));
+	memset(body + sizeof(inc), 0, SWIM_NODE);
+	if (node != NULL)
+		node_put(body + sizeof(inc), node);
+
+	while (count < SWIM_PIGGYBACK){
+		int best = -1;
+		for (int i = 0; i < nb_updates; ++i){
+			if (picked[i])
+				continue;
+			if (same_node(&updates[i].addr, to)){
+				best = i;
+				break;
+			}
+			if (best == -1 || updates[i].sent < updates[best].sent)
+				best = i;
+		}
+		if (best == -1)
+			break;
+
+		picked[best] = true;
+		inc = htonl(updates[best].incarnation);
+		node_put(p, &updates[best].addr);
+		p[SWIM_NODE] = updates[best].state;
+		memcpy(p + SWIM_NODE + 1, &inc, sizeof(inc));
+		p += SWIM_UPDATE;
+		updates[best].sent++;
+		count++;
+	}
+	body[SWIM_HEADER - 1] = count;
+
+	for (int i = 0; i < nb_updates; ){
+		if (updates[i].sent >= limit)
+			updates[i] = updates[--nb_updates];
+		else
+			++i;
+	}
+
+	proto_msg m = {.op = op, .id = seq, .cur = body, .end = p};
+	return proto_encode(&m, buf, size);
+}
+
+/**
+ * @brief Envoie un message à un membre depuis la socket de via
+ */
+static int send_to(const struct sockaddr_in6* a, nethandle* via, void* buf,
+				   int len){
+	struct sockaddr_in6 dest = *a;
+	nethandle to;
+
+	if (len == -1 || sockaddr_to_nethandle(&dest, via, &to) == -1)
+		return -1;
+	return netsend_binary(&to, buf, len);
+}
+
+/**
+ * @brief Attend l'ACK de la sonde seq jusqu'à deadline (ms)
+ * @details swim_lock pris, relâché pendant l'attente
+ * @return true si la sonde est acquittée
+ */
+static int wait_ack(uint32_t seq, long deadline){
+	struct timespec ts = {deadline / 1000, (deadline % 1000) * 1000000};
+
+	while (probe_acked != seq && !swim_stopping){
+		if (pthread_cond_timedwait(&swim_cond, &swim_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	return probe_acked == seq;
+}
+
+/**
+ * @brief Attend jusqu'à deadline (ms), ou swim_stop
+ * @details swim_lock pris, relâché pendant l'attente
+ */
+static void pause_until(long deadline){
+	struct timespec ts = {deadline / 1000, (deadline % 1000) * 1000000};
+
+	while (!swim_stopping){
+		if (pthread_cond_timedwait(&swim_cond, &swim_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+}
+
+/**
+ * @brief Prochain membre à sonder, -1 s'il n'y en a aucun de vivant
+ */
+static int next_target(void){
+	for (int n = 0; n < nb_members + 1 && nb_members > 0; ++n){
+		if (next_probe >= nb_members){
+			for (int i = nb_members - 1; i > 0; --i){
+				int j = rand() % (i + 1), tmp = order[i];
+				order[i] = order[j];
+				order[j] = tmp;
+			}
+			next_probe = 0;
+		}
+		int i = order[next_probe++];
+		if (members[i].state != SWIM_DEAD)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Une période du protocole: sonde un membre
+ * @details swim_lock pris. OP_PING, puis OP_PING_REQ à SWIM_INDIRECT autres
+ * membres vivants tirés au hasard, puis suspicion.
+ */
+static void probe(long start){
+	uint8_t buf[NET_PAYLOAD];
+	int others[SWIM_MEMBERS_MAX];
+	int target = next_target();
+	int timeout = (SWIM_TIMEOUT < swim_period / 2) ? SWIM_TIMEOUT :
+					swim_period / 2;
+	int n = 0, len, i;
+	struct sockaddr_in6 dest;
+	uint32_t seq;
+
+	if (target == -1)
+		return;
+
+	dest = members[target].addr;
+	if (++probe_seq == 0)
+		++probe_seq;
+	seq = probe_seq;
+	len = encode(OP_PING, seq, &dest, NULL, buf, sizeof(buf));
+	send_to(&dest, &swim_sock, buf, len);
+	if (wait_ack(seq, start + timeout))
+		return;
+
+	for (i = 0; i < nb_members; ++i){
+		if (members[i].state == SWIM_ALIVE &&
+			!same_node(&members[i].addr, &dest))
+			others[n++] = i;
+	}
+	for (int k = 0; k < n && k < SWIM_INDIRECT; ++k){
+		int j = k + rand() % (n - k), tmp = others[k];
+		struct sockaddr_in6 via;
+		others[k] = others[j];
+		others[j] = tmp;
+		via = members[others[k]].addr;
+		len = encode(OP_PING_REQ, seq, &via, &dest, buf, sizeof(buf));
+		send_to(&via, &swim_sock, buf, len);
+	}
+	if (wait_ack(seq, start + swim_period))
+		return;
+
+	i = member_find(&dest);
+	if (i != -1 && members[i].state == SWIM_ALIVE)
+		apply(&dest, SWIM_SUSPECT, members[i].incarnation);
+}
+
+/**
+ * @brief Déclare morts les suspects que personne n'a innocentés à temps
+ * @details swim_lock pris
+ */
+static void expire(long now){
+	long timeout = (long)SWIM_SUSPICION * log_members() * swim_period;
+
+	for (int i = 0; i < nb_members; ++i){
+		if (members[i].state == SWIM_SUSPECT &&
+			now - members[i].since >= timeout)
+			apply(&members[i].addr, SWIM_DEAD, members[i].incarnation);
+	}
+}
+
+static void* swim_loop(void* param){
+	(void)param;
+
+	pthread_mutex_lock(&swim_lock);
+	while (!swim_stopping){
+		long start = now_ms();
+		probe(start);
+		expire(now_ms());
+		pause_until(start + swim_period);
+	}
+	pthread_mutex_unlock(&swim_lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Rejoint le groupe et lance les sondes
+ * @details Les sondes partent de la socket s du serveur: son adresse est
+ * celle de ce membre. Les graines sont sondées comme les autres membres, et
+ * apprennent ainsi notre existence; il suffit qu'une seule réponde.
+ *
+ * @param s socket d'écoute du serveur (doit survivre à swim_stop)
+ * @param seeds "HOST:PORT,HOST:PORT,..." (modifiée), ou NULL
+ * @param period millisecondes entre deux sondes
+ * @return 0 ou -1
+ */
+int swim_start(nethandle* s, char* seeds, int period){
+	char *save = NULL, *item, *host, *port;
+	pthread_condattr_t attr;
+	nethandle h;
+	int tmp;
+
+	  assert_return(swim_running, "Membership already started");
+
+	swim_sock = *s;
+	swim_sock.batch = NULL;
+	swim_self = *s->sin6;
+	swim_period = period;
+	swim_incarnation = time(NULL);
+	srand(swim_incarnation ^ getpid());
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&swim_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (item = (seeds != NULL) ? strtok_r(seeds, ",", &save) : NULL;
+		 item != NULL; item = strtok_r(NULL, ",", &save)){
+		  assert_return(netsplit(item, &host, &port) == -1,
+						"Bad seed '%s', HOST:PORT expected", item);
+		  assert_return(netopen(host, port, &h, 'w') == -1,
+						"Can't resolve [%s]:%s", host, port);
+		swim_add(h.sin6);
+		netclose(&h);
+	}
+
+	pthread_mutex_lock(&swim_lock);
+	gossip(&swim_self, SWIM_ALIVE, swim_incarnation);
+	pthread_mutex_unlock(&swim_lock);
+
+	tmp = pthread_create(&swim_thread, NULL, &swim_loop, NULL);
+	  assert_return(tmp != 0, "Can't start the membership thread");
+	__atomic_store_n(&swim_running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief Ajoute un membre à sonder (graine, serveur de l'anneau...)
+ * @details Sans effet sur un membre déjà connu, ou sur soi-même. Son
+ * incarnation est inconnue (0): la première qu'il enverra l'emportera.
+ * @return 0 ou -1
+ */
+int swim_add(const struct sockaddr_in6* a){
+	int tmp = 0;
+
+	pthread_mutex_lock(&swim_lock);
+	if (!same_node(a, &swim_self) && member_find(a) == -1)
+		tmp = (member_add(a, 0) == -1) ? -1 : 0;
+	pthread_mutex_unlock(&swim_lock);
+
+	return tmp;
+}
+
+/**
+ * @brief Traite un OP_PING, OP_PING_REQ ou OP_PING_ACK
+ * @details Appelé par les workers. L'expéditeur est vivant, et les nouvelles
+ * du message sont appliquées (cf apply). Puis:
+ * - OP_PING: OP_PING_ACK à l'expéditeur, qui porte le membre pour qui il
+ *   sondait s'il y en a un
+ * - OP_PING_REQ: OP_PING au membre porté, pour le compte de l'expéditeur
+ * - OP_PING_ACK pour le compte d'un autre: relayé à cet autre. Sinon, s'il
+ *   acquitte la sonde en cours, le thread de sonde est réveillé.
+ *
+ * Un expéditeur inconnu rejoint le groupe: tout l'état du groupe est
+ * rediffusé pour lui.
+ *
+ * @param m message décodé
+ * @param sender expéditeur (un serveur, cf swim.h)
+ * @return 0 ou -1
+ */
+int swim_recv(proto_msg* m, nethandle* sender){
+	uint8_t out[NET_PAYLOAD];
+	uint8_t* p = m->cur;
+	struct sockaddr_in6 node, dest, a;
+	uint32_t inc;
+	int count, len = 0;
+
+	  assert_return(!__atomic_load_n(&swim_running, __ATOMIC_ACQUIRE),
+					"Membership is off (cf --join)");
+	  assert_return(m->end - p < SWIM_HEADER, "Truncated SWIM message");
+	count = p[SWIM_HEADER - 1];
+	  assert_return(m->end - p < SWIM_HEADER + count * SWIM_UPDATE,
+					"Truncated SWIM message");
+	memcpy(&inc, p, sizeof(inc));
+	node_get(p + sizeof(inc), &node);
+	p += SWIM_HEADER;
+
+	pthread_mutex_lock(&swim_lock);
+	if (apply(sender->sin6, SWIM_ALIVE, ntohl(inc)))
+		gossip_all();
+	for (int i = 0; i < count; ++i, p += SWIM_UPDATE){
+		node_get(p, &a);
+		memcpy(&inc, p + SWIM_NODE + 1, sizeof(inc));
+		apply(&a, p[SWIM_NODE], ntohl(inc));
+	}
+
+	switch (m->op){
+		case OP_PING:
+			dest = *sender->sin6;
+			len = encode(OP_PING_ACK, m->id, &dest,
+						 (node.sin6_port != 0) ? &node : NULL,
+						 out, sizeof(out));
+			break;
+		case OP_PING_REQ:
+			dest = node;
+			len = encode(OP_PING, m->id, &dest, sender->sin6,
+						 out, sizeof(out));
+			break;
+		case OP_PING_ACK:
+			if (node.sin6_port != 0){
+				dest = node;
+				len = encode(OP_PING_ACK, m->id, &dest, NULL, out,
+							 sizeof(out));
+			}
+			else if (m->id == probe_seq){
+				probe_acked = m->id;
+				pthread_cond_broadcast(&swim_cond);
+			}
+			break;
+	}
+	pthread_mutex_unlock(&swim_lock);
+
+	if (len != 0 && send_to(&dest, sender, out, len) == -1)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief i_exist: l'expéditeur annonce qu'il est là
+ * @details Il rejoint le groupe (s'il n'en fait pas déjà partie), et sera
+ * sondé comme les autres.
+ * @return 0 ou -1
+ */
+int swim_hello(nethandle* sender){
+	  assert_return(!__atomic_load_n(&swim_running, __ATOMIC_ACQUIRE),
+					"Membership is off (cf --join)");
+
+	pthread_mutex_lock(&swim_lock);
+	if (apply(sender->sin6, SWIM_ALIVE, 0))
+		gossip_all();
+	pthread_mutex_unlock(&swim_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Indique si un serveur n'est pas connu pour mort
+ * @details Un inconnu, ou n'importe qui sans --join, est présumé vivant.
+ */
+int swim_alive(const struct sockaddr_in6* a){
+	int i, alive = true;
+
+	if (!__atomic_load_n(&swim_running, __ATOMIC_ACQUIRE))
+		return true;
+
+	pthread_mutex_lock(&swim_lock);
+	i = member_find(a);
+	if (i != -1)
+		alive = (members[i].state != SWIM_DEAD);
+	pthread_mutex_unlock(&swim_lock);
+
+	return alive;
+}
+
+/**
+ * @brief Compte les membres par état (cf stats)
+ * @return 0, ou -1 sans --join
+ */
+int swim_count(int* alive, int* suspect, int* dead){
+	if (!__atomic_load_n(&swim_running, __ATOMIC_ACQUIRE))
+		return -1;
+
+	*alive = *suspect = *dead = 0;
+	pthread_mutex_lock(&swim_lock);
+	for (int i = 0; i < nb_members; ++i){
+		if (members[i].state == SWIM_ALIVE)
+			(*alive)++;
+		else if (members[i].state == SWIM_SUSPECT)
+			(*suspect)++;
+		else
+			(*dead)++;
+	}
+	pthread_mutex_unlock(&swim_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Arrête les sondes
+ * @details A appeler avant de fermer la socket du serveur.
+ */
+void swim_stop(void){
+	if (!__atomic_load_n(&swim_running, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&swim_lock);
+	swim_stopping = true;
+	pthread_cond_broadcast(&swim_cond);
+	pthread_mutex_unlock(&swim_lock);
+
+	pthread_join(swim_thread, NULL);
+	__atomic_store_n(&swim_running, false, __ATOMIC_RELEASE);
+}
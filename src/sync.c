@@ -0,0 +1,846 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "sync.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[ SYNC ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// Plus petit lot accepté dans un OP_SYNC
+#define SYNC_MIN_PAYLOAD 256
+
+// sent[i] d'un lot acquitté
+#define SYNC_ACKED -1
+
+// Bit b d'un tableau d'octets (cf OP_PULL)
+#define BIT_GET(a, b) ((a)[(b) / 8] & (1 << ((b) % 8)))
+#define BIT_SET(a, b) ((a)[(b) / 8] |= (1 << ((b) % 8)))
+
+// Seaux d'une partition (cf dht_digest)
+#define SHARD_BUCKETS (DHT_DIGEST_BUCKETS >> DHT_SHARD_BITS)
+
+// Noeuds du plus large niveau demandé: celui juste au-dessus des seaux
+#define SYNC_WIDEST (DHT_DIGEST_BUCKETS / DHT_DIGEST_FANOUT)
+
+/**
+ * Une synchronisation servie par sync_serve
+ */
+typedef struct s_sync_job {
+	dht* d;
+	// Socket à part, vers le pair (cf netpeer)
+	nethandle s;
+	uint32_t id;
+	// Taille max d'un lot
+	int payload;
+	// Lots en vol au plus (cf SYNC_WINDOW)
+	unsigned int window;
+	// OP_PULL: seuls les tuples des seaux marqués sont envoyés
+	int filter;
+	uint8_t buckets[DHT_DIGEST_BUCKETS / 8];
+
+	// Lots de la partition en cours: le i-ème dans bufs + i*payload, numéro
+	// first + i
+	uint8_t* bufs;
+	int* lens;
+	// Date du dernier envoi en ms, 0 = jamais envoyé, ou SYNC_ACKED
+	long* sent;
+	int* tries;
+	unsigned int count;
+	unsigned int cap;
+	uint32_t first;
+	// Lot acquitté le plus loin dans la partition, +1 (0 = aucun)
+	unsigned int acked;
+	// Lot en cours de remplissage (le dernier)
+	proto_page pg;
+
+	// Bilan
+	long entries;
+	long resent;
+} sync_job;
+
+// Synchronisations en cours, attendues par sync_stop
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_done = PTHREAD_COND_INITIALIZER;
+static int jobs_running = 0;
+static int jobs_stop = false;
+
+/**
+ * @brief Compte un thread de synchronisation de plus (cf sync_stop)
+ * @param limit nombre max de threads déjà en cours, 0 pour aucune limite
+ * @return 0, ou -1 si sync_stop a été appelé ou la limite atteinte
+ */
+static int job_enter(int limit){
+	int ret = 0;
+
+	pthread_mutex_lock(&jobs_lock);
+	if (jobs_stop || (limit > 0 && jobs_running >= limit))
+		ret = -1;
+	else
+		jobs_running++;
+	pthread_mutex_unlock(&jobs_lock);
+
+	return ret;
+}
+
+static void job_leave(void){
+	pthread_mutex_lock(&jobs_lock);
+	jobs_running--;
+	pthread_cond_broadcast(&jobs_done);
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+static long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int stopped(void){
+	return __atomic_load_n(&jobs_stop, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Commence un nouveau lot dans la partition en cours
+ * @details Le lot précédent doit être terminé (cf proto_page_end): le
+ * tampon des lots peut être déplacé.
+ */
+static int batch_new(sync_job* j){
+	if (j->count == j->cap){
+		unsigned int cap = j->cap ? j->cap * 2 : j->window;
+		uint8_t* bufs = realloc(j->bufs, (size_t)cap * j->payload);
+		  assert_return(bufs == NULL, "realloc");
+		j->bufs = bufs;
+		int* lens = realloc(j->lens, cap * sizeof(*lens));
+		  assert_return(lens == NULL, "realloc");
+		j->lens = lens;
+		long* sent = realloc(j->sent, cap * sizeof(*sent));
+		  assert_return(sent == NULL, "realloc");
+		j->sent = sent;
+		int* tries = realloc(j->tries, cap * sizeof(*tries));
+		  assert_return(tries == NULL, "realloc");
+		j->tries = tries;
+		j->cap = cap;
+	}
+
+	proto_batch_init(&j->pg, j->bufs + (size_t)j->count * j->payload,
+					 j->payload, j->id);
+	j->lens[j->count] = 0;
+	j->sent[j->count] = 0;
+	j->tries[j->count] = 0;
+	j->count++;
+
+	return 0;
+}
+
+/**
+ * @brief Termine le lot en cours
+ */
+static void batch_end(sync_job* j){
+	if (j->count > 0 && j->lens[j->count - 1] == 0)
+		j->lens[j->count - 1] = proto_page_end(&j->pg,
+											   j->first + j->count - 1);
+}
+
+/**
+ * @brief Ajoute une entrée au lot en cours, au format attendu par
+ * dht_foreach_shard (verrou de la partition pris)
+ */
+static int sync_entry(hash* e, void* arg){
+	sync_job* j = arg;
+	proto_msg m;
+
+	if (j->filter && !BIT_GET(j->buckets, dht_bucket(e)))
+		return 0;
+
+	proto_fromhash(e, &m);
+	if (j->count > 0 &&
+		proto_batch_add(&j->pg, &m.key, &m.addr, m.time) == 0){
+		j->entries++;
+		return 0;
+	}
+
+	// Lot plein: on passe au suivant
+	batch_end(j);
+	  assert_return(batch_new(j) == -1, "Can't allocate a batch");
+	if (proto_batch_add(&j->pg, &m.key, &m.addr, m.time) == -1){
+		warn("  Tuple too long for a batch, skipped");
+		return 0;
+	}
+	j->entries++;
+
+	return 0;
+}
+
+/**
+ * @brief Indique si au moins un seau de la partition n est demandé
+ */
+static int shard_wanted(const uint8_t* buckets, int n){
+	for (int b = n * SHARD_BUCKETS; b < (n + 1) * SHARD_BUCKETS; ++b){
+		if (BIT_GET(buckets, b))
+			return true;
+	}
+	return false;
+}
+
+static int batch_send(sync_job* j, unsigned int i){
+	j->sent[i] = now_ms();
+	j->tries[i]++;
+	return netsend_binary(&j->s, j->bufs + (size_t)i * j->payload, 
+						  j->lens[i]);
+}
+
+/**
+ * @brief Marque les lots from à to (inclus) comme acquittés
+ */
+static void batch_ack(sync_job* j, uint32_t from, uint32_t to){
+	uint32_t seq, i;
+
+	// Un intervalle plus grand que la partition n'est pas pour elle
+	if (to - from >= j->count)
+		return;
+
+	for (seq = from; ; ++seq){
+		i = seq - j->first;
+		if (i < j->count){
+			j->sent[i] = SYNC_ACKED;
+			if (i >= j->acked)
+				j->acked = i + 1;
+		}
+		if (seq == to)
+			break;
+	}
+}
+
+/**
+ * @brief Envoie les lots de la partition en cours
+ * @details Au plus j->window lots en vol: un nouveau lot part quand le
+ * plus ancien est acquitté. Un lot non acquitté au bout de SYNC_RTO ms est
+ * renvoyé, au plus SYNC_RETRIES fois.
+ *
+ * Les lots arrivent dans l'ordre: un lot envoyé une seule fois et pas
+ * acquitté alors qu'un lot suivant l'est a sûrement été perdu. Il est
+ * renvoyé de suite, sans attendre SYNC_RTO (une seule fois: s'il est encore
+ * perdu, on retombe sur le délai).
+ *
+ * @return 0, ou -1 si le pair ne répond plus
+ */
+static int sync_shard(sync_job* j){
+	unsigned int base = 0, next = 0, i;
+	nethandle from;
+	long late;
+	proto_msg m;
+	long now;
+
+	j->acked = 0;
+	while (base < j->count){
+		if (stopped())
+			return -1;
+
+		while (next < j->count && next < base + j->window){
+			if (batch_send(j, next) == -1)
+				warn("  Batch %u not sent", j->first + next);
+			next++;
+		}
+
+		// Attend un ACK (au plus SYNC_RTO ms, cf nettimeout)
+		if (netlisten(&j->s, &from) > 0 &&
+			proto_is_binary(j->s.buf, j->s.length) &&
+			proto_decode(j->s.buf, j->s.length, &m) == 0 &&
+			m.op == OP_ACK && m.id == j->id)
+			batch_ack(j, m.from, m.to);
+
+		while (base < next && j->sent[base] == SYNC_ACKED)
+			base++;
+
+		now = now_ms();
+		for (i = base; i < next; ++i){
+			late = (i < j->acked && j->tries[i] == 1) ? 0 : SYNC_RTO;
+			if (j->sent[i] == SYNC_ACKED || now - j->sent[i] < late)
+				continue;
+			  assert_return(j->tries[i] > SYNC_RETRIES,
+							"  Batch %u never acknowledged", j->first + i);
+			batch_send(j, i);
+			j->resent++;
+		}
+	}
+
+	return 0;
+}
+
+static void job_free(sync_job* j){
+	free(j->bufs);
+	free(j->lens);
+	free(j->sent);
+	free(j->tries);
+	netclose(&j->s);
+	free(j);
+	job_leave();
+}
+
+/**
+ * @brief Thread d'une synchronisation (cf sync_serve)
+ * @details Chaque partition est encodée en lots verrou en lecture pris (cf
+ * dht_foreach_shard), puis envoyée verrou relâché.
+ *
+ * @param param sync_job*, libéré en sortie
+ * @return NULL
+ */
+static void* sync_loop(void* param){
+	sync_job* j = param;
+	long start = now_ms();
+	int ret = 0;
+
+	for (int n = 0; n < DHT_SHARDS && ret == 0; ++n){
+		if (j->filter && !shard_wanted(j->buckets, n))
+			continue;
+		j->count = 0;
+		ret = dht_foreach_shard(j->d, n, &sync_entry, j);
+		if (ret == 0 && j->count > 0){
+			batch_end(j);
+			ret = sync_shard(j);
+			j->first += j->count;
+		}
+	}
+
+	if (ret == 0){
+		uint8_t buf[PROTO_HEADER];
+		proto_msg end = {.op = OP_END, .id = j->id};
+		netsend_binary(&j->s, buf, proto_encode(&end, buf, sizeof(buf)));
+		success("Synced %ld entries with %s: %u batches (%ld resent) "
+				"in %ld ms", j->entries, j->s.addr, j->first, j->resent,
+				now_ms() - start);
+	}
+	else {
+		warn("Sync with %s aborted after %ld entries", j->s.addr, 
+			 j->entries);
+	}
+
+	job_free(j);
+	return NULL;
+}
+
+/**
+ * @brief Demande sa DHT à un autre serveur
+ * @details Le OP_SYNC part de s: les lots arriveront donc sur les sockets
+ * d'écoute du serveur, et seront traités par ses workers (cf sync_recv).
+ *
+ * @param s socket d'écoute du serveur
+ * @param host serveur distant
+ * @param port port du serveur distant
+ * @param payload plus gros datagramme que s accepte (cf netbatch_init)
+ * @return 0 ou -1
+ */
+int sync_request(nethandle* s, char* host, char* port, int payload){
+	nethandle peer, to;
+	uint8_t buf[PROTO_HEADER + PROTO_VARINT_MAX];
+	proto_msg m = {
+		.op = OP_SYNC,
+		.id = (uint32_t)time(NULL) ^ (uint32_t)getpid(),
+		.from = payload
+	};
+	int tmp;
+
+	tmp = netopen(host, port, &peer, 'w');
+	  assert_return(tmp == -1, "Can't resolve [%s]:%s", host, port);
+
+	// Même socket que le serveur, mais hors de son lot de réponses
+	tmp = sockaddr_to_nethandle(peer.sin6, s, &to);
+	to.batch = NULL;
+	if (tmp == 0){
+		tmp = proto_encode(&m, buf, sizeof(buf));
+		if (tmp != -1)
+			tmp = netsend_binary(&to, buf, tmp);
+	}
+	netclose(&peer);
+	  assert_return(tmp == -1, "Can't ask [%s]:%s for a sync", host, port);
+
+	info("Asked [%s]:%s for a sync (id %u)", host, port, m.id);
+	return 0;
+}
+
+/**
+ * @brief Répond à un OP_SYNC ou un OP_PULL
+ * @details La synchronisation tourne dans son propre thread, avec sa propre
+ * socket (cf netpeer): le worker qui a reçu la demande retourne de suite à
+ * ses datagrammes.
+ *
+ * @param d DHT à envoyer
+ * @param peer demandeur
+ * @param req OP_SYNC, ou OP_PULL pour n'envoyer que certains seaux
+ * @return 0, ou -1 si la synchronisation n'a pas pu commencer
+ */
+int sync_serve(dht* d, nethandle* peer, proto_msg* req){
+	pthread_attr_t attr;
+	pthread_t thread;
+	sync_job* j;
+	int mtu, tmp;
+
+	  assert_return(job_enter(SYNC_JOBS) == -1, 
+					"Too many syncs in progress, request %u refused", req->id);
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL || netpeer(peer, &j->s) == -1){
+		free(j);
+		job_leave();
+		warn("Can't start sync %u", req->id);
+		return -1;
+	}
+	j->d = d;
+	j->id = req->id;
+	// OP_PULL: seulement les seaux demandés
+	if (req->op == OP_PULL){
+		j->filter = true;
+		memcpy(j->buckets, req->buckets, sizeof(j->buckets));
+	}
+
+	// Le plus gros lot qui tient à la fois dans un paquet et chez le pair
+	mtu = netmtu(&j->s);
+	j->payload = (req->from != 0 && (int)req->from < mtu) ? (int)req->from :
+				 mtu;
+	if (j->payload < SYNC_MIN_PAYLOAD)
+		j->payload = SYNC_MIN_PAYLOAD;
+	j->window = SYNC_WINDOW / j->payload;
+	if (j->window == 0)
+		j->window = 1;
+
+	tmp = nettimeout(&j->s, SYNC_RTO);
+	if (tmp == 0){
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		tmp = pthread_create(&thread, &attr, &sync_loop, j);
+		pthread_attr_destroy(&attr);
+	}
+	if (tmp != 0){
+		job_free(j);
+		warn("Can't start sync %u", req->id);
+		return -1;
+	}
+
+	info("Sync %u with %s: batches of %d bytes, %u in flight", j->id, 
+		 j->s.addr, j->payload, j->window);
+	return 0;
+}
+
+/**
+ * @brief Insère les tuples d'un lot reçu (OP_BATCH, OP_ANNOUNCE)
+ * @details Par paquets de DHT_TUPLE_MAX (cf dht_updatev). Les tuples déjà
+ * expirés sont ignorés (cf dht_load).
+ *
+ * @param d DHT
+ * @param m lot décodé (cf proto_decode)
+ * @return 0 ou -1
+ */
+int sync_insert(dht* d, proto_msg* m){
+	dht_tuple v[DHT_TUPLE_MAX];
+	uint32_t seq = m->from;
+	long now = time(NULL);
+	int n = 0, tmp;
+
+	while ((tmp = proto_batch_next(m, &v[n].key, &v[n].addr,
+								   &v[n].time)) == 1){
+		// Déjà expiré chez nous: le garbage collector le retirerait aussitôt
+		if (v[n].time + GARBAGE_COL_TIME < now)
+			continue;
+		if (++n < DHT_TUPLE_MAX)
+			continue;
+		  assert_return(dht_updatev(d, v, n) == -1, "Batch %u lost", seq);
+		n = 0;
+	}
+	  assert_return(tmp == -1, "Bad batch %u", seq);
+	  assert_return(n > 0 && dht_updatev(d, v, n) == -1, "Batch %u lost", seq);
+
+	return 0;
+}
+
+/**
+ * @brief Insère un OP_BATCH reçu et l'acquitte
+ * @details Le lot est inséré par sync_insert.
+ * Si l'ACK du lot précédent est encore en attente d'envoi (cf netqueue_last)
+ * et qu'il se termine juste avant celui-ci, il est élargi sur place: un seul
+ * ACK pour tous les lots reçus d'un coup par le worker.
+ * Un lot invalide ou mal inséré n'est pas acquitté: l'émetteur le renverra.
+ *
+ * @param d DHT
+ * @param m OP_BATCH décodé (cf proto_decode)
+ * @param sender émetteur
+ * @return 0 ou -1
+ */
+int sync_recv(dht* d, proto_msg* m, nethandle* sender){
+	uint32_t seq = m->from;
+	int tmp;
+
+	if (sync_insert(d, m) == -1)
+		return -1;
+
+	if (sender->batch != NULL){
+		int len;
+		uint8_t* last = netqueue_last(sender->batch, sender->sin6, &len);
+		uint32_t id, to;
+
+		if (last != NULL && len == PROTO_ACK && last[1] == OP_ACK){
+			memcpy(&id, last + 4, sizeof(id));
+			memcpy(&to, last + PROTO_ACK - sizeof(to), sizeof(to));
+			if (ntohl(id) == m->id && ntohl(to) + 1 == seq){
+				to = htonl(seq);
+				memcpy(last + PROTO_ACK - sizeof(to), &to, sizeof(to));
+				return 0;
+			}
+		}
+	}
+
+	uint8_t buf[PROTO_ACK];
+	proto_msg ack = {.op = OP_ACK, .id = m->id, .from = seq, .to = seq};
+	tmp = proto_encode(&ack, buf, sizeof(buf));
+	if (tmp != -1)
+		tmp = netsend_binary(sender, buf, tmp);
+	  assert_return(tmp == -1, "Can't acknowledge batch %u", seq);
+
+	return 0;
+}
+
+/**
+ * @brief Condensés des fils d'un noeud de l'arbre de Merkle
+ * @details Le noeud (level, index) couvre DHT_DIGEST_BUCKETS / 16^level
+ * seaux consécutifs; son condensé est le XOR de leurs condensés. Les fils
+ * sont recalculés à chaque fois depuis les feuilles: au pire 4096 XOR.
+ *
+ * @param leaves condensés des seaux (cf dht_digest)
+ * @param level profondeur du noeud, 0 = racine
+ * @param index position du noeud dans son niveau
+ * @param out DHT_DIGEST_FANOUT condensés
+ */
+static void node_children(const uint64_t* leaves, int level, uint32_t index,
+						  uint64_t* out){
+	uint32_t span = DHT_DIGEST_BUCKETS;
+
+	for (int l = 0; l <= level; ++l)
+		span /= DHT_DIGEST_FANOUT;
+
+	const uint64_t* p = leaves + index * span * DHT_DIGEST_FANOUT;
+	for (int c = 0; c < DHT_DIGEST_FANOUT; ++c){
+		out[c] = 0;
+		for (uint32_t b = 0; b < span; ++b)
+			out[c] ^= *p++;
+	}
+}
+
+/**
+ * @brief Répond à un OP_DIGEST par les condensés des fils du noeud demandé
+ *
+ * @param d DHT
+ * @param m OP_DIGEST reçu
+ * @param sender demandeur
+ * @return 0 ou -1
+ */
+int sync_digest(dht* d, proto_msg* m, nethandle* sender){
+	uint64_t leaves[DHT_DIGEST_BUCKETS];
+	uint8_t buf[PROTO_HEADER + PROTO_VARINT_MAX + sizeof(m->digests)];
+	int level = SYNC_NODE_LEVEL(m->from);
+	uint32_t index = SYNC_NODE_INDEX(m->from);
+	uint32_t width = 1;
+	int tmp;
+
+	for (int l = 0; l < level; ++l)
+		width *= DHT_DIGEST_FANOUT;
+	  assert_return(level >= DHT_DIGEST_LEVELS || index >= width, 
+					"Bad digest node %u", m->from);
+
+	dht_digest(d, leaves);
+	m->op = OP_DIGESTS;
+	node_children(leaves, level, index, m->digests);
+
+	tmp = proto_encode(m, buf, sizeof(buf));
+	if (tmp != -1)
+		tmp = netsend_binary(sender, buf, tmp);
+	  assert_return(tmp == -1, "Can't send digests");
+
+	return 0;
+}
+
+/**
+ * @brief Descend l'arbre de Merkle du pair là où il diffère du nôtre
+ * @details Un niveau à la fois: tous les OP_DIGEST du niveau partent d'un
+ * coup, ceux restés sans réponse au bout de SYNC_RTO ms sont renvoyés. Les
+ * fils dont le condensé diffère sont demandés au niveau suivant; au dernier
+ * niveau, ce sont des seaux, marqués dans wanted.
+ *
+ * @return nombre de seaux différents, -1 si le pair ne répond pas
+ */
+static int repair_walk(nethandle* s, uint32_t id, const uint64_t* leaves,
+					   uint8_t* wanted, int* asked){
+	uint32_t todo[SYNC_WIDEST], next[SYNC_WIDEST];
+	uint8_t done[SYNC_WIDEST];
+	uint8_t buf[PROTO_HEADER + PROTO_VARINT_MAX];
+	uint64_t mine[DHT_DIGEST_FANOUT];
+	int ntodo = 1, nnext, left, tries, buckets = 0;
+	nethandle from;
+	proto_msg m;
+
+	todo[0] = 0;
+	for (int level = 0; level < DHT_DIGEST_LEVELS && ntodo > 0; ++level){
+		memset(done, 0, ntodo);
+		left = ntodo;
+		nnext = 0;
+
+		for (tries = 0; left > 0; ++tries){
+			  assert_return(tries > SYNC_RETRIES || stopped(), 
+							"No digests from %s", s->addr);
+
+			for (int k = 0; k < ntodo; ++k){
+				if (done[k])
+					continue;
+				proto_msg req = {.op = OP_DIGEST, .id = id,
+								 .from = SYNC_NODE(level, todo[k])};
+				netsend_binary(s, buf, proto_encode(&req, buf, sizeof(buf)));
+				(*asked)++;
+			}
+
+			// Réponses jusqu'au premier silence de SYNC_RTO ms
+			while (left > 0 && netlisten(s, &from) > 0){
+				if (!proto_is_binary(s->buf, s->length) ||
+					proto_decode(s->buf, s->length, &m) == -1 ||
+					m.op != OP_DIGESTS || m.id != id ||
+					SYNC_NODE_LEVEL(m.from) != (uint32_t)level)
+					continue;
+
+				// todo est trié: recherche dichotomique du noeud
+				uint32_t index = SYNC_NODE_INDEX(m.from);
+				int lo = 0, hi = ntodo - 1, k = -1;
+				while (lo <= hi){
+					int mid = (lo + hi) / 2;
+					if (todo[mid] == index){
+						k = mid;
+						break;
+					}
+					if (todo[mid] < index)
+						lo = mid + 1;
+					else
+						hi = mid - 1;
+				}
+				if (k == -1 || done[k])
+					continue;
+				done[k] = true;
+				left--;
+
+				node_children(leaves, level, index, mine);
+				for (int c = 0; c < DHT_DIGEST_FANOUT; ++c){
+					if (mine[c] == m.digests[c])
+						continue;
+					if (level + 1 < DHT_DIGEST_LEVELS){
+						next[nnext++] = index * DHT_DIGEST_FANOUT + c;
+					}
+					else {
+						BIT_SET(wanted, index * DHT_DIGEST_FANOUT + c);
+						buckets++;
+					}
+				}
+			}
+		}
+
+		// Les réponses arrivent dans le désordre: next n'est pas trié
+		for (int a = 1; a < nnext; ++a){
+			uint32_t v = next[a];
+			int b = a - 1;
+			while (b >= 0 && next[b] > v){
+				next[b + 1] = next[b];
+				b--;
+			}
+			next[b + 1] = v;
+		}
+		memcpy(todo, next, nnext * sizeof(*next));
+		ntodo = nnext;
+	}
+
+	return buckets;
+}
+
+/**
+ * @brief Récupère auprès du pair les tuples des seaux marqués
+ * @details Le pair répond comme à un OP_SYNC (cf sync_serve), vers s: les
+ * lots sont insérés et acquittés ici même (cf sync_recv). Le OP_PULL est
+ * renvoyé tant qu'aucun lot n'est arrivé.
+ *
+ * @return nombre de tuples reçus, -1 si le pair ne répond plus
+ */
+static long repair_pull(dht* d, nethandle* s, uint32_t id, uint8_t* wanted){
+	uint8_t buf[PROTO_HEADER + PROTO_VARINT_MAX + DHT_DIGEST_BUCKETS / 8];
+	proto_msg req = {.op = OP_PULL, .id = id, .from = s->bufsize - 1,
+					 .buckets = wanted};
+	int idle = 0, started = false;
+	long tuples = 0;
+	nethandle from;
+	proto_msg m;
+
+	while (true){
+		if (!started){
+			int len = proto_encode(&req, buf, sizeof(buf));
+			  assert_return(netsend_binary(s, buf, len) == -1, "OP_PULL");
+		}
+
+		if (netlisten(s, &from) <= 0){
+			  assert_return(++idle > SYNC_RETRIES || stopped(), 
+							"Pull from %s interrupted", s->addr);
+			continue;
+		}
+		if (!proto_is_binary(s->buf, s->length) ||
+			proto_decode(s->buf, s->length, &m) == -1 || m.id != id)
+			continue;
+
+		idle = 0;
+		if (m.op == OP_END)
+			return tuples;
+		if (m.op != OP_BATCH)
+			continue;
+
+		started = true;
+		tuples += m.count;
+		sync_recv(d, &m, &from);
+	}
+}
+
+/**
+ * @brief Anti-entropie avec un pair
+ * @details Les deux serveurs comparent leurs arbres de Merkle (cf dht.h, le
+ * condensé) de la racine vers les feuilles, en ne descendant que dans les
+ * sous-arbres qui diffèrent. Puis les tuples des seaux différents sont
+ * échangés dans les deux sens: on demande ceux du pair (OP_PULL), et on lui
+ * envoie les nôtres comme s'il nous les avait demandés (cf sync_serve). Le
+ * trafic dépend donc de l'écart entre les deux DHT, pas de leur taille.
+ *
+ * @param d DHT
+ * @param host pair
+ * @param port port du pair
+ * @return nombre de tuples reçus, -1 si le pair ne répond pas
+ */
+long sync_repair(dht* d, char* host, char* port){
+	uint64_t leaves[DHT_DIGEST_BUCKETS];
+	uint8_t wanted[DHT_DIGEST_BUCKETS / 8];
+	uint32_t id = (uint32_t)now_ms() ^ ((uint32_t)getpid() << 16);
+	long start = now_ms(), tuples = 0;
+	int asked = 0, buckets;
+	nethandle s;
+
+	  assert_return(netopen(host, port, &s, 'w') == -1, 
+					"Can't resolve [%s]:%s", host, port);
+	// Les lots du pair sont limités par son MTU, pas par notre tampon
+	s.bufsize = BUFF_SIZE;
+	if (nettimeout(&s, SYNC_RTO) == -1){
+		netclose(&s);
+		return -1;
+	}
+
+	memset(wanted, 0, sizeof(wanted));
+	dht_digest(d, leaves);
+	buckets = repair_walk(&s, id, leaves, wanted, &asked);
+	if (buckets > 0)
+		tuples = repair_pull(d, &s, id, wanted);
+	if (buckets > 0 && tuples != -1){
+		proto_msg push = {.op = OP_PULL, .id = id, .buckets = wanted};
+		sync_serve(d, &s, &push);
+	}
+	netclose(&s);
+	  assert_return(buckets == -1 || tuples == -1, 
+					"Repair with [%s]:%s failed", host, port);
+
+	info("Repair with [%s]:%s: %d node(s) compared, %d bucket(s) differ, "
+		 "%ld tuples pulled in %ld ms", host, port, asked, buckets, tuples, 
+		 now_ms() - start);
+	return tuples;
+}
+
+/**
+ * Un pair réparé périodiquement, cf sync_peer
+ */
+typedef struct s_sync_peer {
+	dht* d;
+	char* host;
+	char* port;
+	int period;
+} sync_peer_job;
+
+static void* peer_loop(void* param){
+	sync_peer_job* p = param;
+
+	while (!stopped()){
+		sync_repair(p->d, p->host, p->port);
+		// Attente par petits bouts, pour ne pas retarder sync_stop
+		for (int ms = 0; ms < p->period * 1000 && !stopped(); ms += 100)
+			usleep(100 * 1000);
+	}
+
+	free(p);
+	job_leave();
+	return NULL;
+}
+
+/**
+ * @brief Répare la DHT auprès d'un pair toutes les period secondes
+ * @details Dans un thread à part, arrêté par sync_stop (cf sync_repair).
+ *
+ * @param d DHT
+ * @param host pair (doit survivre au thread)
+ * @param port port du pair (idem)
+ * @param period secondes entre deux réparations
+ * @return 0 ou -1
+ */
+int sync_peer(dht* d, char* host, char* port, int period){
+	pthread_attr_t attr;
+	pthread_t thread;
+	sync_peer_job* p;
+	int tmp;
+
+	  assert_return(job_enter(0) == -1, "Sync stopped");
+	p = malloc(sizeof(*p));
+	if (p == NULL){
+		job_leave();
+		warn("malloc");
+		return -1;
+	}
+	p->d = d;
+	p->host = host;
+	p->port = port;
+	p->period = period;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	tmp = pthread_create(&thread, &attr, &peer_loop, p);
+	pthread_attr_destroy(&attr);
+	if (tmp != 0){
+		free(p);
+		job_leave();
+		warn("Can't start the repair thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Arrête les synchronisations en cours et les attend
+ * @details A appeler avant de libérer la DHT. Aucune nouvelle
+ * synchronisation ne sera servie ensuite.
+ */
+void sync_stop(void){
+	pthread_mutex_lock(&jobs_lock);
+	__atomic_store_n(&jobs_stop, true, __ATOMIC_RELAXED);
+	while (jobs_running > 0)
+		pthread_cond_wait(&jobs_done, &jobs_lock);
+	pthread_mutex_unlock(&jobs_lock);
+}
@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+#include "macros.h"
+#include "wal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Macros d'affichage.
+// Je relie chaque macro 'locale' à la macro 'réelle' prenant un argument
+// supplémentaire qui s'avère être extrêmement redondant (le nom de fichier...)
+#define FILE "[  WAL ]"
+#define info(...)          __info(FILE, __VA_ARGS__)
+#define success(...)       __success(FILE, __VA_ARGS__)
+#define warn(...)          __warn(FILE, __VA_ARGS__)
+#define check(...)         __check(FILE, __VA_ARGS__)
+#define err(...)           __err(FILE, __VA_ARGS__)
+#define assert(...)        __assert(FILE, __VA_ARGS__)
+#define assert_return(...) __assert_return(FILE, __VA_ARGS__)
+
+// Entête du corps d'un enregistrement: kfmt, afmt, klen, alen, time
+#define BODY_HEADER 12
+
+// Forme d'un champ (clé ou adresse) dans un enregistrement
+#define FIELD_RAW   0 // DHT_KEY_BIN ou DHT_ADDR_BIN octets
+#define FIELD_SHORT 1 // len octets
+#define FIELD_LONG  2 // longueur (32 bits, '\0' compris) puis c string
+
+static uint32_t fnv1a(const uint8_t* p, size_t len){
+	uint32_t sum = 2166136261u;
+
+	for (size_t i = 0; i < len; ++i){
+		sum ^= p[i];
+		sum *= 16777619u;
+	}
+
+	return sum;
+}
+
+static int key_form(uint8_t fmt){
+	switch (fmt){
+		case KEY_SHA256: return FIELD_RAW;
+		case KEY_SHORT:  return FIELD_SHORT;
+		case KEY_LONG:   return FIELD_LONG;
+		default:         return -1;
+	}
+}
+
+static int addr_form(uint8_t fmt){
+	switch (fmt){
+		case ADDR_V6:
+		case ADDR_V4:    return FIELD_RAW;
+		case ADDR_SHORT: return FIELD_SHORT;
+		case ADDR_LONG:  return FIELD_LONG;
+		default:         return -1;
+	}
+}
+
+/**
+ * @brief Taille d'un champ une fois écrit
+ */
+static size_t field_size(int form, const hkey* k, size_t bin){
+	switch (form){
+		case FIELD_RAW:   return bin;
+		case FIELD_SHORT: return k->len;
+		default:          return sizeof(uint32_t) + strlen(k->ext) + 1;
+	}
+}
+
+static uint8_t* field_put(uint8_t* p, int form, const hkey* k, size_t bin){
+	uint32_t n;
+
+	switch (form){
+		case FIELD_RAW:
+			memcpy(p, k->bin, bin);
+			return p + bin;
+		case FIELD_SHORT:
+			memcpy(p, k->bin, k->len);
+			return p + k->len;
+		default:
+			n = strlen(k->ext) + 1;
+			memcpy(p, &n, sizeof(n));
+			memcpy(p + sizeof(n), k->ext, n);
+			return p + sizeof(n) + n;
+	}
+}
+
+/**
+ * @brief Lit un champ d'un enregistrement dans k (déjà remis à zéro)
+ * @return 0, ou -1 si le champ dépasse du corps
+ */
+static int field_get(const uint8_t** p, const uint8_t* end, int form,
+					 size_t bin, hkey* k){
+	uint32_t n;
+
+	if (form != FIELD_LONG){
+		n = (form == FIELD_RAW) ? bin : k->len;
+		if (n > bin || (size_t)(end - *p) < n)
+			return -1;
+		memcpy(k->bin, *p, n);
+		*p += n;
+		return 0;
+	}
+
+	if ((size_t)(end - *p) < sizeof(n))
+		return -1;
+	memcpy(&n, *p, sizeof(n));
+	*p += sizeof(n);
+	if (n == 0 || (size_t)(end - *p) < n || (*p)[n-1] != '\0')
+		return -1;
+	// Pointe dans le segment projeté: la chaîne est copiée à l'ajout
+	k->ext = (char*)*p;
+	*p += n;
+	return 0;
+}
+
+/**
+ * @brief Décode le corps d'un enregistrement
+ * @return 0 ou -1 si le corps est invalide
+ */
+static int record_get(const uint8_t* p, const uint8_t* end, hkey* k, hkey* a,
+					  long* t){
+	int64_t time;
+	int kform, aform;
+
+	if (end - p < BODY_HEADER)
+		return -1;
+
+	memset(k, 0, sizeof(*k));
+	memset(a, 0, sizeof(*a));
+	k->fmt = p[0];
+	a->fmt = p[1];
+	k->len = p[2];
+	a->len = p[3];
+	memcpy(&time, p + 4, sizeof(time));
+	*t = time;
+	p += BODY_HEADER;
+
+	kform = key_form(k->fmt);
+	aform = addr_form(a->fmt);
+	if (kform == -1 || aform == -1 ||
+		field_get(&p, end, kform, DHT_KEY_BIN, k) == -1 ||
+		field_get(&p, end, aform, DHT_ADDR_BIN, a) == -1)
+		return -1;
+
+	dht_keycode(k);
+	return 0;
+}
+
+/**
+ * @brief Nom du segment id
+ */
+static int segment_path(wal* w, uint32_t id, char* buf, size_t size){
+	return snprintf(buf, size, "%s.%06u", w->prefix, id) >= (int)size ? -1 : 0;
+}
+
+/**
+ * @brief Segments existants, dans l'ordre (zéros en tête: l'ordre
+ * alphabétique de glob est l'ordre des numéros)
+ * @return 0 (g à libérer avec globfree) ou -1
+ */
+static int segment_list(wal* w, glob_t* g){
+	char pattern[PATH_MAX];
+	int tmp;
+
+	tmp = snprintf(pattern, sizeof(pattern), "%s.[0-9][0-9][0-9][0-9][0-9][0-9]",
+				   w->prefix);
+	  assert_return(tmp >= (int)sizeof(pattern), "WAL prefix too long");
+
+	tmp = glob(pattern, 0, NULL, g);
+	if (tmp == GLOB_NOMATCH){
+		g->gl_pathc = 0;
+		return 0;
+	}
+	  assert_return(tmp != 0, "glob %s", pattern);
+
+	return 0;
+}
+
+static uint32_t segment_id(wal* w, const char* path){
+	return strtoul(path + strlen(w->prefix) + 1, NULL, 10);
+}
+
+/**
+ * @brief Passe au segment id (créé vide)
+ * @details A appeler w->io pris, ou avant wal_start.
+ *
+ * @return 0 ou -1
+ */
+static int segment_open(wal* w, uint32_t id){
+	char path[PATH_MAX];
+	int fd;
+
+	  assert_return(segment_path(w, id, path, sizeof(path)) == -1,
+	                "WAL prefix too long");
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	  assert_return(fd == -1, "Can't open %s", path);
+
+	if (w->fd != -1)
+		close(w->fd);
+	w->fd = fd;
+	w->segment = id;
+	w->written = 0;
+
+	info("WAL segment %s", path);
+	return 0;
+}
+
+/**
+ * @brief Ecrit un lot d'enregistrements et le rend durable
+ * @details Un seul write et un seul fdatasync pour tout le lot. Les lots ne
+ * sont jamais coupés: un enregistrement est entier dans un segment.
+ */
+static void wal_write(wal* w, const uint8_t* p, size_t n){
+	size_t done = 0;
+	ssize_t tmp;
+
+	pthread_mutex_lock(&w->io);
+
+	while (done < n){
+		tmp = write(w->fd, p + done, n - done);
+		if (tmp == -1){
+			if (errno == EINTR)
+				continue;
+			warn("WAL write: %zu bytes lost", n - done);
+			break;
+		}
+		done += tmp;
+	}
+	if (fdatasync(w->fd) == -1)
+		warn("WAL fdatasync");
+
+	w->written += done;
+	if (w->written >= WAL_SEGMENT)
+		segment_open(w, w->segment + 1);
+
+	pthread_mutex_unlock(&w->io);
+}
+
+/**
+ * @brief Thread du journal: écrit le tampon toutes les w->interval
+ * millisecondes, ou dès qu'il est à moitié plein
+ * @details Les PUT remplissent l'autre tampon pendant l'écriture.
+ */
+static void* wal_loop(void* param){
+	wal* w = (wal*)param;
+	struct timespec deadline;
+	uint8_t* out;
+	size_t n;
+
+	pthread_mutex_lock(&w->lock);
+
+	while (true){
+		if (!w->stop && w->len < WAL_BUF/2){
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (long)w->interval * 1000000;
+			deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+		}
+
+		if (w->len == 0){
+			if (w->stop)
+				break;
+			continue;
+		}
+
+		out = w->buf;
+		n = w->len;
+		w->buf = w->spare;
+		w->spare = out;
+		w->len = 0;
+		pthread_cond_broadcast(&w->space);
+
+		pthread_mutex_unlock(&w->lock);
+		wal_write(w, out, n);
+		pthread_mutex_lock(&w->lock);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/**
+ * @brief Prépare le journal de préfixe 'prefix'
+ * @details Ne crée rien: les segments existants sont ceux d'une exécution
+ * précédente, à rejouer (cf wal_replay) avant wal_start.
+ *
+ * @param w journal
+ * @param prefix chemin des segments, sans le numéro
+ * @param interval millisecondes entre deux écritures groupées
+ * @return 0 ou -1
+ */
+int wal_open(wal* w, const char* prefix, int interval){
+	glob_t g;
+	uint32_t id;
+
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+	w->interval = (interval > 0) ? interval : WAL_INTERVAL;
+
+	w->prefix = strdup(prefix);
+	w->buf = malloc(WAL_BUF);
+	w->spare = malloc(WAL_BUF);
+	  assert_return(w->prefix == NULL || w->buf == NULL || w->spare == NULL,
+	                "malloc");
+
+	// Les nouveaux segments suivent les anciens
+	  assert_return(segment_list(w, &g) == -1, "Can't list WAL segments");
+	for (size_t i = 0; i < g.gl_pathc; ++i){
+		id = segment_id(w, g.gl_pathv[i]);
+		if (id > w->segment)
+			w->segment = id;
+	}
+	globfree(&g);
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_mutex_init(&w->io, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	pthread_cond_init(&w->space, NULL);
+
+	return 0;
+}
+
+/**
+ * @brief Rejoue les segments existants dans d, dans l'ordre
+ * @details Chaque segment est projeté en mémoire; les enregistrements déjà
+ * échus sont ignorés. A appeler avant de brancher le journal sur la DHT
+ * (d->wal), sinon le rejeu serait journalisé à nouveau.
+ *
+ * @param w journal ouvert (cf wal_open)
+ * @param d DHT, typiquement rechargée depuis le dernier instantané
+ * @return nombre d'enregistrements rejoués ou -1
+ */
+long wal_replay(wal* w, dht* d){
+	long replayed = 0, now = time(NULL);
+	const uint8_t* map;
+	const uint8_t* p;
+	const uint8_t* end;
+	struct stat st;
+	uint32_t len, sum;
+	hkey k, a;
+	long t;
+	glob_t g;
+	int fd;
+
+	  assert_return(segment_list(w, &g) == -1, "Can't list WAL segments");
+
+	for (size_t i = 0; i < g.gl_pathc; ++i){
+		fd = open(g.gl_pathv[i], O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0){
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED){
+			warn("mmap %s", g.gl_pathv[i]);
+			continue;
+		}
+		madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+		p = map;
+		end = map + st.st_size;
+		while (end - p >= WAL_RECORD_HEADER){
+			memcpy(&len, p, sizeof(len));
+			memcpy(&sum, p + sizeof(len), sizeof(sum));
+			p += WAL_RECORD_HEADER;
+
+			// Fin d'une écriture interrompue
+			if ((size_t)(end - p) < len || fnv1a(p, len) != sum ||
+				record_get(p, p + len, &k, &a, &t) == -1){
+				warn("WAL %s: torn record at %ld", g.gl_pathv[i],
+					 (long)(p - map) - WAL_RECORD_HEADER);
+				break;
+			}
+			p += len;
+
+			if (t + GARBAGE_COL_TIME < now)
+				continue;
+			if (dht_updatek(d, &k, &a, t) != -1)
+				replayed++;
+		}
+
+		munmap((void*)map, st.st_size);
+	}
+
+	info("Replayed %ld WAL records from %zu segment(s)", replayed,
+		 (size_t)g.gl_pathc);
+	globfree(&g);
+
+	return replayed;
+}
+
+/**
+ * @brief Ouvre un nouveau segment et lance le thread du journal
+ * @return 0 ou -1
+ */
+int wal_start(wal* w){
+	int tmp;
+
+	tmp = segment_open(w, w->segment + 1);
+	  assert_return(tmp == -1, "Can't start the WAL");
+
+	tmp = pthread_create(&w->thread, NULL, &wal_loop, w);
+	  assert_return(tmp != 0, "Can't create the WAL thread");
+
+	return 0;
+}
+
+/**
+ * @brief Journalise le PUT (k, a, t)
+ * @details Copie l'enregistrement dans le tampon, sans appel système; il
+ * sera écrit au prochain lot. N'attend que si les deux tampons sont pleins.
+ *
+ * @return 0 ou -1
+ */
+int wal_append(wal* w, const hkey* k, const hkey* a, long t){
+	int kform = key_form(k->fmt);
+	int aform = addr_form(a->fmt);
+	size_t body, rec;
+	uint8_t* p;
+	uint8_t* start;
+	int64_t time = t;
+	uint32_t len;
+
+	  assert_return(kform == -1 || aform == -1, "wal_append: bad format");
+
+	body = BODY_HEADER + field_size(kform, k, DHT_KEY_BIN) +
+	       field_size(aform, a, DHT_ADDR_BIN);
+	rec = WAL_RECORD_HEADER + body;
+	  assert_return(rec > WAL_BUF, "wal_append: record too large");
+
+	pthread_mutex_lock(&w->lock);
+
+	while (w->len + rec > WAL_BUF && !w->stop){
+		pthread_cond_signal(&w->cond);
+		pthread_cond_wait(&w->space, &w->lock);
+	}
+	if (w->stop){
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+
+	start = w->buf + w->len;
+	p = start + WAL_RECORD_HEADER;
+	p[0] = k->fmt;
+	p[1] = a->fmt;
+	p[2] = k->len;
+	p[3] = a->len;
+	memcpy(p + 4, &time, sizeof(time));
+	p = field_put(p + BODY_HEADER, kform, k, DHT_KEY_BIN);
+	p = field_put(p, aform, a, DHT_ADDR_BIN);
+
+	len = body;
+	memcpy(start, &len, sizeof(len));
+	len = fnv1a(start + WAL_RECORD_HEADER, body);
+	memcpy(start + sizeof(len), &len, sizeof(len));
+
+	w->len += rec;
+	if (w->len >= WAL_BUF/2)
+		pthread_cond_signal(&w->cond);
+
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/**
+ * @brief Point de reprise: instantané de la DHT puis purge du journal
+ * @details On passe d'abord à un nouveau segment: tout ce qui est dans les
+ * précédents a été appliqué à la DHT avant l'instantané (un PUT est
+ * journalisé sous le verrou de sa partition, après modification). Une fois
+ * l'instantané écrit, ces segments ne servent plus.
+ *
+ * Les enregistrements encore en tampon partent dans le nouveau segment: au
+ * pire ils seront rejoués sur un instantané qui les contient déjà, ce qui
+ * ne change rien.
+ *
+ * @param w journal démarré (cf wal_start)
+ * @param d DHT
+ * @param snapshot fichier de l'instantané (cf dht_save)
+ * @return 0 ou -1 (le journal est alors gardé en entier)
+ */
+int wal_checkpoint(wal* w, dht* d, const char* snapshot){
+	uint32_t keep;
+	glob_t g;
+	int tmp;
+
+	pthread_mutex_lock(&w->io);
+	tmp = segment_open(w, w->segment + 1);
+	keep = w->segment;
+	pthread_mutex_unlock(&w->io);
+	  assert_return(tmp == -1, "Can't rotate the WAL");
+
+	  assert_return(dht_save(d, snapshot) == -1, "Checkpoint failed");
+
+	  assert_return(segment_list(w, &g) == -1, "Can't list WAL segments");
+	for (size_t i = 0; i < g.gl_pathc; ++i){
+		if (segment_id(w, g.gl_pathv[i]) < keep)
+			unlink(g.gl_pathv[i]);
+	}
+	globfree(&g);
+
+	return 0;
+}
+
+/**
+ * @brief Ecrit ce qui reste en tampon, arrête le thread et ferme le journal
+ */
+void wal_close(wal* w){
+	if (w->fd != -1){
+		pthread_mutex_lock(&w->lock);
+		w->stop = true;
+		pthread_cond_broadcast(&w->cond);
+		pthread_cond_broadcast(&w->space);
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_join(w->thread, NULL);
+		close(w->fd);
+		w->fd = -1;
+	}
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_mutex_destroy(&w->io);
+	pthread_cond_destroy(&w->cond);
+	pthread_cond_destroy(&w->space);
+	free(w->buf);
+	free(w->spare);
+	free(w->prefix);
+	w->buf = w->spare = NULL;
+	w->prefix = NULL;
+}
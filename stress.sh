@@ -0,0 +1,130 @@
+#!/bin/bash
+# Stress des lectures sans verrou (dht_read_begin, limbo) face à l'expiration,
+# au compactage et au rétrécissement de la table (entry_move, shard_shrink).
+#
+# STREAMS clients --batch envoient en parallèle des put/get sur leurs propres
+# clés à un serveur --threads 4, pendant que des vagues de kktakethis déjà
+# presque échus font grossir la table puis expirer, compacter et rétrécir ses
+# partitions à chaque passage du garbage collector.
+#
+# Chaque clé reçoit deux adresses connues: un GET ne doit jamais renvoyer
+# autre chose, et à la fin chaque clé doit avoir exactement les deux.
+#
+# A lancer aussi sur un serveur instrumenté:
+#   make clean; make server client CC="gcc -g -fsanitize=thread"
+#   ./stress.sh
+# ou sous valgrind: SERVER="valgrind --error-exitcode=1 ./server.out" ./stress.sh
+
+SERVER=${SERVER:-./server.out}
+PORT=${PORT:-9292}
+THREADS=${THREADS:-4}
+STREAMS=${STREAMS:-4}
+KEYS=${KEYS:-1000}
+DURATION=${DURATION:-15}
+WAVE=${WAVE:-40000}
+# Doit valoir GARBAGE_COL_TIME (cf dht.h)
+EXPIRY=${EXPIRY:-300}
+
+DIR=$(mktemp -d)
+FAILED=0
+
+fail(){
+	echo "ÉCHEC: $*"
+	FAILED=1
+}
+
+key(){ printf '%08x%056x' $1 $2; }
+
+echo "Lancement du serveur ($THREADS threads)."
+$SERVER '::1' $PORT --threads $THREADS > $DIR/server.log 2>&1 &
+SP=$!
+sleep 1
+if ! kill -0 $SP 2>/dev/null; then
+	cat $DIR/server.log
+	exit 1
+fi
+
+# Commandes de chaque flux et adresses attendues de chaque clé
+for s in $(seq 1 $STREAMS); do
+	awk -v s=$s -v n=$KEYS 'BEGIN {
+		for (j = 1; j <= n; ++j) {
+			k = sprintf("%08x%056x", s, j)
+			a = sprintf("10.%d.%d.%d", s, int(j/256), j%256)
+			b = sprintf("fd00::%x:%x", s, j)
+			printf "put %s %s\nput %s %s\n", k, a, k, b > "'$DIR'/put." s
+			if (j > 16)
+				printf "get %s\n", sprintf("%08x%056x", s, j-16) > "'$DIR'/put." s
+			printf "get %s\n", k > "'$DIR'/get." s
+			printf "%s %s\n%s %s\n", k, a, k, b > "'$DIR'/expected." s
+		}
+	}'
+done
+sort -u $DIR/expected.* > $DIR/expected
+
+# Vagues de clés qui expirent une ou deux secondes après leur ajout: la
+# table grossit, puis une fois vidée et compactée elle rétrécit pendant la pause
+waves(){
+	local w=0
+	exec 3>/dev/udp/::1/$PORT
+	while [ ! -e $DIR/stop ]; do
+		w=$((w + 1))
+		local t=$(( $(date +%s) - EXPIRY + 1 ))
+		for ((j = 1; j <= WAVE; ++j)); do
+			printf 'kktakethis %08x%056x 10.255.%d.%d %d' $((0x80000000 + w)) $j \
+				$((j / 256 % 256)) $((j % 256)) $t >&3
+		done
+		sleep 4
+	done
+	exec 3>&-
+	echo $w > $DIR/waves
+}
+waves &
+WP=$!
+
+echo "$STREAMS flux de $KEYS clés pendant $DURATION s."
+r=0
+END=$((SECONDS + DURATION))
+while [ $SECONDS -lt $END ]; do
+	r=$((r + 1))
+	for s in $(seq 1 $STREAMS); do
+		./client.out '::1' $PORT --batch $DIR/put.$s > $DIR/out.$s.$r 2>&1 &
+		PID[$s]=$!
+	done
+	for s in $(seq 1 $STREAMS); do
+		wait ${PID[$s]} || fail "tour $r, flux $s: requêtes sans réponse"
+	done
+done
+
+touch $DIR/stop
+wait $WP
+echo "$r tours, $(cat $DIR/waves) vagues de $WAVE clés expirées."
+
+# Un GET concurrent peut manquer une adresse, jamais en inventer une
+cat $DIR/out.* | grep -v ' (null)$' | sort -u > $DIR/seen
+BAD=$(comm -23 $DIR/seen $DIR/expected | wc -l)
+[ $BAD -eq 0 ] || fail "$BAD adresses inattendues, dont: $(comm -23 $DIR/seen $DIR/expected | head -3)"
+
+# Toutes les écritures sont acquittées: chaque clé a ses deux adresses
+for s in $(seq 1 $STREAMS); do
+	./client.out '::1' $PORT --batch $DIR/get.$s > $DIR/final.$s 2>/dev/null
+done
+sort -u $DIR/final.* > $DIR/final
+cmp -s $DIR/final $DIR/expected || \
+	fail "contenu final différent: $(diff $DIR/final $DIR/expected | grep -c '^[<>]') lignes"
+
+# Et les clés des vagues ont bien expiré
+sleep 3
+printf 'get %s\n' $(key $((0x80000001)) 1) $(key $((0x80000001)) $WAVE) | \
+	./client.out '::1' $PORT --batch > $DIR/expired 2>/dev/null
+[ $(grep -c ' (null)$' $DIR/expired) -eq 2 ] || fail "clés expirées encore présentes"
+
+kill -0 $SP 2>/dev/null || fail "le serveur s'est arrêté"
+kill $SP; wait $SP
+grep -q -e 'ThreadSanitizer' -e 'AddressSanitizer' -e 'ERROR SUMMARY: [1-9]' $DIR/server.log && \
+	fail "rapport de l'outil d'analyse: $DIR/server.log"
+
+if [ $FAILED -eq 0 ]; then
+	echo "OK"
+	rm -r $DIR
+fi
+exit $FAILED